@@ -27,10 +27,12 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -38,7 +40,9 @@
 #include "api.h"
 #include "daemon.h"
 #include "errors.h"
+#include "eventloop.h"
 #include "frame.h"
+#include "internal.h"
 #include "objects.h"
 #include "ponames.h"
 #include "utils.h"
@@ -68,6 +72,10 @@
         bw2_appendKV(REQPTR, &expiry); \
     }
 
+#define BW2_REQUEST_SET_DEADLINE(PARAMPTR, RCTXPTR) \
+    (RCTXPTR)->timeout = (PARAMPTR)->timeout; \
+    (RCTXPTR)->cancel = (PARAMPTR)->cancel;
+
 #define BW2_REQUEST_ADD_URI(PARAMPTR, REQPTR) \
     struct bw2_header uri; \
     bw2_KVInit(&uri, "uri", (PARAMPTR)->uri, 0); \
@@ -200,9 +208,33 @@ int bw2_clientInit(struct bw2_client* client) {
     if (rv != 0) {
         goto error3;
     }
+    rv = bw2_mutexInit(&client->sharedlock);
+    if (rv != 0) {
+        goto error4;
+    }
+    rv = bw2_condInit(&client->reconnectwake);
+    if (rv != 0) {
+        goto error5;
+    }
+    rv = bw2_chainCacheInit(&client->chaincache, &client->allocator);
+    if (rv != 0) {
+        goto error6;
+    }
+    bw2_reqctxInit(&client->replayEntityReqctx, NULL, NULL);
+    client->timerfd = -1;
+    client->timerfdExpiry = 0;
+    client->batches = NULL;
+    client->framepool.allocator = &client->allocator;
+    bw2_timerWheelInit(&client->timers, bw2_getTimeMicros() / 1000);
 
     return 0;
 
+error6:
+    bw2_condDestroy(&client->reconnectwake);
+error5:
+    bw2_mutexDestroy(&client->sharedlock);
+error4:
+    bw2_mutexDestroy(&client->seqnolock);
 error3:
     bw2_mutexDestroy(&client->reqslock);
 error2:
@@ -239,7 +271,7 @@ void* _bw2_daemon_trampoline(void* arg) {
     } else {
         /* No heap was provided, so we fall back to malloc. */
         frameheap = NULL;
-        free(info);
+        bw2_allocatorFree(&client->allocator, BW2_ALLOC_DAEMON, info);
     }
 
     bw2_daemon(client, frameheap, heapsize);
@@ -247,7 +279,11 @@ void* _bw2_daemon_trampoline(void* arg) {
     return NULL;
 }
 
-int bw2_connect(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* threadstack, size_t stacksize) {
+/* Opens a connection to the agent and reads its HELLO frame, but does not
+ * start reading frames after that. On success, the socket is stored in the
+ * client.
+ */
+int _bw2_connectHandshake(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize) {
     int sock = socket(addr->sa_family, SOCK_STREAM, 0);
     if (sock == -1) {
         return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
@@ -259,62 +295,274 @@ int bw2_connect(struct bw2_client* client, const struct sockaddr* addr, socklen_
         goto closeanderror;
     }
 
+    bw2_mutexLock(&client->outlock);
     client->connfd = sock;
+    bw2_mutexUnlock(&client->outlock);
 
     struct bw2_frame frame;
 
-    rv = bw2_readFrame(&frame, frameheap, heapsize, sock);
+    struct bw2_frameAlloc alloc;
+    _bw2_clientFrameAlloc(client, &alloc, frameheap, heapsize);
+    rv = bw2_readFrameAlloc(&frame, &alloc, sock);
     if (rv != 0) {
         goto closeanderror;
     }
 
     if (memcmp(frame.cmd, BW2_FRAME_CMD_HELLO, 4) != 0) {
         rv = BW2_ERROR_UNEXPECTED_FRAME;
-        goto closeanderror;
+        goto freeandclose;
     }
 
     struct bw2_header* versionhdr = bw2_getFirstHeader(&frame, "version");
     if (versionhdr == NULL) {
         rv = BW2_ERROR_MISSING_HEADER;
-        goto closeanderror;
+        goto freeandclose;
     }
 
     bw2_logf("Connected to BOSSWAVE router version %.*s\n", (int) versionhdr->len, versionhdr->value);
 
     if (frameheap == NULL) {
-        /* The frame was actually malloc'd, so we need to free it... */
-        bw2_frameFreeResources(&frame);
+        /* The frame was actually taken from the pool, so we need to free it... */
+        bw2_frameFreeToPool(&frame, &client->framepool);
+    }
+
+    return 0;
+
+freeandclose:
+    if (frameheap == NULL) {
+        bw2_frameFreeToPool(&frame, &client->framepool);
+    }
+closeanderror:
+    close(sock);
+    return rv;
+}
+
+int bw2_connect(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* threadstack, size_t stacksize) {
+    struct bw2_threadAttrs attrs;
+    memset(&attrs, 0x00, sizeof(attrs));
+    attrs.stack = threadstack;
+    attrs.stacksize = stacksize;
+    return bw2_connectWithAttrs(client, addr, addrlen, frameheap, heapsize, &attrs);
+}
+
+int bw2_connectWithAttrs(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, struct bw2_threadAttrs* attrs) {
+    if (addrlen > sizeof(client->addr)) {
+        return BW2_ERROR_BAD_ARG;
+    }
+
+    int rv = _bw2_connectHandshake(client, addr, addrlen, frameheap, heapsize);
+    if (rv != 0) {
+        return rv;
     }
 
+    /* Remembered in case the client has to reconnect. */
+    memcpy(&client->addr, addr, addrlen);
+    client->addrlen = addrlen;
+    client->closing = false;
+
     struct bw2_daemon_info* dargs;
     if (frameheap != NULL) {
         dargs = (struct bw2_daemon_info*) frameheap;
         dargs->has_heap = true;
     } else {
-        dargs = malloc(sizeof(struct bw2_daemon_info));
+        dargs = bw2_allocatorAlloc(&client->allocator, BW2_ALLOC_DAEMON, sizeof(struct bw2_daemon_info));
+        if (dargs == NULL) {
+            close(client->connfd);
+            return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        }
         dargs->has_heap = false;
     }
     dargs->client = client;
     dargs->heapsize = heapsize;
 
-    rv = bw2_threadCreate(threadstack, stacksize, _bw2_daemon_trampoline, dargs, NULL);
+    rv = bw2_threadCreateWithAttrs(attrs, _bw2_daemon_trampoline, dargs, NULL);
     if (rv != 0) {
-        goto closeanderror;
+        if (frameheap == NULL) {
+            bw2_allocatorFree(&client->allocator, BW2_ALLOC_DAEMON, dargs);
+        }
+        close(client->connfd);
+        return rv;
+    }
+
+    client->connected = true;
+
+    return 0;
+}
+
+/* Sets up the client's receive buffer, for clients that read frames with
+ * bw2_processIncoming rather than on a BOSSWAVE thread.
+ */
+int _bw2_initIncoming(struct bw2_client* client, char* frameheap, size_t heapsize, char* rxbuf, size_t rxbufsize) {
+    if (rxbuf == NULL) {
+        rxbufsize = BW2_MAX(rxbufsize, BW2_RXBUF_INITIAL_SIZE);
+        rxbuf = bw2_allocatorAlloc(&client->allocator, BW2_ALLOC_RXBUF, rxbufsize);
+        if (rxbuf == NULL) {
+            return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        }
+        client->rxbufmalloced = true;
+    } else {
+        client->rxbufmalloced = false;
+    }
+
+    client->frameheap = frameheap;
+    client->heapsize = heapsize;
+    client->rxbuf = rxbuf;
+    client->rxbufsize = rxbufsize;
+    client->rxstart = 0;
+    client->rxlen = 0;
+    memset(&client->rxscan, 0x00, sizeof(client->rxscan));
+
+    return 0;
+}
+
+int bw2_connectThreadless(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* rxbuf, size_t rxbufsize) {
+    int rv = _bw2_initIncoming(client, frameheap, heapsize, rxbuf, rxbufsize);
+    if (rv != 0) {
+        return rv;
+    }
+
+    rv = _bw2_connectHandshake(client, addr, addrlen, frameheap, heapsize);
+    if (rv != 0) {
+        if (client->rxbufmalloced) {
+            bw2_allocatorFree(&client->allocator, BW2_ALLOC_RXBUF, client->rxbuf);
+            client->rxbufmalloced = false;
+        }
+        client->rxbuf = NULL;
+        return rv;
+    }
+
+    client->connected = true;
+
+    return 0;
+}
+
+int bw2_getConnectionFd(struct bw2_client* client) {
+    int fd;
+    bw2_mutexLock(&client->outlock);
+    fd = client->connected ? client->connfd : -1;
+    bw2_mutexUnlock(&client->outlock);
+    return fd;
+}
+
+#if (BW2_OS == LINUX)
+
+int bw2_connectEventLoop(struct bw2_client* client, struct bw2_eventLoop* loop, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* rxbuf, size_t rxbufsize) {
+    int rv = _bw2_initIncoming(client, frameheap, heapsize, rxbuf, rxbufsize);
+    if (rv != 0) {
+        return rv;
+    }
+
+    rv = _bw2_connectHandshake(client, addr, addrlen, frameheap, heapsize);
+    if (rv != 0) {
+        goto freeanderror;
     }
 
     client->connected = true;
 
+    rv = bw2_eventLoopAdd(loop, client);
+    if (rv != 0) {
+        client->connected = false;
+        close(client->connfd);
+        goto freeanderror;
+    }
+
+    return 0;
+
+freeanderror:
+    if (client->rxbufmalloced) {
+        bw2_allocatorFree(&client->allocator, BW2_ALLOC_RXBUF, client->rxbuf);
+        client->rxbufmalloced = false;
+    }
+    client->rxbuf = NULL;
+    return rv;
+}
+
+/* Adds DELTA to a statistic that is read by other threads. */
+void _bw2_busyPollCount(uint64_t* stat, uint64_t delta) {
+    __atomic_store_n(stat, *stat + delta, __ATOMIC_RELAXED);
+}
+
+/* Reads frames for CLIENT without ever blocking, until the connection is
+ * lost or closed.
+ */
+void* _bw2_busyPoll_trampoline(void* arg) {
+    struct bw2_client* client = arg;
+    struct bw2_busyPollStats* stats = &client->busypoll;
+    uint64_t last = bw2_getTimeMicros();
+    int rv;
+
+    do {
+        size_t handled;
+        rv = bw2_processIncoming(client, BW2_BUSYPOLL_FRAME_BUDGET, &handled);
+
+        uint64_t now = bw2_getTimeMicros();
+        _bw2_busyPollCount(&stats->polls, 1);
+        if (handled == 0) {
+            _bw2_busyPollCount(&stats->idlePolls, 1);
+            _bw2_busyPollCount(&stats->idleMicros, now - last);
+            bw2_cpuRelax();
+        } else {
+            _bw2_busyPollCount(&stats->frames, handled);
+            _bw2_busyPollCount(&stats->busyMicros, now - last);
+        }
+        last = now;
+    } while (rv == 0);
+
+    return NULL;
+}
+
+int bw2_connectBusyPoll(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* rxbuf, size_t rxbufsize, struct bw2_busyPollParams* params) {
+    int rv = bw2_connectThreadless(client, addr, addrlen, frameheap, heapsize, rxbuf, rxbufsize);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (params->socketBusyPollMicros != 0) {
+        int busypoll = (int) params->socketBusyPollMicros;
+        if (setsockopt(client->connfd, SOL_SOCKET, SO_BUSY_POLL, &busypoll, sizeof(busypoll)) != 0) {
+            rv = BW2_ERROR_OPERATION_NOT_SUPPORTED;
+            goto closeanderror;
+        }
+    }
+
+    memset(&client->busypoll, 0x00, sizeof(struct bw2_busyPollStats));
+    rv = bw2_threadCreateWithAttrs(&params->thread, _bw2_busyPoll_trampoline, client, NULL);
+    if (rv != 0) {
+        goto closeanderror;
+    }
+
     return 0;
 
 closeanderror:
-    close(sock);
+    client->connected = false;
+    close(client->connfd);
+    if (client->rxbufmalloced) {
+        bw2_allocatorFree(&client->allocator, BW2_ALLOC_RXBUF, client->rxbuf);
+        client->rxbufmalloced = false;
+    }
+    client->rxbuf = NULL;
     return rv;
 }
 
+void bw2_busyPollStats(struct bw2_client* client, struct bw2_busyPollStats* stats) {
+    stats->polls = __atomic_load_n(&client->busypoll.polls, __ATOMIC_RELAXED);
+    stats->idlePolls = __atomic_load_n(&client->busypoll.idlePolls, __ATOMIC_RELAXED);
+    stats->frames = __atomic_load_n(&client->busypoll.frames, __ATOMIC_RELAXED);
+    stats->busyMicros = __atomic_load_n(&client->busypoll.busyMicros, __ATOMIC_RELAXED);
+    stats->idleMicros = __atomic_load_n(&client->busypoll.idleMicros, __ATOMIC_RELAXED);
+}
+
+#endif
+
 int bw2_disconnect(struct bw2_client* client) {
     bw2_mutexLock(&client->outlock);
+    client->closing = true;
+    bw2_condBroadcast(&client->reconnectwake);
     if (client->connected) {
         client->connected = false;
+
+        /* Wake up the BOSSWAVE thread if it is blocked reading a frame. */
+        shutdown(client->connfd, SHUT_RDWR);
         close(client->connfd);
     }
     bw2_mutexUnlock(&client->outlock);
@@ -334,19 +582,218 @@ bool _bw2_simpleReq_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* r
     return true;
 }
 
+struct bw2_autoPAC_ctx {
+    struct bw2_reqctx done;
+    struct bw2_dotChainHash* pac;
+    bool found;
+};
+
+bool _bw2_autoPAC_cb(struct bw2_simpleChain* sc, bool final, int error, union bw2_userctx ctx) {
+    (void) error;
+
+    struct bw2_autoPAC_ctx* actx = ctx.ptr;
+    if (sc != NULL && !actx->found) {
+        bw2_dotChainHash_set(actx->pac, sc->hash, sc->hash_len);
+        actx->found = true;
+    }
+    if (final) {
+        bw2_reqctxSignal(&actx->done);
+    }
+    return false;
+}
+
+/* Sets PAC to the first chain in the chain cache that grants PERMISSIONS on
+ * URI to the client's entity. If there is none and RESOLVE is set, the chains
+ * are built first, which blocks until the agent has sent all of them. Returns
+ * false if autoPAC is disabled or no chain was found.
+ */
+bool _bw2_autoPAC(struct bw2_client* client, char* uri, char* permissions, bool resolve, uint64_t timeout, struct bw2_cancelToken* cancel, struct bw2_dotChainHash* pac) {
+    struct bw2_vkHash to;
+    bw2_mutexLock(&client->reqslock);
+    bool enabled = client->autopac && client->entityvk.vkhashlen != 0;
+    memcpy(&to, &client->entityvk, sizeof(struct bw2_vkHash));
+    bw2_mutexUnlock(&client->reqslock);
+    if (!enabled) {
+        return false;
+    }
+
+    struct bw2_buildChainParams bp;
+    memset(&bp, 0x00, sizeof(bp));
+    bp.uri = uri;
+    bp.accessPermissions = permissions;
+    bp.to = &to;
+    bp.timeout = timeout;
+    bp.cancel = cancel;
+
+    struct bw2_chainCacheKey key;
+    _bw2_chainCacheKeyFromParams(&bp, &key);
+    struct bw2_chainCacheEntry* entry = bw2_chainCacheLookup(&client->chaincache, &key);
+    if (entry != NULL) {
+        struct bw2_simpleChain sc;
+        bw2_chainCacheGetChain(entry, 0, &sc);
+        bw2_dotChainHash_set(pac, sc.hash, sc.hash_len);
+        bw2_chainCacheRelease(&client->chaincache, entry);
+        return true;
+    }
+    if (!resolve) {
+        return false;
+    }
+
+    struct bw2_autoPAC_ctx actx;
+    struct bw2_simplechain_ctx scctx;
+    bw2_reqctxInit(&actx.done, NULL, NULL);
+    actx.pac = pac;
+    actx.found = false;
+    scctx.on_chain = _bw2_autoPAC_cb;
+    scctx.ctx.ptr = &actx;
+    if (_bw2_buildChainUncached(client, &bp, &scctx) == 0) {
+        bw2_reqctxWait(&actx.done);
+    }
+    bw2_reqctxDestroy(&actx.done);
+    return actx.found;
+}
+
+/* Whether the reason given in the failed response FRAME says that the agent
+ * could not verify the DOT chain used for the request, or that it has expired
+ * or been revoked, rather than that the request failed for some other reason.
+ */
+bool _bw2_responseBlamesChain(struct bw2_frame* frame) {
+    static const char* const keywords[] = { "chain", "dot", "expire", "revoke", "permission" };
+    struct bw2_header* reasonhdr;
+    size_t i;
+    size_t j;
+
+    if (frame == NULL || (reasonhdr = bw2_getFirstHeader(frame, "reason")) == NULL) {
+        return false;
+    }
+    for (i = 0; i != sizeof(keywords) / sizeof(keywords[0]); i++) {
+        size_t keylen = strlen(keywords[i]);
+        for (j = 0; j + keylen <= reasonhdr->len; j++) {
+            if (strncasecmp(&reasonhdr->value[j], keywords[i], keylen) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Called with the client's reqslock held, once the agent has answered a
+ * request made with the resolved PAC. A PAC that the agent rejected is
+ * forgotten, so that it is resolved again, and true is returned; requests
+ * that failed for other reasons are not retried.
+ */
+bool _bw2_autoPACResult(struct bw2_client* client, struct bw2_frame* frame, struct bw2_hash* pac, int rv) {
+    if (rv == BW2_ERROR_RESPONSE_STATUS && _bw2_responseBlamesChain(frame)) {
+        bw2_chainCacheInvalidateChain(&client->chaincache, pac);
+        return true;
+    }
+    return false;
+}
+
+bool _bw2_publishPAC_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    (void) final;
+
+    struct bw2_completion* completion = ctx;
+    if (frame != NULL) {
+        rctx->rv = bw2_frameMustResponse(frame);
+    }
+    completion->pacRejected = _bw2_autoPACResult(rctx->client, frame, &completion->pac, rctx->rv);
+
+    bw2_reqctxSignal(rctx);
+
+    return true;
+}
+
+void _bw2_completionSignalled(void* ctx) {
+    struct bw2_completion* completion = ctx;
+    completion->on_complete(completion, completion->ctx);
+}
+
+/* Makes COMPLETION finish once RCTX, which must already be initialized, is
+ * signalled. Without an ON_COMPLETE function, the completion may be released
+ * as soon as RCTX is signalled, so nothing is called afterwards.
+ */
+void _bw2_completionInit(struct bw2_client* client, struct bw2_completion* completion, struct bw2_reqctx* rctx) {
+    completion->client = client;
+    completion->rctx = rctx;
+    completion->entity = NULL;
+    completion->replay = NULL;
+    completion->pacResolved = false;
+    completion->pacRejected = false;
+    if (completion->on_complete != NULL) {
+        rctx->onsignal = _bw2_completionSignalled;
+        rctx->onsignalctx = completion;
+    }
+}
+
+/* Finishes COMPLETION with an error, without sending a request. This runs on
+ * the calling thread, so the client's reqslock is taken to disarm the request
+ * context before it is signalled.
+ */
+int _bw2_completionFail(struct bw2_completion* completion, int rv) {
+    struct bw2_client* client = completion->client;
+    bw2_allocatorFree(&client->allocator, BW2_ALLOC_ENTITY, completion->entity);
+    completion->entity = NULL;
+    completion->rctx->rv = rv;
+
+    bw2_mutexLock(&client->reqslock);
+    _bw2_reqctxDisarm(completion->rctx);
+    bw2_mutexUnlock(&client->reqslock);
+    bw2_reqctxSignal(completion->rctx);
+    return rv;
+}
+
+/* Sends REQ for a request made with one of the *Async functions. If it could
+ * not be sent, the completion is finished with the error straight away.
+ */
+int _bw2_completionStart(struct bw2_client* client, struct bw2_frame* req, struct bw2_completion* completion) {
+    int rv = bw2_transact(client, req, completion->rctx);
+    if (rv != 0) {
+        _bw2_completionFail(completion, rv);
+    }
+    return rv;
+}
+
 bool _bw2_setEntity_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
     (void) final;
 
+    struct bw2_completion* completion = ctx;
+
     if (frame != NULL) {
-        struct bw2_vkHash* vkhash = ctx;
+        struct bw2_vkHash* vkhash = completion->out.vkhash;
+        struct bw2_header* vkhdr = bw2_getFirstHeader(frame, "vk");
 
-        if (vkhash != NULL) {
-            struct bw2_header* vkhdr = bw2_getFirstHeader(frame, "vk");
+        if (vkhash != NULL && vkhdr != NULL) {
+            bw2_vkHash_set(vkhash, vkhdr->value, vkhdr->len);
+        }
+        rctx->rv = bw2_frameMustResponse(frame);
+
+        /* PACs are resolved for this entity from now on. */
+        if (rctx->rv == 0) {
             if (vkhdr != NULL) {
-                bw2_vkHash_set(vkhash, vkhdr->value, vkhdr->len);
+                bw2_vkHash_set(&rctx->client->entityvk, vkhdr->value, vkhdr->len);
+            } else {
+                rctx->client->entityvk.vkhashlen = 0;
             }
         }
-        rctx->rv = bw2_frameMustResponse(frame);
+    }
+
+    /* Remember the entity, so that it can be set again after reconnecting.
+     * The client's reqslock is held here.
+     */
+    struct bw2_allocator* allocator = &completion->client->allocator;
+    if (rctx->rv == 0 && completion->entity != NULL) {
+        bw2_allocatorFree(allocator, BW2_ALLOC_ENTITY, rctx->client->entity);
+        rctx->client->entity = completion->entity;
+        rctx->client->entitylen = completion->entitylen;
+        completion->entity = NULL;
+    }
+    bw2_allocatorFree(allocator, BW2_ALLOC_ENTITY, completion->entity);
+    completion->entity = NULL;
+
+    /* Chains built for the previous entity no longer apply. */
+    if (rctx->rv == 0) {
+        bw2_chainCacheInvalidate(&completion->client->chaincache, NULL);
     }
 
     bw2_reqctxSignal(rctx);
@@ -354,7 +801,7 @@ bool _bw2_setEntity_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* r
     return true;
 }
 
-int bw2_setEntity(struct bw2_client* client, char* entity, size_t entitylen, struct bw2_vkHash* vkhash) {
+int bw2_setEntityAsync(struct bw2_client* client, char* entity, size_t entitylen, struct bw2_vkHash* vkhash, struct bw2_completion* completion) {
     struct bw2_frame req;
     bw2_frameInit(&req, BW2_FRAME_CMD_SET_ENTITY, _bw2_getSeqNo(client));
 
@@ -362,23 +809,40 @@ int bw2_setEntity(struct bw2_client* client, char* entity, size_t entitylen, str
     bw2_POInit(&po, BW2_PO_NUM_ROENTITYWKEY, entity, entitylen);
     bw2_appendPO(&req, &po);
 
-    struct bw2_reqctx reqctx;
-    bw2_reqctxInit(&reqctx, _bw2_setEntity_cb, vkhash);
-
-    int rv = bw2_transact(client, &req, &reqctx);
-    if (rv != 0) {
-        goto done;
+    completion->out.vkhash = vkhash;
+    bw2_reqctxInit(&completion->reqctx, _bw2_setEntity_cb, completion);
+    _bw2_completionInit(client, completion, &completion->reqctx);
+    if (client->reconnect.enabled) {
+        completion->entity = bw2_allocatorAlloc(&client->allocator, BW2_ALLOC_ENTITY, entitylen);
+        if (completion->entity != NULL) {
+            memcpy(completion->entity, entity, entitylen);
+            completion->entitylen = entitylen;
+        }
     }
 
-    bw2_reqctxWait(&reqctx);
-    rv = reqctx.rv;
+    return _bw2_completionStart(client, &req, completion);
+}
 
-done:
-    bw2_reqctxDestroy(&reqctx);
-    return rv;
+int bw2_setEntity(struct bw2_client* client, char* entity, size_t entitylen, struct bw2_vkHash* vkhash) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    bw2_setEntityAsync(client, entity, entitylen, vkhash, &completion);
+    return bw2_wait(&completion);
 }
 
-int bw2_publish(struct bw2_client* client, struct bw2_publishParams* p) {
+int _bw2_publishAsync(struct bw2_client* client, struct bw2_publishParams* p, struct bw2_completion* completion, bool resolve) {
+    struct bw2_publishParams resolved;
+    struct bw2_dotChainHash resolvedpac;
+    bool pacResolved = false;
+    if (p->autochain && p->primaryAccessChain == NULL
+        && _bw2_autoPAC(client, p->uri, "P", resolve, p->timeout, p->cancel, &resolvedpac)) {
+        memcpy(&resolved, p, sizeof(struct bw2_publishParams));
+        resolved.autochain = false;
+        resolved.primaryAccessChain = &resolvedpac;
+        p = &resolved;
+        pacResolved = true;
+    }
+
     struct bw2_frame req;
     if (p->persist) {
         bw2_frameInit(&req, BW2_FRAME_CMD_PERSIST, _bw2_getSeqNo(client));
@@ -396,41 +860,60 @@ int bw2_publish(struct bw2_client* client, struct bw2_publishParams* p) {
     BW2_REQUEST_ADD_VERIFY(p, &req)
     BW2_REQUEST_ADD_PERSIST(p, &req)
 
-    struct bw2_reqctx reqctx;
-    bw2_reqctxInit(&reqctx, _bw2_simpleReq_cb, NULL);
-
-    int rv = bw2_transact(client, &req, &reqctx);
-    if (rv != 0) {
-        goto done;
+    bw2_reqctxInit(&completion->reqctx, _bw2_simpleReq_cb, NULL);
+    _bw2_completionInit(client, completion, &completion->reqctx);
+    BW2_REQUEST_SET_DEADLINE(p, &completion->reqctx)
+    if (pacResolved && bw2_dotChainHash_toBinary(&resolvedpac, &completion->pac) == 0) {
+        completion->pacResolved = true;
+        completion->reqctx.onframe = _bw2_publishPAC_cb;
+        completion->reqctx.ctx = completion;
     }
 
-    bw2_reqctxWait(&reqctx);
-    rv = reqctx.rv;
+    return _bw2_completionStart(client, &req, completion);
+}
+
+int bw2_publishAsync(struct bw2_client* client, struct bw2_publishParams* p, struct bw2_completion* completion) {
+    return _bw2_publishAsync(client, p, completion, false);
+}
 
-done:
-    bw2_reqctxDestroy(&reqctx);
+int bw2_publish(struct bw2_client* client, struct bw2_publishParams* p) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    _bw2_publishAsync(client, p, &completion, true);
+    int rv = bw2_wait(&completion);
+
+    /* If the agent rejected a resolved PAC, it has been forgotten; try once
+     * more with a newly resolved one.
+     */
+    if (rv == BW2_ERROR_RESPONSE_STATUS && completion.pacRejected) {
+        _bw2_publishAsync(client, p, &completion, true);
+        rv = bw2_wait(&completion);
+    }
     return rv;
 }
 
 void _bw2_simplemsg_from_frame(struct bw2_simpleMessage* sm, struct bw2_frame* frame) {
     struct bw2_header* fromhdr = bw2_getFirstHeader(frame, "from");
     struct bw2_header* urihdr = bw2_getFirstHeader(frame, "uri");
-    if (fromhdr != NULL && urihdr != NULL) {
-        sm->from = fromhdr->value;
-        sm->from_len = fromhdr->len;
-        sm->uri = urihdr->value;
-        sm->uri_len = urihdr->len;
+    sm->from = (fromhdr == NULL) ? NULL : fromhdr->value;
+    sm->from_len = (fromhdr == NULL) ? 0 : fromhdr->len;
+    sm->uri = (urihdr == NULL) ? NULL : urihdr->value;
+    sm->uri_len = (urihdr == NULL) ? 0 : urihdr->len;
+    sm->error = 0;
+
+    /* The headers are expected unless a retention policy skipped them. */
+    if ((fromhdr == NULL || urihdr == NULL) && frame->skipped == 0) {
         sm->error = BW2_ERROR_MISSING_HEADER;
-    } else {
-        sm->from = NULL;
-        sm->from_len = 0;
-        sm->uri = NULL;
-        sm->uri_len = 0;
-        sm->error = 0;
+    }
+    if (frame->dropped != 0 && sm->error == 0) {
+        sm->error = BW2_ERROR_FRAME_HEAP_FULL;
     }
 
     sm->pos = frame->pos;
     sm->ros = frame->ros;
+    sm->frame = frame;
+    sm->ref = NULL;
+    sm->allocator = (frame->pool == NULL) ? NULL : frame->pool->allocator;
 }
 
 bool _bw2_simpleMessage_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
@@ -461,71 +944,733 @@ bool _bw2_simpleMessage_cb(struct bw2_frame* frame, bool final, struct bw2_reqct
     }
 }
 
-struct bw2_subscribe_ctx {
-    struct bw2_simplemsg_ctx* smctx;
-    struct bw2_subscriptionHandle* handle;
-};
+struct bw2_simpleMessage* bw2_simpleMessageCopy(struct bw2_simpleMessage* sm) {
+    struct bw2_payloadobj* po;
+    struct bw2_routingobj* ro;
+    size_t numpos = 0;
+    size_t numros = 0;
+    size_t datalen = sm->from_len + sm->uri_len;
 
-/* This callback is used for the first frame after a subscribe message. */
-bool _bw2_subscribe_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
-    struct bw2_subscribe_ctx* sparams = ctx;
+    for (po = sm->pos; po != NULL; po = po->next) {
+        numpos++;
+        datalen += po->polen;
+    }
+    for (ro = sm->ros; ro != NULL; ro = ro->next) {
+        numros++;
+        datalen += ro->rolen;
+    }
 
-    /* This should be the RESP frame. */
-    if (frame != NULL) {
-        rctx->rv = bw2_frameMustResponse(frame);
+    /* The structs go first, so that they are aligned, followed by the bytes
+     * that they point to.
+     */
+    size_t structlen = sizeof(struct bw2_simpleMessage) + numpos * sizeof(struct bw2_payloadobj) + numros * sizeof(struct bw2_routingobj);
+    struct bw2_simpleMessage* copy = bw2_allocatorAlloc(sm->allocator, BW2_ALLOC_MESSAGE_COPY, structlen + datalen);
+    if (copy == NULL) {
+        return NULL;
     }
-    if (rctx->rv == 0 && sparams->handle != NULL) {
-        struct bw2_header* handlehdr = bw2_getFirstHeader(frame, "handle");
-        if (handlehdr == NULL) {
-            rctx->rv = BW2_ERROR_MISSING_HEADER;
+
+    struct bw2_payloadobj* pocopies = (struct bw2_payloadobj*) (copy + 1);
+    struct bw2_routingobj* rocopies = (struct bw2_routingobj*) (pocopies + numpos);
+    char* data = ((char*) copy) + structlen;
+
+    copy->from = data;
+    copy->from_len = sm->from_len;
+    memcpy(data, sm->from, sm->from_len);
+    data += sm->from_len;
+
+    copy->uri = data;
+    copy->uri_len = sm->uri_len;
+    memcpy(data, sm->uri, sm->uri_len);
+    data += sm->uri_len;
+
+    copy->pos = NULL;
+    for (po = sm->pos; po != NULL; po = po->next) {
+        bw2_POInit(pocopies, po->ponum, data, po->polen);
+        memcpy(data, po->po, po->polen);
+        data += po->polen;
+        if (copy->pos != NULL) {
+            pocopies[-1].next = pocopies;
         } else {
-            bw2_subscriptionHandle_set(sparams->handle, handlehdr->value, handlehdr->len);
+            copy->pos = pocopies;
         }
+        pocopies++;
     }
 
-    /* Future frames should be handled by the Simple Message. */
-    rctx->onframe = _bw2_simpleMessage_cb;
-    rctx->ctx = sparams->smctx;
+    copy->ros = NULL;
+    for (ro = sm->ros; ro != NULL; ro = ro->next) {
+        bw2_ROInit(rocopies, ro->ronum, data, ro->rolen);
+        memcpy(data, ro->ro, ro->rolen);
+        data += ro->rolen;
+        if (copy->ros != NULL) {
+            rocopies[-1].next = rocopies;
+        } else {
+            copy->ros = rocopies;
+        }
+        rocopies++;
+    }
 
-    bw2_reqctxSignal(rctx);
-    return (rctx->rv != 0);
+    copy->error = sm->error;
+    copy->frame = NULL;
+    copy->ref = NULL;
+    copy->allocator = sm->allocator;
+
+    return copy;
 }
 
-int bw2_subscribe(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx, struct bw2_subscriptionHandle* handle) {
-    struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_SUBSCRIBE, _bw2_getSeqNo(client));
+struct bw2_simpleMessage* bw2_simpleMessageRetain(struct bw2_simpleMessage* sm) {
+    struct bw2_frameRef* ref = sm->ref;
+    if (ref != NULL) {
+        bw2_frameRefRetain(ref);
+    } else if (sm->frame != NULL) {
+        ref = bw2_frameRetain(sm->frame);
+    }
+    if (ref == NULL) {
+        return bw2_simpleMessageCopy(sm);
+    }
 
-    BW2_REQUEST_ADD_AUTOCHAIN(p, &req)
-    BW2_REQUEST_ADD_EXPIRY(p, &req)
-    BW2_REQUEST_ADD_URI(p, &req)
-    BW2_REQUEST_ADD_PRIMARY_ACCESS_CHAIN(p, &req)
-    BW2_REQUEST_ADD_ROUTING_OBJECTS(p, &req)
-    BW2_REQUEST_ADD_ELABORATE_PAC(p, &req)
-    BW2_REQUEST_ADD_LEAVE_PACKED(p, &req)
-    BW2_REQUEST_ADD_VERIFY(p, &req)
+    struct bw2_simpleMessage* retained = bw2_allocatorAlloc(sm->allocator, BW2_ALLOC_MESSAGE_RETAIN, sizeof(struct bw2_simpleMessage));
+    if (retained == NULL) {
+        bw2_frameRefRelease(ref);
+        return NULL;
+    }
+    memcpy(retained, sm, sizeof(struct bw2_simpleMessage));
+    retained->frame = NULL;
+    retained->ref = ref;
+    return retained;
+}
 
-    struct bw2_subscribe_ctx sparams;
-    sparams.smctx = subctx;
-    sparams.handle = handle;
+void bw2_simpleMessageFree(struct bw2_simpleMessage* sm) {
+    int site = BW2_ALLOC_MESSAGE_COPY;
+    if (sm->ref != NULL) {
+        bw2_frameRefRelease(sm->ref);
+        site = BW2_ALLOC_MESSAGE_RETAIN;
+    }
+    bw2_allocatorFree(sm->allocator, site, sm);
+}
 
-    bw2_reqctxInit(&subctx->reqctx, _bw2_subscribe_cb, &sparams);
-    int rv = bw2_transact(client, &req, &subctx->reqctx);
-    if (rv != 0) {
-        goto done;
+struct bw2_messageBlock* bw2_simpleMessageClone(struct bw2_simpleMessage* sm, struct bw2_arena* arena) {
+    struct bw2_payloadobj* po;
+    struct bw2_routingobj* ro;
+    size_t numpos = 0;
+    size_t numros = 0;
+    size_t datalen = sm->from_len + sm->uri_len;
+
+    for (po = sm->pos; po != NULL; po = po->next) {
+        numpos++;
+        datalen += po->polen;
+    }
+    for (ro = sm->ros; ro != NULL; ro = ro->next) {
+        numros++;
+        datalen += ro->rolen;
     }
-    bw2_reqctxWait(&subctx->reqctx);
 
-done:
-    bw2_reqctxDestroy(&subctx->reqctx);
-    return subctx->reqctx.rv;
-}
+    size_t headerlen = sizeof(struct bw2_messageBlock) + (numpos + numros) * sizeof(struct bw2_messageBlockEntry);
+    if (datalen > UINT32_MAX - headerlen) {
+        return NULL;
+    }
+    struct bw2_messageBlock* block = bw2_arenaAlloc(arena, headerlen + datalen);
+    if (block == NULL) {
+        return NULL;
+    }
 
-int bw2_query(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_simplemsg_ctx* qctx) {
-    struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_QUERY, _bw2_getSeqNo(client));
+    struct bw2_messageBlockEntry* entry = (struct bw2_messageBlockEntry*) (block + 1);
+    char* base = (char*) block;
+    uint32_t offset = (uint32_t) headerlen;
+
+    block->size = (uint32_t) (headerlen + datalen);
+    block->error = sm->error;
+    block->numPOs = (uint32_t) numpos;
+    block->numROs = (uint32_t) numros;
+
+    block->fromOffset = offset;
+    block->fromLen = (uint32_t) sm->from_len;
+    memcpy(&base[offset], sm->from, sm->from_len);
+    offset += block->fromLen;
+
+    block->uriOffset = offset;
+    block->uriLen = (uint32_t) sm->uri_len;
+    memcpy(&base[offset], sm->uri, sm->uri_len);
+    offset += block->uriLen;
+
+    for (po = sm->pos; po != NULL; po = po->next) {
+        entry->num = po->ponum;
+        entry->offset = offset;
+        entry->len = (uint32_t) po->polen;
+        memcpy(&base[offset], po->po, po->polen);
+        offset += entry->len;
+        entry++;
+    }
 
-    BW2_REQUEST_ADD_AUTOCHAIN(p, &req)
-    BW2_REQUEST_ADD_EXPIRY(p, &req)
+    for (ro = sm->ros; ro != NULL; ro = ro->next) {
+        entry->num = ro->ronum;
+        entry->offset = offset;
+        entry->len = (uint32_t) ro->rolen;
+        memcpy(&base[offset], ro->ro, ro->rolen);
+        offset += entry->len;
+        entry++;
+    }
+
+    return block;
+}
+
+size_t bw2_messageBlockSize(struct bw2_messageBlock* block) {
+    return block->size;
+}
+
+int bw2_messageBlockError(struct bw2_messageBlock* block) {
+    return block->error;
+}
+
+char* bw2_messageBlockFrom(struct bw2_messageBlock* block, size_t* len) {
+    *len = block->fromLen;
+    return ((char*) block) + block->fromOffset;
+}
+
+char* bw2_messageBlockURI(struct bw2_messageBlock* block, size_t* len) {
+    *len = block->uriLen;
+    return ((char*) block) + block->uriOffset;
+}
+
+size_t bw2_messageBlockNumPOs(struct bw2_messageBlock* block) {
+    return block->numPOs;
+}
+
+char* bw2_messageBlockPO(struct bw2_messageBlock* block, size_t index, uint32_t* ponum, size_t* len) {
+    if (index >= block->numPOs) {
+        return NULL;
+    }
+    struct bw2_messageBlockEntry* entry = ((struct bw2_messageBlockEntry*) (block + 1)) + index;
+    if (ponum != NULL) {
+        *ponum = entry->num;
+    }
+    *len = entry->len;
+    return ((char*) block) + entry->offset;
+}
+
+size_t bw2_messageBlockNumROs(struct bw2_messageBlock* block) {
+    return block->numROs;
+}
+
+char* bw2_messageBlockRO(struct bw2_messageBlock* block, size_t index, uint8_t* ronum, size_t* len) {
+    if (index >= block->numROs) {
+        return NULL;
+    }
+    struct bw2_messageBlockEntry* entry = ((struct bw2_messageBlockEntry*) (block + 1)) + block->numPOs + index;
+    if (ronum != NULL) {
+        *ronum = (uint8_t) entry->num;
+    }
+    *len = entry->len;
+    return ((char*) block) + entry->offset;
+}
+
+/* Copies the parameters of a subscription so that it can be replayed. */
+struct bw2_replaySub* _bw2_replaySubNew(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* smctx) {
+    struct bw2_routingobj* ro;
+    size_t numros = 0;
+    size_t datalen = strlen(p->uri) + 1;
+    if (p->elaboratePAC != NULL) {
+        datalen += strlen(p->elaboratePAC) + 1;
+    }
+    for (ro = p->routingObjects; ro != NULL; ro = ro->next) {
+        numros++;
+        datalen += ro->rolen;
+    }
+
+    size_t structlen = sizeof(struct bw2_replaySub) + numros * sizeof(struct bw2_routingobj);
+    struct bw2_replaySub* replay = bw2_allocatorAlloc(&client->allocator, BW2_ALLOC_REPLAY, structlen + datalen);
+    if (replay == NULL) {
+        return NULL;
+    }
+    memset(replay, 0x00, sizeof(struct bw2_replaySub));
+    replay->smctx = smctx;
+    memcpy(&replay->params, p, sizeof(struct bw2_subscribeParams));
+    replay->params.timeout = 0;
+    replay->params.cancel = NULL;
+
+    struct bw2_routingobj* rocopies = (struct bw2_routingobj*) (replay + 1);
+    char* data = ((char*) replay) + structlen;
+
+    replay->params.uri = data;
+    memcpy(data, p->uri, strlen(p->uri) + 1);
+    data += strlen(p->uri) + 1;
+
+    if (p->elaboratePAC != NULL) {
+        replay->params.elaboratePAC = data;
+        memcpy(data, p->elaboratePAC, strlen(p->elaboratePAC) + 1);
+        data += strlen(p->elaboratePAC) + 1;
+    }
+
+    if (p->primaryAccessChain != NULL) {
+        memcpy(&replay->pac, p->primaryAccessChain, sizeof(struct bw2_dotChainHash));
+        replay->params.primaryAccessChain = &replay->pac;
+    }
+
+    if (p->expiry != NULL) {
+        memcpy(&replay->expiry, p->expiry, sizeof(struct tm));
+        replay->params.expiry = &replay->expiry;
+    }
+
+    replay->params.routingObjects = NULL;
+    for (ro = p->routingObjects; ro != NULL; ro = ro->next) {
+        bw2_ROInit(rocopies, ro->ronum, data, ro->rolen);
+        rocopies->next = NULL;
+        memcpy(data, ro->ro, ro->rolen);
+        data += ro->rolen;
+        if (replay->params.routingObjects != NULL) {
+            rocopies[-1].next = rocopies;
+        } else {
+            replay->params.routingObjects = rocopies;
+        }
+        rocopies++;
+    }
+
+    return replay;
+}
+
+/* Must be called with client->reqslock held. */
+void _bw2_forgetReplay(struct bw2_client* client, struct bw2_replaySub* replay) {
+    struct bw2_replaySub** currptr;
+    for (currptr = &client->replays; *currptr != NULL; currptr = &(*currptr)->next) {
+        if (*currptr == replay) {
+            *currptr = replay->next;
+            break;
+        }
+    }
+    bw2_allocatorFree(&client->allocator, BW2_ALLOC_REPLAY, replay);
+}
+
+/* This callback is used for the first frame after a subscribe message. */
+bool _bw2_subscribe_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    struct bw2_subscribe_ctx* sparams = ctx;
+
+    /* This should be the RESP frame. */
+    if (frame != NULL) {
+        rctx->rv = bw2_frameMustResponse(frame);
+    }
+    if (rctx->rv == 0 && (sparams->handle != NULL || sparams->replay != NULL)) {
+        struct bw2_header* handlehdr = bw2_getFirstHeader(frame, "handle");
+        if (handlehdr == NULL) {
+            rctx->rv = BW2_ERROR_MISSING_HEADER;
+        } else if (sparams->handle != NULL) {
+            bw2_subscriptionHandle_set(sparams->handle, handlehdr->value, handlehdr->len);
+        }
+        if (rctx->rv == 0 && sparams->replay != NULL) {
+            /* Remember the subscription so it can be replayed. This runs on
+             * the BOSSWAVE thread, which holds the client's reqslock.
+             */
+            struct bw2_replaySub* replay = sparams->replay;
+            bw2_subscriptionHandle_set(&replay->original, handlehdr->value, handlehdr->len);
+            bw2_subscriptionHandle_set(&replay->current, handlehdr->value, handlehdr->len);
+            replay->next = sparams->client->replays;
+            sparams->client->replays = replay;
+            rctx->replay = replay;
+        }
+    }
+
+    if (sparams->pac != NULL) {
+        *sparams->pacRejected = _bw2_autoPACResult(sparams->client, frame, sparams->pac, rctx->rv);
+    }
+
+    /* Future frames should be handled by the Simple Message. */
+    rctx->onframe = _bw2_simpleMessage_cb;
+    rctx->ctx = sparams->smctx;
+
+    /* The subscriber may release RCTX as soon as it is signalled. */
+    bool failed = (rctx->rv != 0);
+    bw2_reqctxSignal(rctx);
+    return failed;
+}
+
+int _bw2_subscribeAsync(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx, struct bw2_subscriptionHandle* handle, struct bw2_completion* completion, bool resolve) {
+    struct bw2_subscribeParams resolved;
+    struct bw2_dotChainHash resolvedpac;
+    bool pacResolved = false;
+    if (p->autochain && p->primaryAccessChain == NULL
+        && _bw2_autoPAC(client, p->uri, "C", resolve, p->timeout, p->cancel, &resolvedpac)) {
+        memcpy(&resolved, p, sizeof(struct bw2_subscribeParams));
+        resolved.autochain = false;
+        resolved.primaryAccessChain = &resolvedpac;
+        p = &resolved;
+        pacResolved = true;
+    }
+
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_SUBSCRIBE, _bw2_getSeqNo(client));
+
+    BW2_REQUEST_ADD_AUTOCHAIN(p, &req)
+    BW2_REQUEST_ADD_EXPIRY(p, &req)
+    BW2_REQUEST_ADD_URI(p, &req)
+    BW2_REQUEST_ADD_PRIMARY_ACCESS_CHAIN(p, &req)
+    BW2_REQUEST_ADD_ROUTING_OBJECTS(p, &req)
+    BW2_REQUEST_ADD_ELABORATE_PAC(p, &req)
+    BW2_REQUEST_ADD_LEAVE_PACKED(p, &req)
+    BW2_REQUEST_ADD_VERIFY(p, &req)
+
+    struct bw2_subscribe_ctx* sparams = &completion->out.subscribe;
+    sparams->client = client;
+    sparams->smctx = subctx;
+    sparams->handle = handle;
+    sparams->replay = NULL;
+    sparams->pac = NULL;
+    sparams->pacRejected = NULL;
+
+    bw2_reqctxInit(&subctx->reqctx, _bw2_subscribe_cb, sparams);
+    _bw2_completionInit(client, completion, &subctx->reqctx);
+    BW2_REQUEST_SET_DEADLINE(p, &subctx->reqctx)
+    if (pacResolved && bw2_dotChainHash_toBinary(&resolvedpac, &completion->pac) == 0) {
+        completion->pacResolved = true;
+        sparams->pac = &completion->pac;
+        sparams->pacRejected = &completion->pacRejected;
+    }
+
+    /* A subscription's budget is part of the client's. */
+    if (p->budget != NULL) {
+        if (p->budget->parent == NULL && p->budget != &client->budget) {
+            p->budget->parent = &client->budget;
+        }
+        subctx->reqctx.budget = p->budget;
+    }
+    subctx->reqctx.policy = p->retain;
+
+    bw2_mutexLock(&client->reqslock);
+    bool replayable = client->reconnect.enabled;
+    bw2_mutexUnlock(&client->reqslock);
+    if (replayable) {
+        sparams->replay = _bw2_replaySubNew(client, p, subctx);
+        if (sparams->replay == NULL) {
+            return _bw2_completionFail(completion, BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE);
+        }
+    }
+    completion->replay = sparams->replay;
+
+    return _bw2_completionStart(client, &req, completion);
+}
+
+int bw2_subscribeAsync(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx, struct bw2_subscriptionHandle* handle, struct bw2_completion* completion) {
+    return _bw2_subscribeAsync(client, p, subctx, handle, completion, false);
+}
+
+int bw2_subscribe(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx, struct bw2_subscriptionHandle* handle) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    _bw2_subscribeAsync(client, p, subctx, handle, &completion, true);
+    int rv = bw2_wait(&completion);
+
+    /* As in bw2_publish, a rejected PAC is resolved again once. */
+    if (rv == BW2_ERROR_RESPONSE_STATUS && completion.pacRejected) {
+        _bw2_subscribeAsync(client, p, subctx, handle, &completion, true);
+        rv = bw2_wait(&completion);
+    }
+    return rv;
+}
+
+void _bw2_sharedsub_unlink(struct bw2_client* client, struct bw2_sharedsub* s) {
+    struct bw2_sharedsub** currptr;
+    for (currptr = &client->shared; *currptr != NULL; currptr = &(*currptr)->next) {
+        if (*currptr == s) {
+            *currptr = s->next;
+            return;
+        }
+    }
+}
+
+void _bw2_sharedsub_free(struct bw2_sharedsub* s) {
+    bw2_condDestroy(&s->ready);
+    bw2_allocatorFree(&s->client->allocator, BW2_ALLOC_SHARED_SUB, s);
+}
+
+bool _bw2_sharedsub_matches(struct bw2_sharedsub* s, struct bw2_subscribeParams* p) {
+    const char* elaborate = (p->elaboratePAC == NULL) ? "" : p->elaboratePAC;
+    if (strcmp(s->uri, p->uri) != 0 || strcmp(s->elaboratePAC, elaborate) != 0 || s->leavePacked != p->leavePacked) {
+        return false;
+    }
+    if (p->primaryAccessChain == NULL) {
+        return s->pac == NULL;
+    }
+    return s->pac != NULL && s->paclen == p->primaryAccessChain->dotchainhashlen
+        && memcmp(s->pac, p->primaryAccessChain->dotchainhash, s->paclen) == 0;
+}
+
+struct bw2_sharedsub* _bw2_sharedsub_new(struct bw2_client* client, struct bw2_subscribeParams* p) {
+    const char* elaborate = (p->elaboratePAC == NULL) ? "" : p->elaboratePAC;
+    size_t urilen = strlen(p->uri) + 1;
+    size_t elaboratelen = strlen(elaborate) + 1;
+    size_t paclen = (p->primaryAccessChain == NULL) ? 0 : p->primaryAccessChain->dotchainhashlen;
+
+    struct bw2_sharedsub* s = bw2_allocatorAlloc(&client->allocator, BW2_ALLOC_SHARED_SUB, sizeof(struct bw2_sharedsub) + urilen + elaboratelen + paclen);
+    if (s == NULL) {
+        return NULL;
+    }
+    memset(s, 0x00, sizeof(struct bw2_sharedsub));
+    if (bw2_condInit(&s->ready) != 0) {
+        bw2_allocatorFree(&client->allocator, BW2_ALLOC_SHARED_SUB, s);
+        return NULL;
+    }
+
+    char* data = (char*) (s + 1);
+    s->uri = data;
+    memcpy(data, p->uri, urilen);
+    data += urilen;
+
+    s->elaboratePAC = data;
+    memcpy(data, elaborate, elaboratelen);
+    data += elaboratelen;
+
+    if (p->primaryAccessChain != NULL) {
+        s->pac = data;
+        s->paclen = paclen;
+        memcpy(data, p->primaryAccessChain->dotchainhash, paclen);
+    }
+
+    s->leavePacked = p->leavePacked;
+    s->client = client;
+    s->state = BW2_SHAREDSUB_PENDING;
+    return s;
+}
+
+/* Fans a message on the agent subscription out to every local listener. This
+ * runs on the BOSSWAVE thread with the client's reqslock held.
+ */
+bool _bw2_sharedsub_on_message(struct bw2_simpleMessage* sm, bool final, int error, union bw2_userctx ctx) {
+    struct bw2_sharedsub* s = ctx.ptr;
+    struct bw2_client* client = s->client;
+    struct bw2_simplemsg_ctx** currptr;
+    struct bw2_simplemsg_ctx* curr;
+    bool ended;
+
+    bw2_mutexLock(&client->sharedlock);
+
+    currptr = &s->listeners;
+    while ((curr = *currptr) != NULL) {
+        /* At this point, curr may no longer be a valid pointer after the
+         * function returns.
+         */
+        struct bw2_simplemsg_ctx* next = curr->nextlistener;
+        bool stoplistening = curr->on_message(sm, final, error, curr->ctx);
+        if (final || stoplistening) {
+            *currptr = next;
+            s->refcount--;
+        } else {
+            currptr = &curr->nextlistener;
+        }
+    }
+
+    /* Once the last listener is gone, or the agent has ended the subscription,
+     * no more frames are delivered for it; if a subscriber is still waiting
+     * for the agent's response, it frees the registry entry instead.
+     */
+    ended = final || (s->listeners == NULL && s->state != BW2_SHAREDSUB_CLOSING && s->state != BW2_SHAREDSUB_CANCELLED);
+    if (ended) {
+        _bw2_sharedsub_unlink(client, s);
+        s->state = BW2_SHAREDSUB_ENDED;
+        if (s->waiters == 0) {
+            bw2_mutexUnlock(&client->sharedlock);
+            _bw2_sharedsub_free(s);
+            return true;
+        }
+    }
+
+    bw2_mutexUnlock(&client->sharedlock);
+    return ended;
+}
+
+int bw2_subscribeShared(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx) {
+    struct bw2_sharedsub* s;
+    struct bw2_subscriptionHandle handle;
+    bool created = false;
+    bool cancel = false;
+    int rv;
+
+    bw2_mutexLock(&client->sharedlock);
+
+    for (s = client->shared; s != NULL; s = s->next) {
+        if (_bw2_sharedsub_matches(s, p)) {
+            break;
+        }
+    }
+
+    if (s == NULL) {
+        s = _bw2_sharedsub_new(client, p);
+        if (s == NULL) {
+            bw2_mutexUnlock(&client->sharedlock);
+            return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        }
+        s->next = client->shared;
+        client->shared = s;
+        created = true;
+    }
+
+    /* Add the listener right away, so that it sees the first message even if
+     * it arrives before the agent's response has been processed.
+     */
+    subctx->shared = s;
+    subctx->nextlistener = s->listeners;
+    s->listeners = subctx;
+    s->refcount++;
+
+    if (s->state == BW2_SHAREDSUB_ACTIVE) {
+        bw2_mutexUnlock(&client->sharedlock);
+        return 0;
+    }
+
+    if (!created) {
+        /* Another thread is creating the agent subscription. */
+        s->waiters++;
+        while (s->state == BW2_SHAREDSUB_PENDING) {
+            bw2_condWait(&s->ready, &client->sharedlock);
+        }
+        s->waiters--;
+        rv = (s->state == BW2_SHAREDSUB_FAILED) ? s->rv : 0;
+        goto done;
+    }
+
+    s->waiters++;
+    bw2_mutexUnlock(&client->sharedlock);
+
+    s->smctx.on_message = _bw2_sharedsub_on_message;
+    s->smctx.ctx.ptr = s;
+    rv = bw2_subscribe(client, p, &s->smctx, &s->handle);
+
+    bw2_mutexLock(&client->sharedlock);
+    s->waiters--;
+    if (rv != 0) {
+        /* Nobody has been given a message, so just drop every listener. */
+        _bw2_sharedsub_unlink(client, s);
+        s->state = BW2_SHAREDSUB_FAILED;
+        s->rv = rv;
+        s->listeners = NULL;
+        s->refcount = 0;
+    } else if (s->state == BW2_SHAREDSUB_PENDING) {
+        s->state = BW2_SHAREDSUB_ACTIVE;
+    } else if (s->state == BW2_SHAREDSUB_CANCELLED) {
+        /* The last listener was removed before the agent's response arrived,
+         * so cancel the agent subscription now that its handle is known.
+         */
+        s->state = BW2_SHAREDSUB_CLOSING;
+        memcpy(&handle, &s->handle, sizeof(handle));
+        cancel = true;
+    }
+    bw2_condBroadcast(&s->ready);
+
+done:
+    if (s->state != BW2_SHAREDSUB_ACTIVE && s->state != BW2_SHAREDSUB_CLOSING && s->waiters == 0) {
+        bw2_mutexUnlock(&client->sharedlock);
+        _bw2_sharedsub_free(s);
+        return rv;
+    }
+    bw2_mutexUnlock(&client->sharedlock);
+
+    /* The entry may be freed as soon as the agent confirms, so it is not
+     * touched after this.
+     */
+    if (cancel) {
+        bw2_unsubscribe(client, &handle);
+    }
+    return rv;
+}
+
+int bw2_unsubscribeShared(struct bw2_client* client, struct bw2_simplemsg_ctx* subctx) {
+    struct bw2_sharedsub* s = subctx->shared;
+    struct bw2_simplemsg_ctx** currptr;
+    struct bw2_subscriptionHandle handle;
+    bool last;
+    int rv = 0;
+
+    bw2_mutexLock(&client->sharedlock);
+
+    for (currptr = &s->listeners; *currptr != NULL; currptr = &(*currptr)->nextlistener) {
+        if (*currptr == subctx) {
+            *currptr = subctx->nextlistener;
+            s->refcount--;
+            break;
+        }
+    }
+
+    /* The agent subscription stays registered until the agent confirms that
+     * it has ended, since frames for it may still be in flight.
+     */
+    last = (s->listeners == NULL && s->state == BW2_SHAREDSUB_ACTIVE);
+    if (last) {
+        _bw2_sharedsub_unlink(client, s);
+        s->state = BW2_SHAREDSUB_CLOSING;
+        memcpy(&handle, &s->handle, sizeof(handle));
+    } else if (s->listeners == NULL && s->state == BW2_SHAREDSUB_PENDING) {
+        /* The handle is not known yet, so bw2_subscribeShared cancels the
+         * agent subscription once the agent's response arrives.
+         */
+        _bw2_sharedsub_unlink(client, s);
+        s->state = BW2_SHAREDSUB_CANCELLED;
+    }
+
+    bw2_mutexUnlock(&client->sharedlock);
+
+    if (last) {
+        rv = bw2_unsubscribe(client, &handle);
+    }
+
+    if (subctx->on_message != NULL) {
+        subctx->on_message(NULL, true, 0, subctx->ctx);
+    }
+    return rv;
+}
+
+bool _bw2_pullsub_on_message(struct bw2_simpleMessage* sm, bool final, int error, union bw2_userctx ctx) {
+    struct bw2_pullsub_ctx* pctx = ctx.ptr;
+
+    if (sm != NULL) {
+        struct bw2_simpleMessage* copy = bw2_simpleMessageRetain(sm);
+        if (copy == NULL) {
+            __atomic_fetch_add(&pctx->queue.copyFailed, 1, __ATOMIC_RELAXED);
+        } else {
+            bw2_msgqueuePush(&pctx->queue, copy);
+        }
+    }
+
+    if (final) {
+        bw2_msgqueueClose(&pctx->queue, error);
+    }
+
+    return false;
+}
+
+int bw2_subscribePull(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_pullsub_ctx* pctx, struct bw2_subscriptionHandle* handle) {
+    int rv = bw2_msgqueueInit(&pctx->queue, pctx->slots, pctx->capacity, pctx->overflowPolicy);
+    if (rv != 0) {
+        return rv;
+    }
+
+    pctx->smctx.on_message = _bw2_pullsub_on_message;
+    pctx->smctx.ctx.ptr = pctx;
+
+    rv = bw2_subscribe(client, p, &pctx->smctx, handle);
+    if (rv != 0) {
+        bw2_msgqueueDestroy(&pctx->queue);
+    }
+    return rv;
+}
+
+int bw2_subscriptionNext(struct bw2_pullsub_ctx* pctx, int64_t timeout, struct bw2_simpleMessage** msg) {
+    return bw2_msgqueuePop(&pctx->queue, timeout, msg);
+}
+
+size_t bw2_subscriptionDrain(struct bw2_pullsub_ctx* pctx, struct bw2_simpleMessage** msgs, size_t max) {
+    return bw2_msgqueueDrain(&pctx->queue, msgs, max);
+}
+
+void bw2_subscriptionStats(struct bw2_pullsub_ctx* pctx, struct bw2_msgqueueStats* stats) {
+    bw2_msgqueueStats(&pctx->queue, stats);
+}
+
+void bw2_subscriptionDestroy(struct bw2_pullsub_ctx* pctx) {
+    bw2_msgqueueDestroy(&pctx->queue);
+}
+
+int bw2_queryAsync(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_simplemsg_ctx* qctx, struct bw2_completion* completion) {
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_QUERY, _bw2_getSeqNo(client));
+
+    BW2_REQUEST_ADD_AUTOCHAIN(p, &req)
+    BW2_REQUEST_ADD_EXPIRY(p, &req)
     BW2_REQUEST_ADD_URI(p, &req)
     BW2_REQUEST_ADD_PRIMARY_ACCESS_CHAIN(p, &req)
     BW2_REQUEST_ADD_ROUTING_OBJECTS(p, &req)
@@ -533,54 +1678,1087 @@ int bw2_query(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_s
     BW2_REQUEST_ADD_LEAVE_PACKED(p, &req)
     BW2_REQUEST_ADD_VERIFY(p, &req)
 
-    bw2_reqctxInit(&qctx->reqctx, _bw2_simpleMessage_cb, qctx);
-    bw2_transact(client, &req, &qctx->reqctx);
-    bw2_reqctxWait(&qctx->reqctx);
+    bw2_reqctxInit(&qctx->reqctx, _bw2_simpleMessage_cb, qctx);
+    _bw2_completionInit(client, completion, &qctx->reqctx);
+    BW2_REQUEST_SET_DEADLINE(p, &qctx->reqctx)
+
+    return _bw2_completionStart(client, &req, completion);
+}
+
+int bw2_query(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_simplemsg_ctx* qctx) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    bw2_queryAsync(client, p, qctx, &completion);
+    return bw2_wait(&completion);
+}
+
+/* Hands the messages batched in BCTX to the user, and returns the user's
+ * decision to stop listening. Must be called with the client's reqslock held.
+ * BCTX is not accessed once the user's function has been called, since the
+ * user may reuse it as soon as the stream has ended.
+ */
+bool _bw2_batchDeliver(struct bw2_batchmsg_ctx* bctx, bool final, int error) {
+    struct bw2_simpleMessage** msgs = bctx->msgs;
+    size_t count = bctx->count;
+    size_t i;
+
+    if (bctx->pprev != NULL) {
+        *bctx->pprev = bctx->next;
+        if (bctx->next != NULL) {
+            bctx->next->pprev = bctx->pprev;
+        }
+        bctx->next = NULL;
+        bctx->pprev = NULL;
+    }
+    bctx->count = 0;
+
+    bool stop = bctx->on_batch(msgs, count, final, error, bctx->ctx);
+
+    for (i = 0; i < count; i++) {
+        bw2_simpleMessageFree(msgs[i]);
+    }
+    if (final || stop) {
+        bw2_allocatorFree(&bctx->client->allocator, BW2_ALLOC_BATCH, msgs);
+    }
+    return stop;
+}
+
+bool _bw2_batch_cb(struct bw2_simpleMessage* sm, bool final, int error, union bw2_userctx ctx) {
+    struct bw2_batchmsg_ctx* bctx = ctx.ptr;
+
+    if (sm != NULL) {
+        struct bw2_simpleMessage* copy = bw2_simpleMessageRetain(sm);
+        if (copy == NULL) {
+            /* Deliver this message on its own, while it is still valid. */
+            if (bctx->count != 0 && _bw2_batchDeliver(bctx, false, 0)) {
+                return true;
+            }
+            bool stop = bctx->on_batch(&sm, 1, final, error, bctx->ctx);
+            if (final || stop) {
+                bw2_allocatorFree(&bctx->client->allocator, BW2_ALLOC_BATCH, bctx->msgs);
+            }
+            return stop;
+        }
+
+        if (bctx->count == 0) {
+            bctx->first = bw2_getTimeMicros();
+            bctx->next = bctx->client->batches;
+            bctx->pprev = &bctx->client->batches;
+            if (bctx->next != NULL) {
+                bctx->next->pprev = &bctx->next;
+            }
+            bctx->client->batches = bctx;
+        }
+        bctx->msgs[bctx->count++] = copy;
+    }
+
+    if (final || bctx->count == bctx->maxmessages) {
+        return _bw2_batchDeliver(bctx, final, error);
+    }
+    return false;
+}
+
+/* Delivers the batched messages of CLIENT's subscriptions, or, unless ALL is
+ * set, only those that have been held back for too long. Must be called with
+ * client->reqslock held, on the thread that handles frames for CLIENT.
+ */
+void _bw2_flushBatches(struct bw2_client* client, bool all) {
+    struct bw2_batchmsg_ctx* bctx = client->batches;
+    uint64_t now = (all || bctx == NULL) ? 0 : bw2_getTimeMicros();
+
+    while (bctx != NULL) {
+        struct bw2_batchmsg_ctx* next = bctx->next;
+
+        if (all || (bctx->maxdelay != 0 && now - bctx->first >= bctx->maxdelay)) {
+            struct bw2_reqctx* rctx = &bctx->smctx.reqctx;
+            struct bw2_replaySub* replay = rctx->replay;
+
+            /* As in _bw2_dispatchFrame, the request is out of the list while
+             * the user's function runs, and is put back if it still wants
+             * messages.
+             */
+            bool linked = (rctx->pprev != NULL);
+            _bw2_reqsRemove(rctx);
+            if (_bw2_batchDeliver(bctx, false, 0)) {
+                /* The user stopped listening, so BCTX may no longer be valid.
+                 * As when any other function stops listening, the agent
+                 * subscription itself stays until the user calls
+                 * bw2_unsubscribe.
+                 */
+                if (replay != NULL) {
+                    _bw2_forgetReplay(client, replay);
+                }
+            } else if (linked) {
+                _bw2_reqsInsert(client, rctx);
+            }
+        }
+
+        bctx = next;
+    }
+}
+
+/* Prepares BCTX to collect messages into batches. */
+int _bw2_batchInit(struct bw2_client* client, struct bw2_batchmsg_ctx* bctx) {
+    if (bctx->maxmessages == 0) {
+        bctx->maxmessages = BW2_BATCH_DEFAULT_MAX_MESSAGES;
+    }
+    bctx->msgs = bw2_allocatorAlloc(&client->allocator, BW2_ALLOC_BATCH, bctx->maxmessages * sizeof(struct bw2_simpleMessage*));
+    if (bctx->msgs == NULL) {
+        return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+    }
+    bctx->client = client;
+    bctx->count = 0;
+    bctx->next = NULL;
+    bctx->pprev = NULL;
+    bctx->smctx.on_message = _bw2_batch_cb;
+    bctx->smctx.ctx.ptr = bctx;
+    return 0;
+}
+
+int bw2_subscribeBatched(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_batchmsg_ctx* bctx, struct bw2_subscriptionHandle* handle) {
+    int rv = _bw2_batchInit(client, bctx);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = bw2_subscribe(client, p, &bctx->smctx, handle);
+    if (rv != 0) {
+        bw2_allocatorFree(&client->allocator, BW2_ALLOC_BATCH, bctx->msgs);
+    }
+    return rv;
+}
+
+int bw2_queryBatched(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_batchmsg_ctx* bctx) {
+    int rv = _bw2_batchInit(client, bctx);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = bw2_query(client, p, &bctx->smctx);
+    if (rv != 0) {
+        bw2_allocatorFree(&client->allocator, BW2_ALLOC_BATCH, bctx->msgs);
+    }
+    return rv;
+}
+
+bool _bw2_list_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    bool gotResp;
+    bw2_reqctxSignalled(rctx, &gotResp);
+
+    if (gotResp) {
+        /* Deliver this frame to the application via the on_message function. */
+        struct bw2_chararr_ctx* lctx = ctx;
+        if (frame == NULL) {
+            if (lctx->on_message != NULL) {
+                lctx->on_message(NULL, 0, final, rctx->rv, lctx->ctx);
+            }
+            return true;
+        } else if (lctx->on_message != NULL) {
+            struct bw2_header* childhdr = bw2_getFirstHeader(frame, "child");
+
+            char* childuri;
+            size_t childuri_len;
+            if (childhdr == NULL) {
+                childuri = NULL;
+                childuri_len = 0;
+            } else {
+                childuri = childhdr->value;
+                childuri_len = childhdr->len;
+            }
+            return lctx->on_message(childuri, childuri_len, final, 0, lctx->ctx);
+        }
+        return false;
+    } else {
+        /* This should be the RESP frame. */
+        if (frame != NULL) {
+            rctx->rv = bw2_frameMustResponse(frame);
+        }
+        bw2_reqctxSignal(rctx);
+        return (rctx->rv != 0);
+    }
+}
+
+int bw2_listAsync(struct bw2_client* client, struct bw2_listParams* p, struct bw2_chararr_ctx* lctx, struct bw2_completion* completion) {
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_LIST, _bw2_getSeqNo(client));
+
+    BW2_REQUEST_ADD_AUTOCHAIN(p, &req)
+    BW2_REQUEST_ADD_EXPIRY(p, &req)
+    BW2_REQUEST_ADD_URI(p, &req)
+    BW2_REQUEST_ADD_PRIMARY_ACCESS_CHAIN(p, &req)
+    BW2_REQUEST_ADD_ROUTING_OBJECTS(p, &req)
+    BW2_REQUEST_ADD_ELABORATE_PAC(p, &req)
+    BW2_REQUEST_ADD_VERIFY(p, &req)
+
+    bw2_reqctxInit(&lctx->reqctx, _bw2_list_cb, lctx);
+    _bw2_completionInit(client, completion, &lctx->reqctx);
+    BW2_REQUEST_SET_DEADLINE(p, &lctx->reqctx)
+
+    return _bw2_completionStart(client, &req, completion);
+}
+
+int bw2_list(struct bw2_client* client, struct bw2_listParams* p, struct bw2_chararr_ctx* lctx) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    bw2_listAsync(client, p, lctx, &completion);
+    return bw2_wait(&completion);
+}
+
+/* One request of a bw2_queryMulti or bw2_listMulti call. The flags are
+ * protected by the lock of the multi context.
+ */
+struct bw2_multiSlot {
+    struct bw2_multi* multi;
+    size_t index;
+    bool inuse;
+    bool responded;
+    bool waited;
+    bool ended;
+    struct bw2_completion completion;
+    union {
+        struct bw2_simplemsg_ctx smctx;
+        struct bw2_chararr_ctx lctx;
+    } req;
+};
+
+struct bw2_multi {
+    struct bw2_client* client;
+    char** uris;
+    void* params;
+    void* userctx;
+
+    /* Starts the request of SLOT for URIS[SLOT->INDEX]. */
+    void (*start)(struct bw2_multiSlot* slot);
+
+    /* Tells the user that the request for URIS[INDEX] failed. */
+    void (*fail)(struct bw2_multi* multi, size_t index, int error);
+
+    struct bw2_mutex lock;
+    struct bw2_cond condvar;
+    bool changed;
+};
+
+void _bw2_multiNotify(struct bw2_multiSlot* slot, bool* flag) {
+    struct bw2_multi* multi = slot->multi;
+    bw2_mutexLock(&multi->lock);
+    *flag = true;
+    multi->changed = true;
+    bw2_condSignal(&multi->condvar);
+    bw2_mutexUnlock(&multi->lock);
+}
+
+void _bw2_multiResponded(struct bw2_completion* completion, union bw2_userctx ctx) {
+    (void) completion;
+    struct bw2_multiSlot* slot = ctx.ptr;
+    _bw2_multiNotify(slot, &slot->responded);
+}
+
+bool _bw2_cancelTokenCancelled(struct bw2_cancelToken* token) {
+    bool cancelled;
+    bw2_mutexLock(&token->lock);
+    cancelled = token->cancelled;
+    bw2_mutexUnlock(&token->lock);
+    return cancelled;
+}
+
+/* Runs the requests of MULTI for COUNT URIs, with at most CONCURRENCY of them
+ * outstanding at once, and returns once all of them have finished.
+ */
+int _bw2_multi(struct bw2_multi* multi, size_t count, size_t concurrency, struct bw2_cancelToken* cancel) {
+    struct bw2_multiSlot* slots;
+    size_t next = 0;
+    size_t active = 0;
+    size_t i;
+    int rv = 0;
+
+    if (concurrency == 0 || concurrency > count) {
+        concurrency = count;
+    }
+    if (concurrency == 0) {
+        return 0;
+    }
+
+    slots = bw2_allocatorAlloc(&multi->client->allocator, BW2_ALLOC_MULTI, concurrency * sizeof(struct bw2_multiSlot));
+    if (slots == NULL) {
+        return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+    }
+    memset(slots, 0x00, concurrency * sizeof(struct bw2_multiSlot));
+    if (bw2_mutexInit(&multi->lock) != 0) {
+        rv = BW2_ERROR_SYNCHRONIZATION;
+        goto freeslots;
+    }
+    if (bw2_condInit(&multi->condvar) != 0) {
+        rv = BW2_ERROR_SYNCHRONIZATION;
+        goto destroylock;
+    }
+    multi->changed = false;
+
+    while (next < count || active > 0) {
+        /* Keep CONCURRENCY requests outstanding, as long as URIs remain. */
+        for (i = 0; i < concurrency && next < count; i++) {
+            struct bw2_multiSlot* slot = &slots[i];
+            if (slot->inuse) {
+                continue;
+            }
+            if (cancel != NULL && _bw2_cancelTokenCancelled(cancel)) {
+                /* Requests already sent run to completion. */
+                while (next < count) {
+                    multi->fail(multi, next++, BW2_ERROR_CANCELLED);
+                }
+                if (rv == 0) {
+                    rv = BW2_ERROR_CANCELLED;
+                }
+                break;
+            }
+            slot->multi = multi;
+            slot->index = next++;
+            slot->inuse = true;
+            slot->responded = false;
+            slot->waited = false;
+            slot->ended = false;
+            slot->completion.on_complete = _bw2_multiResponded;
+            slot->completion.ctx.ptr = slot;
+            active++;
+            multi->start(slot);
+        }
+
+        if (active == 0) {
+            continue;
+        }
+
+        /* Nothing else may be servicing the deadlines of these requests, so
+         * wake up for the earliest one.
+         */
+        uint64_t deadline = 0;
+        for (i = 0; i < concurrency; i++) {
+            if (slots[i].inuse && !slots[i].waited) {
+                uint64_t d = slots[i].completion.rctx->deadline;
+                if (d != 0 && (deadline == 0 || d < deadline)) {
+                    deadline = d;
+                }
+            }
+        }
+
+        int waitrv = 0;
+        bw2_mutexLock(&multi->lock);
+        if (!multi->changed) {
+            if (deadline == 0) {
+                bw2_condWait(&multi->condvar, &multi->lock);
+            } else {
+                waitrv = bw2_condTimedWait(&multi->condvar, &multi->lock, deadline * 1000);
+            }
+        }
+        multi->changed = false;
+        bw2_mutexUnlock(&multi->lock);
+
+        if (waitrv == ETIMEDOUT) {
+            bw2_mutexLock(&multi->client->reqslock);
+            _bw2_serviceTimers(multi->client);
+            bw2_mutexUnlock(&multi->client->reqslock);
+        }
+
+        /* Finish the requests that have been answered, and free the slots of
+         * the streams that have ended.
+         */
+        for (i = 0; i < concurrency; i++) {
+            struct bw2_multiSlot* slot = &slots[i];
+            if (!slot->inuse) {
+                continue;
+            }
+
+            bw2_mutexLock(&multi->lock);
+            bool responded = slot->responded;
+            bool ended = slot->ended;
+            bw2_mutexUnlock(&multi->lock);
+
+            if (responded && !slot->waited) {
+                int crv = bw2_wait(&slot->completion);
+                slot->waited = true;
+                if (crv != 0) {
+                    /* The stream never started, so the user has not heard of it. */
+                    multi->fail(multi, slot->index, crv);
+                    ended = true;
+                    if (rv == 0) {
+                        rv = crv;
+                    }
+                }
+            }
+            if (slot->waited && ended) {
+                slot->inuse = false;
+                active--;
+            }
+        }
+    }
+
+    bw2_condDestroy(&multi->condvar);
+destroylock:
+    bw2_mutexDestroy(&multi->lock);
+freeslots:
+    bw2_allocatorFree(&multi->client->allocator, BW2_ALLOC_MULTI, slots);
+    return rv;
+}
+
+bool _bw2_multiQuery_cb(struct bw2_simpleMessage* sm, bool final, int error, union bw2_userctx ctx) {
+    struct bw2_multiSlot* slot = ctx.ptr;
+    struct bw2_multimsg_ctx* mctx = slot->multi->userctx;
+
+    bool stop = true;
+    if (mctx->on_message != NULL) {
+        stop = mctx->on_message(sm, slot->index, final, error, mctx->ctx);
+    }
+    if (final || stop) {
+        _bw2_multiNotify(slot, &slot->ended);
+    }
+    return stop;
+}
+
+void _bw2_multiQueryStart(struct bw2_multiSlot* slot) {
+    struct bw2_queryParams p;
+    memcpy(&p, slot->multi->params, sizeof(struct bw2_queryParams));
+    p.uri = slot->multi->uris[slot->index];
+    p.cancel = NULL;
+
+    slot->req.smctx.on_message = _bw2_multiQuery_cb;
+    slot->req.smctx.ctx.ptr = slot;
+    bw2_queryAsync(slot->multi->client, &p, &slot->req.smctx, &slot->completion);
+}
+
+void _bw2_multiQueryFail(struct bw2_multi* multi, size_t index, int error) {
+    struct bw2_multimsg_ctx* mctx = multi->userctx;
+    if (mctx->on_message != NULL) {
+        mctx->on_message(NULL, index, true, error, mctx->ctx);
+    }
+}
+
+int bw2_queryMulti(struct bw2_client* client, struct bw2_queryParams* p, char** uris, size_t count, size_t concurrency, struct bw2_multimsg_ctx* mctx) {
+    struct bw2_multi multi;
+    multi.client = client;
+    multi.uris = uris;
+    multi.params = p;
+    multi.userctx = mctx;
+    multi.start = _bw2_multiQueryStart;
+    multi.fail = _bw2_multiQueryFail;
+    return _bw2_multi(&multi, count, concurrency, p->cancel);
+}
+
+bool _bw2_multiList_cb(char* arr, size_t arrlen, bool final, int error, union bw2_userctx ctx) {
+    struct bw2_multiSlot* slot = ctx.ptr;
+    struct bw2_multiarr_ctx* mctx = slot->multi->userctx;
+
+    bool stop = true;
+    if (mctx->on_message != NULL) {
+        stop = mctx->on_message(arr, arrlen, slot->index, final, error, mctx->ctx);
+    }
+    if (final || stop) {
+        _bw2_multiNotify(slot, &slot->ended);
+    }
+    return stop;
+}
+
+void _bw2_multiListStart(struct bw2_multiSlot* slot) {
+    struct bw2_listParams p;
+    memcpy(&p, slot->multi->params, sizeof(struct bw2_listParams));
+    p.uri = slot->multi->uris[slot->index];
+    p.cancel = NULL;
+
+    slot->req.lctx.on_message = _bw2_multiList_cb;
+    slot->req.lctx.ctx.ptr = slot;
+    bw2_listAsync(slot->multi->client, &p, &slot->req.lctx, &slot->completion);
+}
+
+void _bw2_multiListFail(struct bw2_multi* multi, size_t index, int error) {
+    struct bw2_multiarr_ctx* mctx = multi->userctx;
+    if (mctx->on_message != NULL) {
+        mctx->on_message(NULL, 0, index, true, error, mctx->ctx);
+    }
+}
+
+int bw2_listMulti(struct bw2_client* client, struct bw2_listParams* p, char** uris, size_t count, size_t concurrency, struct bw2_multiarr_ctx* mctx) {
+    struct bw2_multi multi;
+    multi.client = client;
+    multi.uris = uris;
+    multi.params = p;
+    multi.userctx = mctx;
+    multi.start = _bw2_multiListStart;
+    multi.fail = _bw2_multiListFail;
+    return _bw2_multi(&multi, count, concurrency, p->cancel);
+}
+
+bool _bw2_createDOT_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    (void) final;
+
+    if (frame != NULL) {
+        struct bw2_createDOT_ctx* cdctx = &((struct bw2_completion*) ctx)->out.createDOT;
+
+        if (cdctx->dothash != NULL) {
+            struct bw2_header* hashhdr = bw2_getFirstHeader(frame, "hash");
+            if (hashhdr != NULL) {
+                bw2_dotHash_set(cdctx->dothash, hashhdr->value, hashhdr->len);
+            }
+        }
+        if (cdctx->dot != NULL) {
+            struct bw2_payloadobj* dotpo = frame->pos;
+            if (dotpo != NULL) {
+                bw2_dot_set(cdctx->dot, dotpo->po, dotpo->polen);
+            }
+        }
+        rctx->rv = bw2_frameMustResponse(frame);
+    }
+
+    bw2_reqctxSignal(rctx);
+
+    return true;
+}
+
+int bw2_createDOTAsync(struct bw2_client* client, struct bw2_createDOTParams* p, struct bw2_dotHash* dothash, struct bw2_dot* dot, struct bw2_completion* completion) {
+    completion->out.createDOT.dothash = dothash;
+    completion->out.createDOT.dot = dot;
+    bw2_reqctxInit(&completion->reqctx, _bw2_createDOT_cb, completion);
+    _bw2_completionInit(client, completion, &completion->reqctx);
+    BW2_REQUEST_SET_DEADLINE(p, &completion->reqctx)
+
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_MAKE_DOT, _bw2_getSeqNo(client));
+
+    BW2_REQUEST_ADD_EXPIRY(p, &req)
+    BW2_REQUEST_ADD_CONTACT(p, &req)
+    BW2_REQUEST_ADD_COMMENT(p, &req)
+    BW2_REQUEST_ADD_REVOKERS(p, &req)
+    BW2_REQUEST_ADD_OMIT_CREATION_DATE(p, &req)
+    BW2_REQUEST_ADD_TTL(p, &req)
+    BW2_REQUEST_ADD_TO(p, &req)
+    BW2_REQUEST_ADD_IS_PERMISSION(p, &req)
+    if (p->isPermission) {
+        return _bw2_completionFail(completion, BW2_ERROR_OPERATION_NOT_SUPPORTED);
+    }
+    BW2_REQUEST_ADD_URI(p, &req)
+    BW2_REQUEST_ADD_ACCESS_PERMISSIONS(p, &req)
+
+    return _bw2_completionStart(client, &req, completion);
+}
+
+int bw2_createDOT(struct bw2_client* client, struct bw2_createDOTParams* p, struct bw2_dotHash* dothash, struct bw2_dot* dot) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    bw2_createDOTAsync(client, p, dothash, dot, &completion);
+    return bw2_wait(&completion);
+}
+
+bool _bw2_createEntity_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    (void) final;
+
+    if (frame != NULL) {
+        struct bw2_createEntity_ctx* cectx = &((struct bw2_completion*) ctx)->out.createEntity;
+        if (cectx->vkhash != NULL) {
+            struct bw2_header* vkhdr = bw2_getFirstHeader(frame, "vk");
+            if (vkhdr != NULL) {
+                bw2_vkHash_set(cectx->vkhash, vkhdr->value, vkhdr->len);
+            }
+        }
+        if (cectx->vk != NULL) {
+            struct bw2_payloadobj* vkpo = frame->pos;
+            if (vkpo != NULL) {
+                bw2_vk_set(cectx->vk, vkpo->po, vkpo->polen);
+            }
+        }
+        rctx->rv = bw2_frameMustResponse(frame);
+    }
+
+    bw2_reqctxSignal(rctx);
+
+    return true;
+}
+
+int bw2_createEntityAsync(struct bw2_client* client, struct bw2_createEntityParams* p, struct bw2_vkHash* vkhash, struct bw2_vk* vk, struct bw2_completion* completion) {
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_MAKE_ENTITY, _bw2_getSeqNo(client));
+
+    BW2_REQUEST_ADD_EXPIRY(p, &req)
+    BW2_REQUEST_ADD_CONTACT(p, &req)
+    BW2_REQUEST_ADD_COMMENT(p, &req)
+    BW2_REQUEST_ADD_REVOKERS(p, &req)
+    BW2_REQUEST_ADD_OMIT_CREATION_DATE(p, &req)
+
+    completion->out.createEntity.vkhash = vkhash;
+    completion->out.createEntity.vk = vk;
+    bw2_reqctxInit(&completion->reqctx, _bw2_createEntity_cb, completion);
+    _bw2_completionInit(client, completion, &completion->reqctx);
+    BW2_REQUEST_SET_DEADLINE(p, &completion->reqctx)
+
+    return _bw2_completionStart(client, &req, completion);
+}
+
+int bw2_createEntity(struct bw2_client* client, struct bw2_createEntityParams* p, struct bw2_vkHash* vkhash, struct bw2_vk* vk) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    bw2_createEntityAsync(client, p, vkhash, vk, &completion);
+    return bw2_wait(&completion);
+}
+
+bool _bw2_createDOTChain_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    (void) final;
+
+    if (frame != NULL) {
+        struct bw2_dotChainHash* dotchainhash = ((struct bw2_completion*) ctx)->out.dotchainhash;
+        if (dotchainhash != NULL) {
+            struct bw2_header* hashhdr = bw2_getFirstHeader(frame, "hash");
+            if (hashhdr != NULL) {
+                bw2_dotChainHash_set(dotchainhash, hashhdr->value, hashhdr->len);
+            }
+        }
+        rctx->rv = bw2_frameMustResponse(frame);
+    }
+
+    bw2_reqctxSignal(rctx);
+
+    return true;
+}
+
+int bw2_createDOTChainAsync(struct bw2_client* client, struct bw2_createDOTChainParams* p, struct bw2_dotChainHash* dotchainhash, struct bw2_completion* completion) {
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_MAKE_CHAIN, _bw2_getSeqNo(client));
+
+    BW2_REQUEST_ADD_IS_PERMISSION(p, &req)
+    BW2_REQUEST_ADD_UNELABORATE(p, &req)
+    BW2_REQUEST_ADD_DOTS(p, &req)
+
+    completion->out.dotchainhash = dotchainhash;
+    bw2_reqctxInit(&completion->reqctx, _bw2_createDOTChain_cb, completion);
+    _bw2_completionInit(client, completion, &completion->reqctx);
+    BW2_REQUEST_SET_DEADLINE(p, &completion->reqctx)
+
+    return _bw2_completionStart(client, &req, completion);
+}
+
+int bw2_createDOTChain(struct bw2_client* client, struct bw2_createDOTChainParams* p, struct bw2_dotChainHash* dotchainhash) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    bw2_createDOTChainAsync(client, p, dotchainhash, &completion);
+    return bw2_wait(&completion);
+}
+
+bool _bw2_buildChain_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    bool gotResp;
+    bw2_reqctxSignalled(rctx, &gotResp);
+
+    if (gotResp) {
+        /* Deliver this frame to the application via the on_chain function,
+         * and collect the chains for the chain cache.
+         */
+        struct bw2_simplechain_ctx* scctx = ctx;
+        bool stop = false;
+        if (frame == NULL) {
+            if (scctx->builder != NULL) {
+                bw2_chainCacheBuilderDiscard(scctx->builder);
+                scctx->builder = NULL;
+            }
+            if (scctx->on_chain != NULL) {
+                scctx->on_chain(NULL, final, rctx->rv, scctx->ctx);
+            }
+            return true;
+        }
+
+        struct bw2_chainCacheBuilder* builder = scctx->builder;
+        struct bw2_simpleChain sc;
+        struct bw2_simpleChain* scp = NULL;
+
+        /* A frame with objects left out (because the frame heap was full or a
+         * memory budget was exceeded) holds only part of a chain, which must
+         * not be served from the cache.
+         */
+        if (builder != NULL && frame->dropped != 0) {
+            bw2_chainCacheBuilderFail(builder);
+        }
+        struct bw2_header* hashhdr = bw2_getFirstHeader(frame, "hash");
+        if (hashhdr != NULL) {
+            struct bw2_header* permissionshdr = bw2_getFirstHeader(frame, "permissions");
+            struct bw2_header* tohdr = bw2_getFirstHeader(frame, "to");
+            struct bw2_header* urihdr = bw2_getFirstHeader(frame, "uri");
+            struct bw2_payloadobj* contentpo = frame->pos;
+
+            sc.hash = hashhdr->value;
+            sc.hash_len = hashhdr->len;
+            if (permissionshdr != NULL) {
+                sc.permissions = permissionshdr->value;
+                sc.permissions_len = permissionshdr->len;
+            } else {
+                sc.permissions = NULL;
+                sc.permissions_len = 0;
+            }
+            if (tohdr != NULL) {
+                sc.to = tohdr->value;
+                sc.to_len = tohdr->len;
+            } else {
+                sc.to = NULL;
+                sc.to_len = 0;
+            }
+            if (urihdr != NULL) {
+                sc.uri = urihdr->value;
+                sc.uri_len = urihdr->len;
+            } else {
+                sc.uri = NULL;
+                sc.uri_len = 0;
+            }
+            if (contentpo != NULL) {
+                sc.content = contentpo->po;
+                sc.content_len = contentpo->polen;
+            } else {
+                sc.content = NULL;
+                sc.content_len = 0;
+            }
+            if (builder != NULL) {
+                bw2_chainCacheBuilderAdd(builder, &sc);
+            }
+            scp = &sc;
+        }
+
+        /* Only the complete set of chains is cached. SCCTX may be deallocated
+         * as soon as on_chain is called with FINAL set or returns true, so the
+         * builder is finished before calling it, and discarded afterwards
+         * through the local copy.
+         */
+        if (builder != NULL && final) {
+            scctx->builder = NULL;
+            bw2_chainCacheBuilderFinish(&rctx->client->chaincache, builder);
+        }
+        if ((scp != NULL || final) && scctx->on_chain != NULL) {
+            stop = scctx->on_chain(scp, final, 0, scctx->ctx);
+        }
+        if (builder != NULL && !final && stop) {
+            bw2_chainCacheBuilderDiscard(builder);
+        }
+        return stop;
+    } else {
+        /* This should be the RESP frame. If the request failed, no chains
+         * will follow it.
+         */
+        struct bw2_simplechain_ctx* scctx = ctx;
+        if (frame != NULL) {
+            rctx->rv = bw2_frameMustResponse(frame);
+        }
+        if (rctx->rv != 0 && scctx->builder != NULL) {
+            bw2_chainCacheBuilderDiscard(scctx->builder);
+            scctx->builder = NULL;
+        }
+        bw2_reqctxSignal(rctx);
+        return (rctx->rv != 0);
+    }
+}
+
+void _bw2_chainCacheKeyFromParams(struct bw2_buildChainParams* p, struct bw2_chainCacheKey* key) {
+    key->uri = p->uri;
+    key->urilen = strlen(p->uri);
+    key->permissions = p->accessPermissions;
+    key->permissionslen = strlen(p->accessPermissions);
+    key->to = p->to->vkhash;
+    key->tolen = p->to->vkhashlen;
+}
+
+/* Delivers the chains in ENTRY as if they had been streamed from the agent. */
+void _bw2_chainCacheDeliver(struct bw2_chainCacheEntry* entry, struct bw2_simplechain_ctx* scctx) {
+    size_t i;
+    if (scctx->on_chain == NULL) {
+        return;
+    }
+    for (i = 0; i != entry->numChains; i++) {
+        struct bw2_simpleChain sc;
+        bw2_chainCacheGetChain(entry, i, &sc);
+        if (scctx->on_chain(&sc, false, 0, scctx->ctx)) {
+            return;
+        }
+    }
+    scctx->on_chain(NULL, true, 0, scctx->ctx);
+}
+
+/* Builds chains without looking in the chain cache first. */
+int _bw2_buildChainUncached(struct bw2_client* client, struct bw2_buildChainParams* p, struct bw2_simplechain_ctx* scctx) {
+    struct bw2_chainCacheKey key;
+    _bw2_chainCacheKeyFromParams(p, &key);
+
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_BUILD_CHAIN, _bw2_getSeqNo(client));
+
+    BW2_REQUEST_ADD_URI(p, &req)
+    BW2_REQUEST_ADD_TO(p, &req)
+    BW2_REQUEST_ADD_ACCESS_PERMISSIONS(p, &req)
+
+    scctx->builder = bw2_chainCacheBuilderNew(&client->chaincache, &key);
+    bw2_reqctxInit(&scctx->reqctx, _bw2_buildChain_cb, scctx);
+    BW2_REQUEST_SET_DEADLINE(p, &scctx->reqctx)
+    int rv = bw2_transact(client, &req, &scctx->reqctx);
+    if (rv != 0) {
+        /* No frames will be delivered for the request. */
+        if (scctx->builder != NULL) {
+            bw2_chainCacheBuilderDiscard(scctx->builder);
+            scctx->builder = NULL;
+        }
+        goto done;
+    }
+    bw2_reqctxWait(&scctx->reqctx);
+
+done:
+    bw2_reqctxDestroy(&scctx->reqctx);
+    return scctx->reqctx.rv;
+}
+
+int bw2_buildChain(struct bw2_client* client, struct bw2_buildChainParams* p, struct bw2_simplechain_ctx* scctx) {
+    struct bw2_chainCacheKey key;
+    _bw2_chainCacheKeyFromParams(p, &key);
+
+    struct bw2_chainCacheEntry* entry = bw2_chainCacheLookup(&client->chaincache, &key);
+    if (entry != NULL) {
+        _bw2_chainCacheDeliver(entry, scctx);
+        bw2_chainCacheRelease(&client->chaincache, entry);
+        scctx->reqctx.rv = 0;
+        return 0;
+    }
+    return _bw2_buildChainUncached(client, p, scctx);
+}
+
+int bw2_setReconnect(struct bw2_client* client, struct bw2_reconnectParams* params) {
+    bw2_mutexLock(&client->reqslock);
+    memcpy(&client->reconnect, params, sizeof(struct bw2_reconnectParams));
+    if (client->reconnect.initialDelay == 0) {
+        client->reconnect.initialDelay = BW2_RECONNECT_DEFAULT_INITIAL_DELAY;
+    }
+    if (client->reconnect.maxDelay == 0) {
+        client->reconnect.maxDelay = BW2_RECONNECT_DEFAULT_MAX_DELAY;
+    }
+    client->reconnect.maxDelay = BW2_MAX(client->reconnect.maxDelay, client->reconnect.initialDelay);
+    if (client->jitterstate == 0) {
+        client->jitterstate = (uint32_t) bw2_getTimeMicros() ^ (uint32_t) (uintptr_t) client;
+        if (client->jitterstate == 0) {
+            client->jitterstate = 1;
+        }
+    }
+    bw2_mutexUnlock(&client->reqslock);
+    return 0;
+}
+
+int bw2_setWaitPolicy(struct bw2_client* client, struct bw2_waitPolicy* policy) {
+    memcpy(&client->waitpolicy, policy, sizeof(struct bw2_waitPolicy));
+    __atomic_store_n(&client->waitlatency, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int bw2_setFramePool(struct bw2_client* client, struct bw2_framePoolParams* params) {
+    return bw2_framePoolConfigure(&client->framepool, params);
+}
+
+void bw2_getFramePoolStats(struct bw2_client* client, struct bw2_framePoolStats* stats) {
+    bw2_framePoolGetStats(&client->framepool, stats);
+}
+
+int bw2_setFrameSpill(struct bw2_client* client, char* spill, size_t spillsize) {
+    client->spill = spill;
+    client->spillsize = spillsize;
+    return 0;
+}
+
+int bw2_setPayloadAlignment(struct bw2_client* client, size_t alignment) {
+    if ((alignment & (alignment - 1)) != 0) {
+        return BW2_ERROR_BAD_ARG;
+    }
+    client->poalign = alignment;
+    return 0;
+}
+
+int bw2_setMemoryBudget(struct bw2_client* client, size_t limit) {
+    client->budget.limit = limit;
+    return 0;
+}
+
+int bw2_setAllocator(struct bw2_client* client, void* (*alloc)(size_t size, void* ctx), void (*free)(void* ptr, void* ctx), void* ctx) {
+    struct bw2_allocStats stats;
+    int i;
+
+    if ((alloc == NULL) != (free == NULL)) {
+        return BW2_ERROR_BAD_ARG;
+    }
+
+    /* Memory from the old allocator, such as blocks kept in the frame pool or
+     * the chain cache's buckets, would later be freed with the new one.
+     */
+    bw2_allocatorGetStats(&client->allocator, &stats);
+    for (i = 0; i != BW2_ALLOC_NUM_SITES; i++) {
+        if (stats.sites[i].allocs != 0) {
+            return BW2_ERROR_OPERATION_NOT_SUPPORTED;
+        }
+    }
+
+    client->allocator.alloc = alloc;
+    client->allocator.free = free;
+    client->allocator.ctx = ctx;
+    return 0;
+}
+
+void bw2_getAllocStats(struct bw2_client* client, struct bw2_allocStats* stats) {
+    bw2_allocatorGetStats(&client->allocator, stats);
+}
+
+void bw2_getMemoryBudgetStats(struct bw2_client* client, struct bw2_memBudgetStats* stats) {
+    bw2_memBudgetGetStats(&client->budget, stats);
+}
+
+void bw2_getFrameStats(struct bw2_client* client, struct bw2_frameStats* stats) {
+    bw2_frameStatsGet(&client->framestats, stats);
+}
+
+int bw2_setChainCache(struct bw2_client* client, struct bw2_chainCacheParams* params) {
+    return bw2_chainCacheConfigure(&client->chaincache, params);
+}
+
+int bw2_setAutoPAC(struct bw2_client* client, bool enabled) {
+    /* Resolved PACs are kept in the chain cache. */
+    bw2_mutexLock(&client->chaincache.lock);
+    bool cacheEnabled = (client->chaincache.maxEntries != 0);
+    bw2_mutexUnlock(&client->chaincache.lock);
+    if (enabled && !cacheEnabled) {
+        struct bw2_chainCacheParams params;
+        memset(&params, 0x00, sizeof(params));
+        int rv = bw2_chainCacheConfigure(&client->chaincache, &params);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    bw2_mutexLock(&client->reqslock);
+    client->autopac = enabled;
+    bw2_mutexUnlock(&client->reqslock);
+    return 0;
+}
+
+void bw2_getChainCacheStats(struct bw2_client* client, struct bw2_chainCacheStats* stats) {
+    bw2_chainCacheGetStats(&client->chaincache, stats);
+}
+
+size_t bw2_invalidateChainCache(struct bw2_client* client, struct bw2_buildChainParams* p) {
+    struct bw2_chainCacheKey key;
+    if (p == NULL) {
+        return bw2_chainCacheInvalidate(&client->chaincache, NULL);
+    }
+    _bw2_chainCacheKeyFromParams(p, &key);
+    return bw2_chainCacheInvalidate(&client->chaincache, &key);
+}
+
+int bw2_invalidateChainCacheByHash(struct bw2_client* client, struct bw2_dotChainHash* dotchainhash, size_t* removed) {
+    struct bw2_hash hash;
+    int rv = bw2_dotChainHash_toBinary(dotchainhash, &hash);
+    if (rv != 0) {
+        return rv;
+    }
+    size_t count = bw2_chainCacheInvalidateChain(&client->chaincache, &hash);
+    if (removed != NULL) {
+        *removed = count;
+    }
+    return 0;
+}
+
+/* Applies the budget and retention policy of the request that FRAME is for.
+ * The policy only applies to results, so that responses are read in full.
+ */
+void _bw2_clientFrameHeader(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, void* ctx) {
+    struct bw2_client* client = ctx;
+    struct bw2_reqctx* curr;
+
+    /* Most frames are for requests without a budget or policy of their own,
+     * which need not be looked up.
+     */
+    if (__atomic_load_n(&client->reqsfiltered, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    bw2_mutexLock(&client->reqslock);
+    for (curr = client->reqs; curr != NULL; curr = curr->next) {
+        if (curr->seqno == frame->seqno) {
+            if (curr->budget != NULL) {
+                alloc->budget = curr->budget;
+            }
+            if (memcmp(frame->cmd, BW2_FRAME_CMD_RESULT, 4) == 0) {
+                alloc->policy = curr->policy;
+            }
+            break;
+        }
+    }
+    bw2_mutexUnlock(&client->reqslock);
+}
+
+void _bw2_clientFrameAlloc(struct bw2_client* client, struct bw2_frameAlloc* alloc, char* frameheap, size_t heapsize) {
+    alloc->frameheap = frameheap;
+    alloc->heapsize = heapsize;
+    alloc->spill = client->spill;
+    alloc->spillsize = client->spillsize;
+    alloc->pool = &client->framepool;
+    alloc->poalign = client->poalign;
+    alloc->stats = &client->framestats;
+    alloc->budget = &client->budget;
+    alloc->policy = NULL;
+    alloc->onheader = _bw2_clientFrameHeader;
+    alloc->onheaderctx = client;
+}
 
-    bw2_reqctxDestroy(&qctx->reqctx);
-    return qctx->reqctx.rv;
+/* Must be called with client->reqslock held. */
+bool _bw2_shouldReconnect(struct bw2_client* client) {
+    bool closing;
+    if (!client->reconnect.enabled) {
+        return false;
+    }
+    bw2_mutexLock(&client->outlock);
+    closing = client->closing;
+    bw2_mutexUnlock(&client->outlock);
+    return !closing;
 }
 
-bool _bw2_list_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
-    bool gotResp;
-    bw2_reqctxSignalled(rctx, &gotResp);
+/* Returns a delay between half of DELAY and DELAY, so that clients that lost
+ * the same agent spread out their reconnection attempts.
+ */
+uint64_t _bw2_jitter(struct bw2_client* client, uint64_t delay) {
+    /* xorshift32 */
+    uint32_t x = client->jitterstate;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    client->jitterstate = x;
+    return (delay / 2) + (x % (delay - (delay / 2) + 1));
+}
 
-    if (gotResp) {
-        /* Deliver this frame to the application via the on_message function. */
-        struct bw2_chararr_ctx* lctx = ctx;
-        if (frame == NULL) {
-            if (lctx->on_message != NULL) {
-                lctx->on_message(NULL, 0, final, rctx->rv, lctx->ctx);
-            }
-            return true;
-        } else if (lctx->on_message != NULL) {
-            struct bw2_header* childhdr = bw2_getFirstHeader(frame, "child");
+/* This callback is used for the RESP frame of a replayed subscription. */
+bool _bw2_replay_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
+    struct bw2_replaySub* replay = ctx;
+    struct bw2_simplemsg_ctx* smctx = replay->smctx;
+    (void) final;
 
-            char* childuri;
-            size_t childuri_len;
-            if (childhdr == NULL) {
-                childuri = NULL;
-                childuri_len = 0;
-            } else {
-                childuri = childhdr->value;
-                childuri_len = childhdr->len;
-            }
-            return lctx->on_message(childuri, childuri_len, final, 0, lctx->ctx);
+    if (frame != NULL) {
+        rctx->rv = bw2_frameMustResponse(frame);
+    }
+    if (rctx->rv == 0) {
+        struct bw2_header* handlehdr = bw2_getFirstHeader(frame, "handle");
+        if (handlehdr == NULL) {
+            rctx->rv = BW2_ERROR_MISSING_HEADER;
+        } else {
+            bw2_subscriptionHandle_set(&replay->current, handlehdr->value, handlehdr->len);
         }
-        return false;
-    } else {
-        /* This should be the RESP frame. */
-        if (frame != NULL) {
-            rctx->rv = bw2_frameMustResponse(frame);
+    }
+
+    if (rctx->rv != 0) {
+        /* The subscription could not be made again, so it has ended. */
+        if (smctx->on_message != NULL) {
+            smctx->on_message(NULL, true, rctx->rv, smctx->ctx);
         }
-        bw2_reqctxSignal(rctx);
-        return (rctx->rv != 0);
+        return true;
     }
+
+    /* Future frames should be handled by the Simple Message. */
+    rctx->onframe = _bw2_simpleMessage_cb;
+    rctx->ctx = smctx;
+    return false;
 }
 
-int bw2_list(struct bw2_client* client, struct bw2_listParams* p, struct bw2_chararr_ctx* lctx) {
+/* Sends the SUBSCRIBE frame for a replayed subscription. Must be called with
+ * client->reqslock held.
+ */
+int _bw2_replaySubscription(struct bw2_client* client, struct bw2_replaySub* replay) {
+    struct bw2_subscribeParams* p = &replay->params;
     struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_LIST, _bw2_getSeqNo(client));
+    bw2_frameInit(&req, BW2_FRAME_CMD_SUBSCRIBE, _bw2_getSeqNo(client));
 
     BW2_REQUEST_ADD_AUTOCHAIN(p, &req)
     BW2_REQUEST_ADD_EXPIRY(p, &req)
@@ -588,297 +2766,331 @@ int bw2_list(struct bw2_client* client, struct bw2_listParams* p, struct bw2_cha
     BW2_REQUEST_ADD_PRIMARY_ACCESS_CHAIN(p, &req)
     BW2_REQUEST_ADD_ROUTING_OBJECTS(p, &req)
     BW2_REQUEST_ADD_ELABORATE_PAC(p, &req)
+    BW2_REQUEST_ADD_LEAVE_PACKED(p, &req)
     BW2_REQUEST_ADD_VERIFY(p, &req)
 
-    bw2_reqctxInit(&lctx->reqctx, _bw2_list_cb, lctx);
-    int rv = bw2_transact(client, &req, &lctx->reqctx);
-    if (rv != 0) {
-        goto done;
-    }
-    bw2_reqctxWait(&lctx->reqctx);
+    struct bw2_reqctx* rctx = &replay->smctx->reqctx;
+    rctx->seqno = req.seqno;
+    rctx->onframe = _bw2_replay_cb;
+    rctx->ctx = replay;
 
-done:
-    bw2_reqctxDestroy(&lctx->reqctx);
-    return lctx->reqctx.rv;
+    bw2_mutexLock(&client->outlock);
+    int rv = bw2_writeFrame(&req, client->connfd);
+    bw2_mutexUnlock(&client->outlock);
+    return rv;
 }
 
-struct bw2_createDOT_ctx {
-    struct bw2_dotHash* dothash;
-    struct bw2_dot* dot;
-};
-
-bool _bw2_createDOT_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
-    (void) final;
-
-    if (frame != NULL) {
-        struct bw2_createDOT_ctx* cdctx = ctx;
+/* Sets the entity again, and makes every remembered subscription again, without
+ * waiting for the agent to respond in between. The responses are handled by
+ * the BOSSWAVE thread once it resumes reading frames.
+ */
+void _bw2_replay(struct bw2_client* client) {
+    struct bw2_replaySub* replay;
 
-        if (cdctx->dothash != NULL) {
-            struct bw2_header* hashhdr = bw2_getFirstHeader(frame, "hash");
-            if (hashhdr != NULL) {
-                bw2_dotHash_set(cdctx->dothash, hashhdr->value, hashhdr->len);
-            }
-        }
-        if (cdctx->dot != NULL) {
-            struct bw2_payloadobj* dotpo = frame->pos;
-            if (dotpo != NULL) {
-                bw2_dot_set(cdctx->dot, dotpo->po, dotpo->polen);
-            }
-        }
-        rctx->rv = bw2_frameMustResponse(frame);
-    }
+    bw2_mutexLock(&client->reqslock);
 
-    bw2_reqctxSignal(rctx);
+    if (client->entity != NULL) {
+        struct bw2_frame req;
+        bw2_frameInit(&req, BW2_FRAME_CMD_SET_ENTITY, _bw2_getSeqNo(client));
 
-    return true;
-}
+        struct bw2_payloadobj po;
+        bw2_POInit(&po, BW2_PO_NUM_ROENTITYWKEY, client->entity, client->entitylen);
+        bw2_appendPO(&req, &po);
 
-int bw2_createDOT(struct bw2_client* client, struct bw2_createDOTParams* p, struct bw2_dotHash* dothash, struct bw2_dot* dot) {
-    struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_MAKE_DOT, _bw2_getSeqNo(client));
+        struct bw2_reqctx* rctx = &client->replayEntityReqctx;
+        rctx->onframe = _bw2_simpleReq_cb;
+        rctx->ready = false;
+        rctx->seqno = req.seqno;
+        _bw2_reqsInsert(client, rctx);
 
-    BW2_REQUEST_ADD_EXPIRY(p, &req)
-    BW2_REQUEST_ADD_CONTACT(p, &req)
-    BW2_REQUEST_ADD_COMMENT(p, &req)
-    BW2_REQUEST_ADD_REVOKERS(p, &req)
-    BW2_REQUEST_ADD_OMIT_CREATION_DATE(p, &req)
-    BW2_REQUEST_ADD_TTL(p, &req)
-    BW2_REQUEST_ADD_TO(p, &req)
-    BW2_REQUEST_ADD_IS_PERMISSION(p, &req)
-    if (p->isPermission) {
-        return BW2_ERROR_OPERATION_NOT_SUPPORTED;
+        bw2_mutexLock(&client->outlock);
+        bw2_writeFrame(&req, client->connfd);
+        bw2_mutexUnlock(&client->outlock);
     }
-    BW2_REQUEST_ADD_URI(p, &req)
-    BW2_REQUEST_ADD_ACCESS_PERMISSIONS(p, &req)
-
-    struct bw2_createDOT_ctx cdctx;
-    cdctx.dothash = dothash;
-    cdctx.dot = dot;
-
-    struct bw2_reqctx reqctx;
-    bw2_reqctxInit(&reqctx, _bw2_createDOT_cb, &cdctx);
 
-    int rv = bw2_transact(client, &req, &reqctx);
-    if (rv != 0) {
-        goto done;
+    /* If writing fails, the BOSSWAVE thread will find out when it next tries
+     * to read a frame, and reconnect again.
+     */
+    for (replay = client->replays; replay != NULL; replay = replay->next) {
+        _bw2_replaySubscription(client, replay);
     }
 
-    bw2_reqctxWait(&reqctx);
-    rv = reqctx.rv;
-
-done:
-    bw2_reqctxDestroy(&reqctx);
-    return reqctx.rv;
+    bw2_mutexUnlock(&client->reqslock);
 }
 
-struct bw2_createEntity_ctx {
-    struct bw2_vkHash* vkhash;
-    struct bw2_vk* vk;
-};
+/* Called by the BOSSWAVE thread after the connection is lost. Tries to
+ * reconnect, with backoff, until it succeeds, the client is disconnected, or
+ * the maximum number of attempts is reached.
+ */
+int _bw2_reconnect(struct bw2_client* client, char* frameheap, size_t heapsize) {
+    struct bw2_reconnectParams params;
+    size_t attempt;
+    uint64_t delay;
+    int rv;
 
-bool _bw2_createEntity_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
-    (void) final;
+    bw2_mutexLock(&client->reqslock);
+    memcpy(&params, &client->reconnect, sizeof(struct bw2_reconnectParams));
+    bw2_mutexUnlock(&client->reqslock);
 
-    if (frame != NULL) {
-        struct bw2_createEntity_ctx* cectx = ctx;
-        if (cectx->vkhash != NULL) {
-            struct bw2_header* vkhdr = bw2_getFirstHeader(frame, "vk");
-            if (vkhdr != NULL) {
-                bw2_vkHash_set(cectx->vkhash, vkhdr->value, vkhdr->len);
-            }
+    if (params.on_reconnect != NULL) {
+        params.on_reconnect(false, params.ctx);
+    }
+
+    delay = params.initialDelay;
+    for (attempt = 0; params.maxAttempts == 0 || attempt < params.maxAttempts; attempt++) {
+        uint64_t deadline = bw2_getTimeMicros() + 1000 * _bw2_jitter(client, delay);
+        bool closing;
+
+        bw2_mutexLock(&client->outlock);
+        while (!client->closing && bw2_condTimedWait(&client->reconnectwake, &client->outlock, deadline) == 0);
+        closing = client->closing;
+        bw2_mutexUnlock(&client->outlock);
+        if (closing) {
+            return BW2_ERROR_CONNECTION_LOST;
         }
-        if (cectx->vk != NULL) {
-            struct bw2_payloadobj* vkpo = frame->pos;
-            if (vkpo != NULL) {
-                bw2_vk_set(cectx->vk, vkpo->po, vkpo->polen);
+
+        rv = _bw2_connectHandshake(client, (struct sockaddr*) &client->addr, client->addrlen, frameheap, heapsize);
+        if (rv == 0) {
+            bw2_mutexLock(&client->outlock);
+            closing = client->closing;
+            if (closing) {
+                close(client->connfd);
+            } else {
+                client->connected = true;
+            }
+            bw2_mutexUnlock(&client->outlock);
+            if (closing) {
+                return BW2_ERROR_CONNECTION_LOST;
             }
+
+            bw2_logf("Reconnected to BOSSWAVE router after %zu attempt(s)\n", attempt + 1);
+            _bw2_replay(client);
+            if (params.on_reconnect != NULL) {
+                params.on_reconnect(true, params.ctx);
+            }
+            return 0;
         }
-        rctx->rv = bw2_frameMustResponse(frame);
+
+        delay = BW2_MIN(delay * 2, params.maxDelay);
     }
 
-    bw2_reqctxSignal(rctx);
+    return BW2_ERROR_CONNECTION_LOST;
+}
 
-    return true;
+int bw2_cancelTokenInit(struct bw2_cancelToken* token) {
+    token->cancelled = false;
+    token->client = NULL;
+    token->reqctx = NULL;
+    if (bw2_mutexInit(&token->lock) != 0) {
+        return BW2_ERROR_SYNCHRONIZATION;
+    }
+    return 0;
 }
 
-int bw2_createEntity(struct bw2_client* client, struct bw2_createEntityParams* p, struct bw2_vkHash* vkhash, struct bw2_vk* vk) {
-    struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_MAKE_ENTITY, _bw2_getSeqNo(client));
+/* Ties TOKEN to a request that is about to be sent. Returns false if the token
+ * was already cancelled. Must be called with client->reqslock held.
+ */
+bool _bw2_cancelTokenBind(struct bw2_cancelToken* token, struct bw2_client* client, struct bw2_reqctx* reqctx) {
+    bool cancelled;
+    bw2_mutexLock(&token->lock);
+    cancelled = token->cancelled;
+    if (!cancelled) {
+        token->client = client;
+    }
+    bw2_mutexUnlock(&token->lock);
 
-    BW2_REQUEST_ADD_EXPIRY(p, &req)
-    BW2_REQUEST_ADD_CONTACT(p, &req)
-    BW2_REQUEST_ADD_COMMENT(p, &req)
-    BW2_REQUEST_ADD_REVOKERS(p, &req)
-    BW2_REQUEST_ADD_OMIT_CREATION_DATE(p, &req)
+    if (!cancelled) {
+        token->reqctx = reqctx;
+    }
+    return !cancelled;
+}
 
-    struct bw2_createEntity_ctx cectx;
-    cectx.vkhash = vkhash;
-    cectx.vk = vk;
+void bw2_cancel(struct bw2_cancelToken* token) {
+    struct bw2_client* client;
 
-    struct bw2_reqctx reqctx;
-    bw2_reqctxInit(&reqctx, _bw2_createEntity_cb, &cectx);
+    bw2_mutexLock(&token->lock);
+    token->cancelled = true;
+    client = token->client;
+    bw2_mutexUnlock(&token->lock);
 
-    int rv = bw2_transact(client, &req, &reqctx);
-    if (rv != 0) {
-        goto done;
+    if (client != NULL) {
+        bw2_mutexLock(&client->reqslock);
+        if (token->reqctx != NULL) {
+            _bw2_expireRequest(token->reqctx, BW2_ERROR_CANCELLED);
+        }
+        bw2_mutexUnlock(&client->reqslock);
     }
-
-    bw2_reqctxWait(&reqctx);
-    rv = reqctx.rv;
-
-done:
-    bw2_reqctxDestroy(&reqctx);
-    return reqctx.rv;
 }
 
-bool _bw2_createDOTChain_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
-    (void) final;
+void bw2_cancelTokenDestroy(struct bw2_cancelToken* token) {
+    bw2_mutexDestroy(&token->lock);
+}
 
-    if (frame != NULL) {
-        struct bw2_dotChainHash* dotchainhash = ctx;
-        if (dotchainhash != NULL) {
-            struct bw2_header* hashhdr = bw2_getFirstHeader(frame, "hash");
-            if (hashhdr != NULL) {
-                bw2_dotChainHash_set(dotchainhash, hashhdr->value, hashhdr->len);
-            }
+int bw2_unsubscribeAsync(struct bw2_client* client, struct bw2_subscriptionHandle* handle, struct bw2_completion* completion) {
+    struct bw2_subscriptionHandle current;
+    struct bw2_replaySub* replay;
+
+    /* A replayed subscription has a new handle after each reconnection. */
+    bw2_mutexLock(&client->reqslock);
+    for (replay = client->replays; replay != NULL; replay = replay->next) {
+        if (replay->original.handlelen == handle->handlelen && memcmp(replay->original.handle, handle->handle, handle->handlelen) == 0) {
+            memcpy(&current, &replay->current, sizeof(struct bw2_subscriptionHandle));
+            handle = &current;
+            break;
         }
-        rctx->rv = bw2_frameMustResponse(frame);
     }
+    bw2_mutexUnlock(&client->reqslock);
 
-    bw2_reqctxSignal(rctx);
+    struct bw2_frame req;
+    bw2_frameInit(&req, BW2_FRAME_CMD_UNSUBSCRIBE, _bw2_getSeqNo(client));
 
-    return true;
+    struct bw2_header handlehdr;
+    bw2_KVInit(&handlehdr, "handle", handle->handle, handle->handlelen);
+    bw2_appendKV(&req, &handlehdr);
+
+    bw2_reqctxInit(&completion->reqctx, _bw2_simpleReq_cb, NULL);
+    _bw2_completionInit(client, completion, &completion->reqctx);
+
+    return _bw2_completionStart(client, &req, completion);
 }
 
-int bw2_createDOTChain(struct bw2_client* client, struct bw2_createDOTChainParams* p, struct bw2_dotChainHash* dotchainhash) {
-    struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_MAKE_CHAIN, _bw2_getSeqNo(client));
+int bw2_unsubscribe(struct bw2_client* client, struct bw2_subscriptionHandle* handle) {
+    struct bw2_completion completion;
+    completion.on_complete = NULL;
+    bw2_unsubscribeAsync(client, handle, &completion);
+    return bw2_wait(&completion);
+}
 
-    BW2_REQUEST_ADD_IS_PERMISSION(p, &req)
-    BW2_REQUEST_ADD_UNELABORATE(p, &req)
-    BW2_REQUEST_ADD_DOTS(p, &req)
+bool bw2_completionDone(struct bw2_completion* completion) {
+    bool done;
+    bw2_reqctxSignalled(completion->rctx, &done);
+    return done;
+}
 
-    struct bw2_reqctx reqctx;
-    bw2_reqctxInit(&reqctx, _bw2_createDOTChain_cb, dotchainhash);
+int bw2_completionResult(struct bw2_completion* completion) {
+    return completion->rctx->rv;
+}
 
-    int rv = bw2_transact(client, &req, &reqctx);
-    if (rv != 0) {
-        goto done;
+int bw2_wait(struct bw2_completion* completion) {
+    bw2_reqctxWait(completion->rctx);
+
+    /* The request context of a subscription, query or list keeps being used
+     * for as long as results arrive, so only the completion's own is
+     * destroyed.
+     */
+    if (completion->rctx == &completion->reqctx) {
+        bw2_reqctxDestroy(completion->rctx);
     }
 
-    bw2_reqctxWait(&reqctx);
-    rv = reqctx.rv;
+    /* A subscription that was not made is not replayed. */
+    if (completion->replay != NULL && completion->rctx->replay == NULL) {
+        bw2_allocatorFree(&completion->client->allocator, BW2_ALLOC_REPLAY, completion->replay);
+    }
+    completion->replay = NULL;
 
-done:
-    bw2_reqctxDestroy(&reqctx);
-    return reqctx.rv;
+    return completion->rctx->rv;
 }
 
-bool _bw2_buildChain_cb(struct bw2_frame* frame, bool final, struct bw2_reqctx* rctx, void* ctx) {
-    bool gotResp;
-    bw2_reqctxSignalled(rctx, &gotResp);
-
-    if (gotResp) {
-        /* Deliver this frame to the application via the on_chain function. */
-        struct bw2_simplechain_ctx* scctx = ctx;
-        if (frame == NULL) {
-            if (scctx->on_chain != NULL) {
-                scctx->on_chain(NULL, final, rctx->rv, scctx->ctx);
-            }
-            return true;
-        } else if (scctx->on_chain != NULL) {
-            struct bw2_header* hashhdr = bw2_getFirstHeader(frame, "hash");
-
-            if (hashhdr != NULL) {
-                struct bw2_simpleChain sc;
-                struct bw2_header* permissionshdr = bw2_getFirstHeader(frame, "permissions");
-                struct bw2_header* tohdr = bw2_getFirstHeader(frame, "to");
-                struct bw2_header* urihdr = bw2_getFirstHeader(frame, "uri");
-                struct bw2_payloadobj* contentpo = frame->pos;
-
-                sc.hash = hashhdr->value;
-                sc.hash_len = hashhdr->len;
-                if (permissionshdr != NULL) {
-                    sc.permissions = permissionshdr->value;
-                    sc.permissions_len = permissionshdr->len;
-                } else {
-                    sc.permissions = NULL;
-                    sc.permissions_len = 0;
-                }
-                if (tohdr != NULL) {
-                    sc.to = tohdr->value;
-                    sc.to_len = tohdr->len;
-                } else {
-                    sc.to = NULL;
-                    sc.to_len = 0;
-                }
-                if (urihdr != NULL) {
-                    sc.uri = urihdr->value;
-                    sc.uri_len = urihdr->len;
-                } else {
-                    sc.uri = NULL;
-                    sc.uri_len = 0;
-                }
-                if (contentpo != NULL) {
-                    sc.content = contentpo->po;
-                    sc.content_len = contentpo->polen;
-                } else {
-                    sc.content = NULL;
-                    sc.content_len = 0;
-                }
-                return scctx->on_chain(&sc, final, 0, scctx->ctx);
-            } else if (final) {
-                return scctx->on_chain(NULL, final, 0, scctx->ctx);
-            }
+int bw2_waitAll(struct bw2_completion** completions, size_t count) {
+    int rv = 0;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        int crv = bw2_wait(completions[i]);
+        if (rv == 0) {
+            rv = crv;
         }
-        return false;
-    } else {
-        /* This should be the RESP frame. */
-        if (frame != NULL) {
-            rctx->rv = bw2_frameMustResponse(frame);
+    }
+    return rv;
+}
+
+/* Returns the index of a finished completion, or COUNT if none has finished. */
+size_t _bw2_findDone(struct bw2_completion** completions, size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (bw2_completionDone(completions[i])) {
+            break;
         }
-        bw2_reqctxSignal(rctx);
-        return (rctx->rv != 0);
     }
+    return i;
 }
 
-int bw2_buildChain(struct bw2_client* client, struct bw2_buildChainParams* p, struct bw2_simplechain_ctx* scctx) {
-    struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_BUILD_CHAIN, _bw2_getSeqNo(client));
+int bw2_waitAny(struct bw2_completion** completions, size_t count, size_t* index) {
+    struct bw2_reqctxWaiter waiter;
+    size_t registered;
+    size_t i;
 
-    BW2_REQUEST_ADD_URI(p, &req)
-    BW2_REQUEST_ADD_TO(p, &req)
-    BW2_REQUEST_ADD_ACCESS_PERMISSIONS(p, &req)
+    if (count == 0) {
+        return BW2_ERROR_BAD_ARG;
+    }
 
-    bw2_reqctxInit(&scctx->reqctx, _bw2_buildChain_cb, NULL);
-    int rv = bw2_transact(client, &req, &scctx->reqctx);
-    if (rv != 0) {
-        goto done;
+    bw2_mutexInit(&waiter.lock);
+    bw2_condInit(&waiter.condvar);
+    waiter.fired = false;
+
+    /* Ask every request to wake us up, unless one has already finished. */
+    for (registered = 0; registered < count; registered++) {
+        struct bw2_reqctx* rctx = completions[registered]->rctx;
+        bw2_mutexLock(&rctx->lock);
+        bool done = rctx->ready;
+        if (!done) {
+            rctx->waiter = &waiter;
+        }
+        bw2_mutexUnlock(&rctx->lock);
+        if (done) {
+            break;
+        }
     }
-    bw2_reqctxWait(&scctx->reqctx);
 
-done:
-    bw2_reqctxDestroy(&scctx->reqctx);
-    return scctx->reqctx.rv;
-}
+    i = registered;
+    while (i == count) {
+        /* Nothing else may be servicing the deadlines of these requests, so
+         * wake up for the earliest one.
+         */
+        uint64_t deadline = 0;
+        for (i = 0; i < count; i++) {
+            uint64_t d = completions[i]->rctx->deadline;
+            if (d != 0 && (deadline == 0 || d < deadline)) {
+                deadline = d;
+            }
+        }
 
-int bw2_unsubscribe(struct bw2_client* client, struct bw2_subscriptionHandle* handle) {
-    struct bw2_frame req;
-    bw2_frameInit(&req, BW2_FRAME_CMD_UNSUBSCRIBE, _bw2_getSeqNo(client));
+        int waitrv = 0;
+        bw2_mutexLock(&waiter.lock);
+        if (!waiter.fired) {
+            if (deadline == 0) {
+                bw2_condWait(&waiter.condvar, &waiter.lock);
+            } else {
+                waitrv = bw2_condTimedWait(&waiter.condvar, &waiter.lock, deadline * 1000);
+            }
+        }
+        waiter.fired = false;
+        bw2_mutexUnlock(&waiter.lock);
+
+        if (waitrv == ETIMEDOUT) {
+            for (i = 0; i < count; i++) {
+                struct bw2_reqctx* rctx = completions[i]->rctx;
+                if (rctx->deadline == deadline && !bw2_completionDone(completions[i])) {
+                    bw2_mutexLock(&rctx->client->reqslock);
+                    _bw2_serviceTimers(rctx->client);
+                    bw2_mutexUnlock(&rctx->client->reqslock);
+                }
+            }
+        }
 
-    struct bw2_header handlehdr;
-    bw2_KVInit(&handlehdr, "handle", handle->handle, handle->handlelen);
-    bw2_appendKV(&req, &handlehdr);
+        i = _bw2_findDone(completions, count);
+    }
 
-    struct bw2_reqctx reqctx;
-    bw2_reqctxInit(&reqctx, _bw2_simpleReq_cb, NULL);
-    int rv = bw2_transact(client, &req, &reqctx);
-    if (rv != 0) {
-        goto done;
+    /* No request may touch the waiter once this function returns. */
+    size_t j;
+    for (j = 0; j < registered; j++) {
+        struct bw2_reqctx* rctx = completions[j]->rctx;
+        bw2_mutexLock(&rctx->lock);
+        rctx->waiter = NULL;
+        bw2_mutexUnlock(&rctx->lock);
     }
-    bw2_reqctxWait(&reqctx);
+    bw2_mutexDestroy(&waiter.lock);
+    bw2_condDestroy(&waiter.condvar);
 
-done:
-    bw2_reqctxDestroy(&reqctx);
-    return reqctx.rv;
+    *index = i;
+    return 0;
 }
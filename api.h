@@ -35,13 +35,107 @@
 #include <sys/types.h>
 #include <time.h>
 
+#include "chaincache.h"
 #include "daemon.h"
 #include "frame.h"
 #include "objects.h"
 #include "osutil.h"
+#include "queue.h"
+#include "timer.h"
+#include "utils.h"
 
 #define BW2_PORT 28589
 
+/* Initial size of the receive buffer, if it is allocated with malloc. */
+#define BW2_RXBUF_INITIAL_SIZE 4096
+
+/* Defaults for the backoff between reconnection attempts, in milliseconds. */
+#define BW2_RECONNECT_DEFAULT_INITIAL_DELAY 100
+#define BW2_RECONNECT_DEFAULT_MAX_DELAY 30000
+
+/* Most frames a busy-polling thread handles before checking timers again. */
+#define BW2_BUSYPOLL_FRAME_BUDGET 64
+
+/* Default number of messages delivered at once to a struct bw2_batchmsg_ctx. */
+#define BW2_BATCH_DEFAULT_MAX_MESSAGES 64
+
+struct bw2_eventLoop;
+struct bw2_sharedsub;
+struct bw2_batchmsg_ctx;
+struct bw2_replaySub;
+
+/* Cancels a blocking API call in progress on another thread. A token can be
+ * used for one call at a time.
+ */
+struct bw2_cancelToken {
+    /* Used internally by the bindings. CLIENT and CANCELLED are protected by
+     * LOCK, and REQCTX by the client's reqslock.
+     */
+    struct bw2_mutex lock;
+    bool cancelled;
+    struct bw2_client* client;
+    struct bw2_reqctx* reqctx;
+};
+
+union bw2_userctx {
+    void* ptr;
+    int32_t val;
+};
+
+struct bw2_reconnectParams {
+    bool enabled;
+
+    /* The delay before each attempt starts at INITIALDELAY and doubles after
+     * every failed attempt, up to MAXDELAY (both in milliseconds). Each delay
+     * is randomized to between half of it and all of it, so that clients that
+     * lost the same agent don't all come back at once. If MAXATTEMPTS is 0,
+     * the client keeps trying forever.
+     */
+    uint64_t initialDelay;
+    uint64_t maxDelay;
+    size_t maxAttempts;
+
+    /* Called on the BOSSWAVE thread when the connection is lost and when it
+     * has been restored. May be NULL.
+     */
+    void (*on_reconnect)(bool connected, union bw2_userctx ctx);
+    union bw2_userctx ctx;
+};
+
+/* How a thread waits for the response to a request (see bw2_setWaitPolicy).
+ * The thread first checks for the response in a loop for up to SPINMICROS
+ * microseconds, then yields the CPU between checks for up to YIELDMICROS more,
+ * and then blocks. If ADAPTIVE is set, these phases are shortened, or skipped,
+ * according to how long responses have recently taken.
+ */
+struct bw2_waitPolicy {
+    uint64_t spinMicros;
+    uint64_t yieldMicros;
+    bool adaptive;
+};
+
+/* Used with bw2_connectBusyPoll. THREAD places the polling thread. If
+ * SOCKETBUSYPOLLMICROS is nonzero, the socket is also set up with
+ * SO_BUSY_POLL, so that the kernel polls the network device for up to that
+ * many microseconds when the socket is read, instead of waiting for an
+ * interrupt.
+ */
+struct bw2_busyPollParams {
+    struct bw2_threadAttrs thread;
+    uint32_t socketBusyPollMicros;
+};
+
+/* How a busy-polling thread has spent its time. POLLS counts every attempt
+ * to read from the socket, of which IDLEPOLLS handled no frame.
+ */
+struct bw2_busyPollStats {
+    uint64_t polls;
+    uint64_t idlePolls;
+    uint64_t frames;
+    uint64_t busyMicros;
+    uint64_t idleMicros;
+};
+
 struct bw2_client {
     int connfd;
     struct bw2_mutex outlock;
@@ -55,10 +149,117 @@ struct bw2_client {
     struct bw2_mutex reqslock;
     struct bw2_reqctx* reqs;
 
+    /* The number of requests in REQS with a memory budget or retention
+     * policy, so that frames for other requests need not look them up.
+     * Updated with reqslock held, but may be read atomically without it.
+     */
+    size_t reqsfiltered;
+
     struct bw2_mutex seqnolock;
     int32_t curseqno;
 
+    /* Linked list of agent subscriptions shared by bw2_subscribeShared. */
+    struct bw2_mutex sharedlock;
+    struct bw2_sharedsub* shared;
+
+    /* Used to reconnect to the agent if the connection is lost (see
+     * bw2_setReconnect). The entity and the subscriptions to replay are
+     * protected by reqslock; CLOSING and RECONNECTWAKE by outlock.
+     */
+    struct bw2_reconnectParams reconnect;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char* entity;
+    size_t entitylen;
+    struct bw2_replaySub* replays;
+    struct bw2_reqctx replayEntityReqctx;
+    bool closing;
+    struct bw2_cond reconnectwake;
+    uint32_t jitterstate;
+
     bool connected;
+
+    /* Used only by clients without their own BOSSWAVE thread, which read frames
+     * with bw2_processIncoming. Bytes are buffered in RXBUF until a whole frame
+     * has arrived, and then the frame is parsed into FRAMEHEAP.
+     */
+    char* frameheap;
+    size_t heapsize;
+    char* rxbuf;
+    size_t rxbufsize;
+    size_t rxstart;
+    size_t rxlen;
+    bool rxbufmalloced;
+    struct bw2_framescan rxscan;
+
+    /* Without a frame heap, frames are read into blocks from this pool, which
+     * is used only by the thread reading frames (see bw2_setFramePool).
+     */
+    struct bw2_framePool framepool;
+
+    /* Used for what does not fit in the frame heap, if not NULL, and
+     * statistics about the frames that have been read (see
+     * bw2_setFrameSpill).
+     */
+    char* spill;
+    size_t spillsize;
+    struct bw2_frameStats framestats;
+
+    /* The boundary to which PO bodies are aligned (see
+     * bw2_setPayloadAlignment).
+     */
+    size_t poalign;
+
+    /* What frames read without a frame heap are charged to, unless their
+     * subscription has a budget of its own (see bw2_setMemoryBudget).
+     */
+    struct bw2_memBudget budget;
+
+    /* Where the client allocates memory (see bw2_setAllocator). */
+    struct bw2_allocator allocator;
+
+    /* Chains built by bw2_buildChain (see bw2_setChainCache). */
+    struct bw2_chainCache chaincache;
+
+    /* Whether publishes and subscriptions that ask for autochain are given a
+     * PAC from the chain cache instead (see bw2_setAutoPAC), and the hash of
+     * the entity that PACs are resolved for. Protected by reqslock.
+     */
+    bool autopac;
+    struct bw2_vkHash entityvk;
+
+    /* Deadlines of outstanding requests, in milliseconds. Protected by
+     * reqslock.
+     */
+    struct bw2_timerWheel timers;
+
+    /* On Linux, the BOSSWAVE thread also waits on TIMERFD, which is set to
+     * fire at TIMERFDEXPIRY (or not at all, if it is 0), so that requests
+     * expire on time even if no thread is waiting for them. TIMERFD is -1 if
+     * the client has no BOSSWAVE thread. Protected by reqslock.
+     */
+    int timerfd;
+    uint64_t timerfdExpiry;
+
+    /* Linked list of batched subscriptions with messages that have not yet
+     * been delivered. Protected by reqslock.
+     */
+    struct bw2_batchmsg_ctx* batches;
+
+    /* How threads wait for responses, and a moving average of how long they
+     * have waited, in microseconds, which is updated without a lock.
+     */
+    struct bw2_waitPolicy waitpolicy;
+    uint64_t waitlatency;
+
+    /* Written only by the busy-polling thread, if there is one, and read
+     * atomically by bw2_busyPollStats.
+     */
+    struct bw2_busyPollStats busypoll;
+
+    /* Set if the client is registered with an event loop (see eventloop.h). */
+    struct bw2_eventLoop* loop;
+    uint32_t loopslot;
 };
 
 #define BW2_ELABORATE_FULL "full"
@@ -77,6 +278,8 @@ struct bw2_publishParams {
     char* elaboratePAC;
     bool doNotVerify;
     bool persist;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
 };
 
 struct bw2_subscribeParams {
@@ -89,6 +292,10 @@ struct bw2_subscribeParams {
     char* elaboratePAC;
     bool doNotVerify;
     bool leavePacked;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
+    struct bw2_memBudget* budget;
+    struct bw2_retainPolicy* retain;
 };
 
 struct bw2_queryParams {
@@ -101,6 +308,8 @@ struct bw2_queryParams {
     char* elaboratePAC;
     bool doNotVerify;
     bool leavePacked;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
 };
 
 struct bw2_listParams {
@@ -112,6 +321,8 @@ struct bw2_listParams {
     uint64_t expiryDelta;
     char* elaboratePAC;
     bool doNotVerify;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
 };
 
 struct bw2_createDOTParams {
@@ -126,12 +337,16 @@ struct bw2_createDOTParams {
     bool omitCreationDate;
     char* uri;
     char* accessPermissions;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
 };
 
 struct bw2_createDOTChainParams {
     struct bw2_dotHash* dots;
     bool isPermission;
     bool unElaborate;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
 };
 
 struct bw2_createEntityParams {
@@ -141,17 +356,16 @@ struct bw2_createEntityParams {
     char* comment;
     struct bw2_vkHash* revokers;
     bool omitCreationDate;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
 };
 
 struct bw2_buildChainParams {
     char* uri;
     char* accessPermissions;
     struct bw2_vkHash* to;
-};
-
-union bw2_userctx {
-    void* ptr;
-    int32_t val;
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
 };
 
 struct bw2_simpleMessage {
@@ -167,6 +381,36 @@ struct bw2_simpleMessage {
     struct bw2_routingobj* ros;
 
     int error;
+
+    /* Used internally by the bindings to retain the message (see
+     * bw2_simpleMessageRetain).
+     */
+    struct bw2_frame* frame;
+    struct bw2_frameRef* ref;
+    struct bw2_allocator* allocator;
+};
+
+/* A message serialized into one contiguous block by bw2_simpleMessageClone.
+ * It contains no pointers, only offsets from the start of the block, so it can
+ * be moved or copied with memcpy. Read it with the bw2_messageBlock*
+ * functions. The header is followed by the POs' and ROs' entries, and then by
+ * the bytes they refer to.
+ */
+struct bw2_messageBlockEntry {
+    uint32_t num;
+    uint32_t offset;
+    uint32_t len;
+};
+
+struct bw2_messageBlock {
+    uint32_t size;
+    int32_t error;
+    uint32_t fromOffset;
+    uint32_t fromLen;
+    uint32_t uriOffset;
+    uint32_t uriLen;
+    uint32_t numPOs;
+    uint32_t numROs;
 };
 
 struct bw2_simpleChain {
@@ -189,6 +433,74 @@ struct bw2_simplemsg_ctx {
 
     /* The remaining elements are used internally by the bindings. */
     struct bw2_reqctx reqctx;
+
+    /* Used only by listeners added with bw2_subscribeShared. */
+    struct bw2_sharedsub* shared;
+    struct bw2_simplemsg_ctx* nextlistener;
+};
+
+#define BW2_SHAREDSUB_PENDING 0
+#define BW2_SHAREDSUB_ACTIVE 1
+#define BW2_SHAREDSUB_FAILED 2
+#define BW2_SHAREDSUB_CLOSING 3
+#define BW2_SHAREDSUB_ENDED 4
+#define BW2_SHAREDSUB_CANCELLED 5
+
+/* A single agent subscription whose messages are fanned out to every local
+ * listener subscribed with the same URI, PAC, elaborate level, and unpack
+ * setting. Allocated with malloc; the key strings are stored after it.
+ */
+struct bw2_sharedsub {
+    struct bw2_sharedsub* next;
+    struct bw2_client* client;
+
+    char* uri;
+    char* pac;
+    size_t paclen;
+    char* elaboratePAC;
+    bool leavePacked;
+
+    int state;
+    int rv;
+    size_t refcount; // Number of listeners
+    size_t waiters; // Number of threads in bw2_subscribeShared for this entry
+    struct bw2_cond ready;
+    struct bw2_simplemsg_ctx* listeners;
+
+    struct bw2_simplemsg_ctx smctx;
+    struct bw2_subscriptionHandle handle;
+};
+
+/* A subscription made while reconnection is enabled. Its parameters are
+ * copied, together with everything they point to, into a single block of
+ * memory allocated with malloc, so that the subscription can be made again
+ * after reconnecting. The user keeps using the handle from the original
+ * subscription; bw2_unsubscribe translates it to the current one.
+ */
+struct bw2_replaySub {
+    struct bw2_replaySub* next;
+    struct bw2_simplemsg_ctx* smctx;
+    struct bw2_subscriptionHandle original;
+    struct bw2_subscriptionHandle current;
+
+    struct bw2_subscribeParams params;
+    struct bw2_dotChainHash pac;
+    struct tm expiry;
+};
+
+/* Context for a pull-mode subscription. Instead of being passed to a
+ * user-provided function, messages are queued and the user takes them with
+ * bw2_subscriptionNext or bw2_subscriptionDrain.
+ */
+struct bw2_pullsub_ctx {
+    /* The user sets these elements. The capacity must be a power of two. */
+    struct bw2_msgqueueSlot* slots;
+    size_t capacity;
+    int overflowPolicy;
+
+    /* The remaining elements are used internally by the bindings. */
+    struct bw2_msgqueue queue;
+    struct bw2_simplemsg_ctx smctx;
 };
 
 struct bw2_chararr_ctx {
@@ -200,6 +512,46 @@ struct bw2_chararr_ctx {
     struct bw2_reqctx reqctx;
 };
 
+/* Used with bw2_subscribeBatched and bw2_queryBatched. Messages are
+ * delivered to ON_BATCH, at most MAXMESSAGES (or
+ * BW2_BATCH_DEFAULT_MAX_MESSAGES, if 0) at a time, and none is held back for
+ * longer than MAXDELAY microseconds (if nonzero) once another frame arrives.
+ */
+struct bw2_batchmsg_ctx {
+    /* The user sets these elements. */
+    bool (*on_batch)(struct bw2_simpleMessage** msgs, size_t count, bool final, int error, union bw2_userctx ctx);
+    union bw2_userctx ctx;
+    size_t maxmessages;
+    uint64_t maxdelay;
+
+    /* The remaining elements are used internally by the bindings. MSGS holds
+     * copies of the COUNT messages received since the batch started at FIRST.
+     */
+    struct bw2_simplemsg_ctx smctx;
+    struct bw2_client* client;
+    struct bw2_simpleMessage** msgs;
+    size_t count;
+    uint64_t first;
+    struct bw2_batchmsg_ctx* next;
+    struct bw2_batchmsg_ctx** pprev;
+};
+
+/* Used with bw2_queryMulti. INDEX is the index of the URI that the result is
+ * for, and FINAL is set for the last result for that URI.
+ */
+struct bw2_multimsg_ctx {
+    /* The user sets these elements. */
+    bool (*on_message)(struct bw2_simpleMessage* sm, size_t index, bool final, int error, union bw2_userctx ctx);
+    union bw2_userctx ctx;
+};
+
+/* Used with bw2_listMulti, like struct bw2_multimsg_ctx. */
+struct bw2_multiarr_ctx {
+    /* The user sets these elements. */
+    bool (*on_message)(char* arr, size_t arrlen, size_t index, bool final, int error, union bw2_userctx ctx);
+    union bw2_userctx ctx;
+};
+
 struct bw2_simplechain_ctx {
     /* The user sets this element. */
     bool (*on_chain)(struct bw2_simpleChain* sc, bool final, int error, union bw2_userctx ctx);
@@ -207,21 +559,173 @@ struct bw2_simplechain_ctx {
 
     /* The remaining elements are used internally by the bindings. */
     struct bw2_reqctx reqctx;
+    struct bw2_chainCacheBuilder* builder;
+};
+
+struct bw2_createDOT_ctx {
+    struct bw2_dotHash* dothash;
+    struct bw2_dot* dot;
+};
+
+struct bw2_createEntity_ctx {
+    struct bw2_vkHash* vkhash;
+    struct bw2_vk* vk;
+};
+
+struct bw2_subscribe_ctx {
+    struct bw2_client* client;
+    struct bw2_simplemsg_ctx* smctx;
+    struct bw2_subscriptionHandle* handle;
+    struct bw2_replaySub* replay;
+    struct bw2_hash* pac;
+    bool* pacRejected;
+};
+
+/* The handle for a request made with one of the *Async functions. It must stay
+ * valid until it has been passed to bw2_wait (or to bw2_waitAll), which
+ * returns the request's result.
+ */
+struct bw2_completion {
+    /* The user sets these elements before making the request. If ON_COMPLETE
+     * is not NULL, it is called once the result is available, possibly on the
+     * BOSSWAVE thread, in which case it must not make API calls.
+     */
+    void (*on_complete)(struct bw2_completion* completion, union bw2_userctx ctx);
+    union bw2_userctx ctx;
+
+    /* The remaining elements are used internally by the bindings. RCTX is
+     * either REQCTX, or the request context of the subscription, query or
+     * list being started.
+     */
+    struct bw2_client* client;
+    struct bw2_reqctx* rctx;
+    struct bw2_reqctx reqctx;
+    union {
+        struct bw2_createDOT_ctx createDOT;
+        struct bw2_createEntity_ctx createEntity;
+        struct bw2_subscribe_ctx subscribe;
+        struct bw2_vkHash* vkhash;
+        struct bw2_dotChainHash* dotchainhash;
+    } out;
+
+    /* For bw2_setEntityAsync, a copy of the entity to remember for
+     * reconnecting, if reconnection is enabled.
+     */
+    char* entity;
+    size_t entitylen;
+
+    /* For bw2_subscribeAsync, the record of the subscription to replay after
+     * reconnecting, which is freed if the subscription is not made.
+     */
+    struct bw2_replaySub* replay;
+
+    /* For bw2_publishAsync and bw2_subscribeAsync, the PAC used in place of
+     * autochain, if PACRESOLVED is set (see bw2_setAutoPAC), and whether the
+     * agent refused the request because of it.
+     */
+    struct bw2_hash pac;
+    bool pacResolved;
+    bool pacRejected;
 };
 
+/* Copies a message, including everything it points to, into a single block of
+ * memory allocated with the client's allocator, so that it stays valid after
+ * the user-provided function returns. Returns NULL if memory could not be
+ * allocated.
+ */
+struct bw2_simpleMessage* bw2_simpleMessageCopy(struct bw2_simpleMessage* sm);
+
+/* Keeps a message delivered to a user-provided function valid after the
+ * function returns, by sharing the buffers of the frame it came from rather
+ * than copying them. Falls back to bw2_simpleMessageCopy for frames read into
+ * a frame heap. Returns NULL if memory could not be allocated.
+ */
+struct bw2_simpleMessage* bw2_simpleMessageRetain(struct bw2_simpleMessage* sm);
+void bw2_simpleMessageFree(struct bw2_simpleMessage* sm);
+
+/* Serializes SM into a single block allocated from ARENA (see utils.h).
+ * Returns NULL if the arena is full.
+ */
+struct bw2_messageBlock* bw2_simpleMessageClone(struct bw2_simpleMessage* sm, struct bw2_arena* arena);
+size_t bw2_messageBlockSize(struct bw2_messageBlock* block);
+int bw2_messageBlockError(struct bw2_messageBlock* block);
+char* bw2_messageBlockFrom(struct bw2_messageBlock* block, size_t* len);
+char* bw2_messageBlockURI(struct bw2_messageBlock* block, size_t* len);
+size_t bw2_messageBlockNumPOs(struct bw2_messageBlock* block);
+char* bw2_messageBlockPO(struct bw2_messageBlock* block, size_t index, uint32_t* ponum, size_t* len);
+size_t bw2_messageBlockNumROs(struct bw2_messageBlock* block);
+char* bw2_messageBlockRO(struct bw2_messageBlock* block, size_t index, uint8_t* ronum, size_t* len);
+
 int bw2_clientInit(struct bw2_client* client);
 int bw2_connect(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* threadstack, size_t stacksize);
+int bw2_connectWithAttrs(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, struct bw2_threadAttrs* attrs);
+int bw2_connectThreadless(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* rxbuf, size_t rxbufsize);
+int bw2_getConnectionFd(struct bw2_client* client);
+#if (BW2_OS == LINUX)
+int bw2_connectEventLoop(struct bw2_client* client, struct bw2_eventLoop* loop, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* rxbuf, size_t rxbufsize);
+int bw2_connectBusyPoll(struct bw2_client* client, const struct sockaddr* addr, socklen_t addrlen, char* frameheap, size_t heapsize, char* rxbuf, size_t rxbufsize, struct bw2_busyPollParams* params);
+void bw2_busyPollStats(struct bw2_client* client, struct bw2_busyPollStats* stats);
+#endif
 int bw2_disconnect(struct bw2_client* client);
+int bw2_setReconnect(struct bw2_client* client, struct bw2_reconnectParams* params);
+int bw2_setWaitPolicy(struct bw2_client* client, struct bw2_waitPolicy* policy);
+int bw2_setFramePool(struct bw2_client* client, struct bw2_framePoolParams* params);
+void bw2_getFramePoolStats(struct bw2_client* client, struct bw2_framePoolStats* stats);
+int bw2_setFrameSpill(struct bw2_client* client, char* spill, size_t spillsize);
+int bw2_setPayloadAlignment(struct bw2_client* client, size_t alignment);
+int bw2_setMemoryBudget(struct bw2_client* client, size_t limit);
+/* Must be called right after bw2_clientInit, before anything (such as
+ * bw2_setFramePool or bw2_setChainCache) has allocated memory for the client.
+ */
+int bw2_setAllocator(struct bw2_client* client, void* (*alloc)(size_t size, void* ctx), void (*free)(void* ptr, void* ctx), void* ctx);
+void bw2_getAllocStats(struct bw2_client* client, struct bw2_allocStats* stats);
+void bw2_getMemoryBudgetStats(struct bw2_client* client, struct bw2_memBudgetStats* stats);
+void bw2_getFrameStats(struct bw2_client* client, struct bw2_frameStats* stats);
+int bw2_setChainCache(struct bw2_client* client, struct bw2_chainCacheParams* params);
+int bw2_setAutoPAC(struct bw2_client* client, bool enabled);
+void bw2_getChainCacheStats(struct bw2_client* client, struct bw2_chainCacheStats* stats);
+size_t bw2_invalidateChainCache(struct bw2_client* client, struct bw2_buildChainParams* p);
+int bw2_invalidateChainCacheByHash(struct bw2_client* client, struct bw2_dotChainHash* dotchainhash, size_t* removed);
 bool bw2_isConnected(struct bw2_client* client);
 int bw2_setEntity(struct bw2_client* client, char* entity, size_t entitylen, struct bw2_vkHash* vkhash);
 int bw2_publish(struct bw2_client* client, struct bw2_publishParams* p);
 int bw2_subscribe(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx, struct bw2_subscriptionHandle* handle);
+int bw2_subscribeShared(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx);
+int bw2_unsubscribeShared(struct bw2_client* client, struct bw2_simplemsg_ctx* subctx);
+int bw2_subscribePull(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_pullsub_ctx* pctx, struct bw2_subscriptionHandle* handle);
+int bw2_subscriptionNext(struct bw2_pullsub_ctx* pctx, int64_t timeout, struct bw2_simpleMessage** msg);
+size_t bw2_subscriptionDrain(struct bw2_pullsub_ctx* pctx, struct bw2_simpleMessage** msgs, size_t max);
+void bw2_subscriptionStats(struct bw2_pullsub_ctx* pctx, struct bw2_msgqueueStats* stats);
+void bw2_subscriptionDestroy(struct bw2_pullsub_ctx* pctx);
+int bw2_subscribeBatched(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_batchmsg_ctx* bctx, struct bw2_subscriptionHandle* handle);
 int bw2_query(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_simplemsg_ctx* qctx);
+int bw2_queryBatched(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_batchmsg_ctx* bctx);
 int bw2_list(struct bw2_client* client, struct bw2_listParams* p, struct bw2_chararr_ctx* lctx);
+int bw2_queryMulti(struct bw2_client* client, struct bw2_queryParams* p, char** uris, size_t count, size_t concurrency, struct bw2_multimsg_ctx* mctx);
+int bw2_listMulti(struct bw2_client* client, struct bw2_listParams* p, char** uris, size_t count, size_t concurrency, struct bw2_multiarr_ctx* mctx);
 int bw2_createDOT(struct bw2_client* client, struct bw2_createDOTParams* p, struct bw2_dotHash* dothash, struct bw2_dot* dot);
 int bw2_createEntity(struct bw2_client* client, struct bw2_createEntityParams* p, struct bw2_vkHash* vkhash, struct bw2_vk* vk);
 int bw2_createDOTChain(struct bw2_client* client, struct bw2_createDOTChainParams* p, struct bw2_dotChainHash* dotchainhash);
 int bw2_buildChain(struct bw2_client* client, struct bw2_buildChainParams* p, struct bw2_simplechain_ctx* scctx);
 int bw2_unsubscribe(struct bw2_client* client, struct bw2_subscriptionHandle* handle);
 
+int bw2_publishAsync(struct bw2_client* client, struct bw2_publishParams* p, struct bw2_completion* completion);
+int bw2_subscribeAsync(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_simplemsg_ctx* subctx, struct bw2_subscriptionHandle* handle, struct bw2_completion* completion);
+int bw2_queryAsync(struct bw2_client* client, struct bw2_queryParams* p, struct bw2_simplemsg_ctx* qctx, struct bw2_completion* completion);
+int bw2_listAsync(struct bw2_client* client, struct bw2_listParams* p, struct bw2_chararr_ctx* lctx, struct bw2_completion* completion);
+int bw2_setEntityAsync(struct bw2_client* client, char* entity, size_t entitylen, struct bw2_vkHash* vkhash, struct bw2_completion* completion);
+int bw2_createDOTAsync(struct bw2_client* client, struct bw2_createDOTParams* p, struct bw2_dotHash* dothash, struct bw2_dot* dot, struct bw2_completion* completion);
+int bw2_createEntityAsync(struct bw2_client* client, struct bw2_createEntityParams* p, struct bw2_vkHash* vkhash, struct bw2_vk* vk, struct bw2_completion* completion);
+int bw2_createDOTChainAsync(struct bw2_client* client, struct bw2_createDOTChainParams* p, struct bw2_dotChainHash* dotchainhash, struct bw2_completion* completion);
+int bw2_unsubscribeAsync(struct bw2_client* client, struct bw2_subscriptionHandle* handle, struct bw2_completion* completion);
+bool bw2_completionDone(struct bw2_completion* completion);
+int bw2_completionResult(struct bw2_completion* completion);
+int bw2_wait(struct bw2_completion* completion);
+int bw2_waitAll(struct bw2_completion** completions, size_t count);
+int bw2_waitAny(struct bw2_completion** completions, size_t count, size_t* index);
+
+int bw2_cancelTokenInit(struct bw2_cancelToken* token);
+void bw2_cancel(struct bw2_cancelToken* token);
+void bw2_cancelTokenDestroy(struct bw2_cancelToken* token);
+
 #endif
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "api.h"
+#include "chaincache.h"
+#include "errors.h"
+#include "objects.h"
+#include "osutil.h"
+#include "utils.h"
+
+uint64_t _bw2_chaincache_keyhash(struct bw2_chainCacheKey* key) {
+    uint64_t hash = bw2_hash_bytes(key->uri, key->urilen);
+    hash = ((hash << 21) | (hash >> 43)) ^ bw2_hash_bytes(key->permissions, key->permissionslen);
+    hash = ((hash << 21) | (hash >> 43)) ^ bw2_hash_bytes(key->to, key->tolen);
+    return hash;
+}
+
+char* _bw2_chaincache_entry_key(struct bw2_chainCacheEntry* entry) {
+    return ((char*) entry) + sizeof(struct bw2_chainCacheEntry);
+}
+
+struct bw2_chainCacheRecord* _bw2_chaincache_entry_records(struct bw2_chainCacheEntry* entry) {
+    return (struct bw2_chainCacheRecord*) (((char*) entry) + entry->recordsOffset);
+}
+
+bool _bw2_chaincache_entry_matches(struct bw2_chainCacheEntry* entry, uint64_t keyhash, struct bw2_chainCacheKey* key) {
+    char* k = _bw2_chaincache_entry_key(entry);
+    return entry->keyhash == keyhash
+        && entry->urilen == key->urilen && memcmp(k, key->uri, key->urilen) == 0
+        && entry->permissionslen == key->permissionslen && memcmp(&k[entry->urilen], key->permissions, key->permissionslen) == 0
+        && entry->tolen == key->tolen && memcmp(&k[entry->urilen + entry->permissionslen], key->to, key->tolen) == 0;
+}
+
+/* Removes ENTRY from the cache, and frees it unless it is being read. Must be
+ * called with the cache's lock held.
+ */
+void _bw2_chaincache_unlink(struct bw2_chainCache* cache, struct bw2_chainCacheEntry* entry) {
+    struct bw2_chainCacheEntry** curr;
+    for (curr = &cache->buckets[entry->keyhash & (cache->numbuckets - 1)]; *curr != NULL; curr = &(*curr)->next) {
+        if (*curr == entry) {
+            *curr = entry->next;
+            break;
+        }
+    }
+
+    if (entry->lruprev != NULL) {
+        entry->lruprev->lrunext = entry->lrunext;
+    } else {
+        cache->lruhead = entry->lrunext;
+    }
+    if (entry->lrunext != NULL) {
+        entry->lrunext->lruprev = entry->lruprev;
+    } else {
+        cache->lrutail = entry->lruprev;
+    }
+
+    cache->stats.entries--;
+    cache->stats.bytes -= entry->size;
+    entry->linked = false;
+    if (entry->refs == 0) {
+        bw2_allocatorFree(cache->allocator, BW2_ALLOC_CHAIN_CACHE, entry);
+    }
+}
+
+/* Must be called with the cache's lock held. */
+void _bw2_chaincache_push_front(struct bw2_chainCache* cache, struct bw2_chainCacheEntry* entry) {
+    entry->lruprev = NULL;
+    entry->lrunext = cache->lruhead;
+    if (cache->lruhead != NULL) {
+        cache->lruhead->lruprev = entry;
+    } else {
+        cache->lrutail = entry;
+    }
+    cache->lruhead = entry;
+}
+
+/* Must be called with the cache's lock held. */
+void _bw2_chaincache_clear(struct bw2_chainCache* cache) {
+    while (cache->lruhead != NULL) {
+        _bw2_chaincache_unlink(cache, cache->lruhead);
+    }
+}
+
+int bw2_chainCacheInit(struct bw2_chainCache* cache, struct bw2_allocator* allocator) {
+    memset(cache, 0x00, sizeof(struct bw2_chainCache));
+    if (bw2_mutexInit(&cache->lock) != 0) {
+        return BW2_ERROR_SYNCHRONIZATION;
+    }
+    cache->allocator = allocator;
+    return 0;
+}
+
+int bw2_chainCacheConfigure(struct bw2_chainCache* cache, struct bw2_chainCacheParams* params) {
+    struct bw2_chainCacheEntry** buckets = NULL;
+    size_t numbuckets = 0;
+    size_t maxEntries = 0;
+    uint64_t maxAge = 0;
+
+    if (params != NULL) {
+        maxEntries = (params->maxEntries == 0) ? BW2_CHAINCACHE_DEFAULT_MAX_ENTRIES : params->maxEntries;
+        maxAge = (params->maxAge == 0) ? BW2_CHAINCACHE_DEFAULT_MAX_AGE : params->maxAge;
+
+        /* The table never holds more entries than it has buckets. */
+        numbuckets = 1;
+        while (numbuckets < maxEntries) {
+            numbuckets <<= 1;
+        }
+        buckets = bw2_allocatorAlloc(cache->allocator, BW2_ALLOC_CHAIN_CACHE, numbuckets * sizeof(struct bw2_chainCacheEntry*));
+        if (buckets == NULL) {
+            return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        }
+        memset(buckets, 0x00, numbuckets * sizeof(struct bw2_chainCacheEntry*));
+    }
+
+    bw2_mutexLock(&cache->lock);
+    _bw2_chaincache_clear(cache);
+    struct bw2_chainCacheEntry** oldbuckets = cache->buckets;
+    cache->buckets = buckets;
+    cache->numbuckets = numbuckets;
+    cache->maxEntries = maxEntries;
+    cache->maxAge = maxAge;
+    cache->generation++;
+    bw2_mutexUnlock(&cache->lock);
+
+    if (oldbuckets != NULL) {
+        bw2_allocatorFree(cache->allocator, BW2_ALLOC_CHAIN_CACHE, oldbuckets);
+    }
+    return 0;
+}
+
+struct bw2_chainCacheEntry* bw2_chainCacheLookup(struct bw2_chainCache* cache, struct bw2_chainCacheKey* key) {
+    struct bw2_chainCacheEntry* entry;
+    uint64_t keyhash = _bw2_chaincache_keyhash(key);
+
+    bw2_mutexLock(&cache->lock);
+    if (cache->maxEntries == 0) {
+        bw2_mutexUnlock(&cache->lock);
+        return NULL;
+    }
+    for (entry = cache->buckets[keyhash & (cache->numbuckets - 1)]; entry != NULL; entry = entry->next) {
+        if (_bw2_chaincache_entry_matches(entry, keyhash, key)) {
+            break;
+        }
+    }
+    if (entry != NULL && bw2_getTimeMicros() / 1000 >= entry->expires) {
+        _bw2_chaincache_unlink(cache, entry);
+        cache->stats.expired++;
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        cache->stats.misses++;
+    } else {
+        cache->stats.hits++;
+        entry->refs++;
+        if (entry != cache->lruhead) {
+            entry->lruprev->lrunext = entry->lrunext;
+            if (entry->lrunext != NULL) {
+                entry->lrunext->lruprev = entry->lruprev;
+            } else {
+                cache->lrutail = entry->lruprev;
+            }
+            _bw2_chaincache_push_front(cache, entry);
+        }
+    }
+    bw2_mutexUnlock(&cache->lock);
+    return entry;
+}
+
+void _bw2_chaincache_get_field(struct bw2_chainCacheEntry* entry, struct bw2_chainCacheField* field, char** value, size_t* len) {
+    if (field->offset == 0) {
+        *value = NULL;
+        *len = 0;
+    } else {
+        *value = ((char*) entry) + field->offset;
+        *len = field->len;
+    }
+}
+
+void bw2_chainCacheGetChain(struct bw2_chainCacheEntry* entry, size_t index, struct bw2_simpleChain* sc) {
+    struct bw2_chainCacheRecord* record = &_bw2_chaincache_entry_records(entry)[index];
+    _bw2_chaincache_get_field(entry, &record->hash, &sc->hash, &sc->hash_len);
+    _bw2_chaincache_get_field(entry, &record->permissions, &sc->permissions, &sc->permissions_len);
+    _bw2_chaincache_get_field(entry, &record->to, &sc->to, &sc->to_len);
+    _bw2_chaincache_get_field(entry, &record->uri, &sc->uri, &sc->uri_len);
+    _bw2_chaincache_get_field(entry, &record->content, &sc->content, &sc->content_len);
+}
+
+void bw2_chainCacheRelease(struct bw2_chainCache* cache, struct bw2_chainCacheEntry* entry) {
+    bw2_mutexLock(&cache->lock);
+    entry->refs--;
+    bool unused = (entry->refs == 0 && !entry->linked);
+    bw2_mutexUnlock(&cache->lock);
+    if (unused) {
+        bw2_allocatorFree(cache->allocator, BW2_ALLOC_CHAIN_CACHE, entry);
+    }
+}
+
+struct bw2_chainCacheBuilder* bw2_chainCacheBuilderNew(struct bw2_chainCache* cache, struct bw2_chainCacheKey* key) {
+    bw2_mutexLock(&cache->lock);
+    bool enabled = (cache->maxEntries != 0);
+    uint64_t generation = cache->generation;
+    bw2_mutexUnlock(&cache->lock);
+    if (!enabled) {
+        return NULL;
+    }
+
+    size_t keylen = key->urilen + key->permissionslen + key->tolen;
+    struct bw2_chainCacheBuilder* builder = bw2_allocatorAlloc(cache->allocator, BW2_ALLOC_CHAIN_CACHE, sizeof(struct bw2_chainCacheBuilder) + keylen);
+    if (builder == NULL) {
+        return NULL;
+    }
+    memset(builder, 0x00, sizeof(struct bw2_chainCacheBuilder));
+    builder->allocator = cache->allocator;
+    builder->generation = generation;
+    builder->keyhash = _bw2_chaincache_keyhash(key);
+    builder->urilen = key->urilen;
+    builder->permissionslen = key->permissionslen;
+    builder->tolen = key->tolen;
+    memcpy(builder->key, key->uri, key->urilen);
+    memcpy(&builder->key[key->urilen], key->permissions, key->permissionslen);
+    memcpy(&builder->key[key->urilen + key->permissionslen], key->to, key->tolen);
+    return builder;
+}
+
+/* Grows the array at *BUF, of *CAP bytes, to hold at least NEEDED bytes. */
+bool _bw2_chaincache_grow(struct bw2_allocator* allocator, void** buf, size_t* cap, size_t used, size_t needed) {
+    if (needed <= *cap) {
+        return true;
+    }
+    size_t newcap = (*cap == 0) ? 256 : *cap;
+    while (newcap < needed) {
+        newcap <<= 1;
+    }
+    void* newbuf = bw2_allocatorAlloc(allocator, BW2_ALLOC_CHAIN_CACHE, newcap);
+    if (newbuf == NULL) {
+        return false;
+    }
+    if (*buf != NULL) {
+        memcpy(newbuf, *buf, used);
+        bw2_allocatorFree(allocator, BW2_ALLOC_CHAIN_CACHE, *buf);
+    }
+    *buf = newbuf;
+    *cap = newcap;
+    return true;
+}
+
+void _bw2_chaincache_add_field(struct bw2_chainCacheBuilder* builder, struct bw2_chainCacheField* field, char* value, size_t len) {
+    if (value == NULL) {
+        field->offset = 0;
+        field->len = 0;
+        return;
+    }
+    field->offset = (uint32_t) (builder->datalen + 1);
+    field->len = (uint32_t) len;
+    memcpy(&builder->data[builder->datalen], value, len);
+    builder->datalen += len;
+}
+
+void bw2_chainCacheBuilderAdd(struct bw2_chainCacheBuilder* builder, struct bw2_simpleChain* sc) {
+    if (builder->failed) {
+        return;
+    }
+
+    size_t len = sc->hash_len + sc->permissions_len + sc->to_len + sc->uri_len + sc->content_len;
+    size_t recordsize = sizeof(struct bw2_chainCacheRecord);
+    if (builder->datalen + len > UINT32_MAX / 2
+        || !_bw2_chaincache_grow(builder->allocator, (void**) &builder->data, &builder->datacap, builder->datalen, builder->datalen + len)
+        || !_bw2_chaincache_grow(builder->allocator, (void**) &builder->records, &builder->recordsCap, builder->numRecords * recordsize, (builder->numRecords + 1) * recordsize)) {
+        builder->failed = true;
+        return;
+    }
+
+    struct bw2_chainCacheRecord* record = &builder->records[builder->numRecords++];
+    _bw2_chaincache_add_field(builder, &record->hash, sc->hash, sc->hash_len);
+    _bw2_chaincache_add_field(builder, &record->permissions, sc->permissions, sc->permissions_len);
+    _bw2_chaincache_add_field(builder, &record->to, sc->to, sc->to_len);
+    _bw2_chaincache_add_field(builder, &record->uri, sc->uri, sc->uri_len);
+    _bw2_chaincache_add_field(builder, &record->content, sc->content, sc->content_len);
+}
+
+void bw2_chainCacheBuilderFail(struct bw2_chainCacheBuilder* builder) {
+    builder->failed = true;
+}
+
+void _bw2_chaincache_rebase_field(struct bw2_chainCacheField* field, size_t dataOffset) {
+    if (field->offset != 0) {
+        field->offset = (uint32_t) (dataOffset + field->offset - 1);
+    }
+}
+
+/* Copies what BUILDER collected into a single block. */
+struct bw2_chainCacheEntry* _bw2_chaincache_entry_new(struct bw2_chainCacheBuilder* builder, uint64_t expires) {
+    size_t keylen = builder->urilen + builder->permissionslen + builder->tolen;
+    size_t recordsOffset = sizeof(struct bw2_chainCacheEntry) + keylen;
+    recordsOffset += (__alignof__(struct bw2_chainCacheRecord) - (recordsOffset % __alignof__(struct bw2_chainCacheRecord))) % __alignof__(struct bw2_chainCacheRecord);
+    size_t dataOffset = recordsOffset + builder->numRecords * sizeof(struct bw2_chainCacheRecord);
+    size_t size = dataOffset + builder->datalen;
+
+    struct bw2_chainCacheEntry* entry = bw2_allocatorAlloc(builder->allocator, BW2_ALLOC_CHAIN_CACHE, size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    memset(entry, 0x00, sizeof(struct bw2_chainCacheEntry));
+    entry->keyhash = builder->keyhash;
+    entry->expires = expires;
+    entry->size = size;
+    entry->linked = true;
+    entry->urilen = (uint32_t) builder->urilen;
+    entry->permissionslen = (uint32_t) builder->permissionslen;
+    entry->tolen = (uint32_t) builder->tolen;
+    entry->recordsOffset = (uint32_t) recordsOffset;
+    entry->numChains = (uint32_t) builder->numRecords;
+    memcpy(_bw2_chaincache_entry_key(entry), builder->key, keylen);
+
+    struct bw2_chainCacheRecord* records = _bw2_chaincache_entry_records(entry);
+    size_t i;
+    for (i = 0; i != builder->numRecords; i++) {
+        records[i] = builder->records[i];
+        _bw2_chaincache_rebase_field(&records[i].hash, dataOffset);
+        _bw2_chaincache_rebase_field(&records[i].permissions, dataOffset);
+        _bw2_chaincache_rebase_field(&records[i].to, dataOffset);
+        _bw2_chaincache_rebase_field(&records[i].uri, dataOffset);
+        _bw2_chaincache_rebase_field(&records[i].content, dataOffset);
+    }
+    if (builder->datalen != 0) {
+        memcpy(((char*) entry) + dataOffset, builder->data, builder->datalen);
+    }
+    return entry;
+}
+
+void bw2_chainCacheBuilderFinish(struct bw2_chainCache* cache, struct bw2_chainCacheBuilder* builder) {
+    struct bw2_chainCacheEntry* entry = NULL;
+    struct bw2_chainCacheKey key;
+
+    /* A triple with no chains is not cached, so that it is retried once a
+     * DOT granting the permissions is created.
+     */
+    if (builder->failed || builder->numRecords == 0) {
+        goto done;
+    }
+
+    bw2_mutexLock(&cache->lock);
+    uint64_t maxAge = cache->maxAge;
+    bool current = (cache->maxEntries != 0 && cache->generation == builder->generation);
+    bw2_mutexUnlock(&cache->lock);
+    if (!current) {
+        goto done;
+    }
+
+    entry = _bw2_chaincache_entry_new(builder, bw2_getTimeMicros() / 1000 + maxAge);
+    if (entry == NULL) {
+        goto done;
+    }
+
+    key.uri = builder->key;
+    key.urilen = builder->urilen;
+    key.permissions = &builder->key[builder->urilen];
+    key.permissionslen = builder->permissionslen;
+    key.to = &builder->key[builder->urilen + builder->permissionslen];
+    key.tolen = builder->tolen;
+
+    bw2_mutexLock(&cache->lock);
+    if (cache->maxEntries == 0 || cache->generation != builder->generation) {
+        bw2_mutexUnlock(&cache->lock);
+        bw2_allocatorFree(cache->allocator, BW2_ALLOC_CHAIN_CACHE, entry);
+        goto done;
+    }
+
+    /* Another request for the same triple may have finished first. */
+    struct bw2_chainCacheEntry* old;
+    for (old = cache->buckets[entry->keyhash & (cache->numbuckets - 1)]; old != NULL; old = old->next) {
+        if (_bw2_chaincache_entry_matches(old, entry->keyhash, &key)) {
+            _bw2_chaincache_unlink(cache, old);
+            break;
+        }
+    }
+    if (cache->stats.entries == cache->maxEntries) {
+        _bw2_chaincache_unlink(cache, cache->lrutail);
+        cache->stats.evictions++;
+    }
+
+    struct bw2_chainCacheEntry** bucket = &cache->buckets[entry->keyhash & (cache->numbuckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    _bw2_chaincache_push_front(cache, entry);
+    cache->stats.inserts++;
+    cache->stats.entries++;
+    cache->stats.bytes += entry->size;
+    bw2_mutexUnlock(&cache->lock);
+
+done:
+    bw2_chainCacheBuilderDiscard(builder);
+}
+
+void bw2_chainCacheBuilderDiscard(struct bw2_chainCacheBuilder* builder) {
+    if (builder->records != NULL) {
+        bw2_allocatorFree(builder->allocator, BW2_ALLOC_CHAIN_CACHE, builder->records);
+    }
+    if (builder->data != NULL) {
+        bw2_allocatorFree(builder->allocator, BW2_ALLOC_CHAIN_CACHE, builder->data);
+    }
+    bw2_allocatorFree(builder->allocator, BW2_ALLOC_CHAIN_CACHE, builder);
+}
+
+size_t bw2_chainCacheInvalidate(struct bw2_chainCache* cache, struct bw2_chainCacheKey* key) {
+    size_t removed = 0;
+
+    bw2_mutexLock(&cache->lock);
+    if (key == NULL) {
+        removed = cache->stats.entries;
+        _bw2_chaincache_clear(cache);
+    } else if (cache->maxEntries != 0) {
+        uint64_t keyhash = _bw2_chaincache_keyhash(key);
+        struct bw2_chainCacheEntry* entry;
+        for (entry = cache->buckets[keyhash & (cache->numbuckets - 1)]; entry != NULL; entry = entry->next) {
+            if (_bw2_chaincache_entry_matches(entry, keyhash, key)) {
+                _bw2_chaincache_unlink(cache, entry);
+                removed = 1;
+                break;
+            }
+        }
+    }
+    cache->generation++;
+    cache->stats.invalidations += removed;
+    bw2_mutexUnlock(&cache->lock);
+
+    return removed;
+}
+
+size_t bw2_chainCacheInvalidateChain(struct bw2_chainCache* cache, const struct bw2_hash* chainhash) {
+    size_t removed = 0;
+    struct bw2_chainCacheEntry* entry;
+    struct bw2_chainCacheEntry* next;
+
+    bw2_mutexLock(&cache->lock);
+    for (entry = cache->lruhead; entry != NULL; entry = next) {
+        struct bw2_chainCacheRecord* records = _bw2_chaincache_entry_records(entry);
+        uint32_t i;
+        next = entry->lrunext;
+        for (i = 0; i != entry->numChains; i++) {
+            struct bw2_hash hash;
+            if (records[i].hash.offset != 0
+                && bw2_hashDecode(&hash, ((char*) entry) + records[i].hash.offset, records[i].hash.len) == 0
+                && bw2_hashEqual(&hash, chainhash)) {
+                _bw2_chaincache_unlink(cache, entry);
+                removed++;
+                break;
+            }
+        }
+    }
+    cache->generation++;
+    cache->stats.invalidations += removed;
+    bw2_mutexUnlock(&cache->lock);
+
+    return removed;
+}
+
+void bw2_chainCacheGetStats(struct bw2_chainCache* cache, struct bw2_chainCacheStats* stats) {
+    bw2_mutexLock(&cache->lock);
+    memcpy(stats, &cache->stats, sizeof(struct bw2_chainCacheStats));
+    bw2_mutexUnlock(&cache->lock);
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BW2_CHAINCACHE_H
+#define BW2_CHAINCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "objects.h"
+#include "osutil.h"
+#include "utils.h"
+
+#define BW2_CHAINCACHE_DEFAULT_MAX_ENTRIES 64
+#define BW2_CHAINCACHE_DEFAULT_MAX_AGE 300000
+
+struct bw2_simpleChain;
+
+struct bw2_chainCacheParams {
+    /* Most (uri, accessPermissions, to) triples kept (0 for the default). */
+    size_t maxEntries;
+
+    /* Milliseconds for which the chains built for a triple are reused (0 for
+     * the default).
+     */
+    uint64_t maxAge;
+};
+
+struct bw2_chainCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired; // Misses because the triple's entry was too old
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+/* What a cache entry is looked up by. The strings are not null-terminated. */
+struct bw2_chainCacheKey {
+    const char* uri;
+    size_t urilen;
+    const char* permissions;
+    size_t permissionslen;
+    const char* to;
+    size_t tolen;
+};
+
+/* Where one field of a cached chain is, relative to the start of its entry.
+ * An offset of 0 means that the chain did not have the field.
+ */
+struct bw2_chainCacheField {
+    uint32_t offset;
+    uint32_t len;
+};
+
+struct bw2_chainCacheRecord {
+    struct bw2_chainCacheField hash;
+    struct bw2_chainCacheField permissions;
+    struct bw2_chainCacheField to;
+    struct bw2_chainCacheField uri;
+    struct bw2_chainCacheField content;
+};
+
+/* The chains built for one triple, stored in a single block: this header,
+ * the key, the records of the chains, and then the bytes they refer to.
+ */
+struct bw2_chainCacheEntry {
+    struct bw2_chainCacheEntry* next; // In its bucket
+    struct bw2_chainCacheEntry* lruprev;
+    struct bw2_chainCacheEntry* lrunext;
+    uint64_t keyhash;
+    uint64_t expires;
+    size_t size;
+
+    /* An entry that is removed from the cache while it is being read is
+     * freed once REFS reaches 0.
+     */
+    size_t refs;
+    bool linked;
+
+    uint32_t urilen;
+    uint32_t permissionslen;
+    uint32_t tolen;
+    uint32_t recordsOffset;
+    uint32_t numChains;
+};
+
+/* Collects the chains streamed back for a triple, to be added to the cache
+ * once the last one has arrived. The cache is only updated if it has not been
+ * invalidated in the meantime.
+ */
+struct bw2_chainCacheBuilder {
+    struct bw2_allocator* allocator;
+    uint64_t generation;
+    uint64_t keyhash;
+    bool failed;
+
+    /* Field offsets are relative to the start of DATA, plus one. */
+    struct bw2_chainCacheRecord* records;
+    size_t numRecords;
+    size_t recordsCap;
+    char* data;
+    size_t datalen;
+    size_t datacap;
+
+    size_t urilen;
+    size_t permissionslen;
+    size_t tolen;
+    char key[];
+};
+
+/* A cache of built chains, which may be used from any thread. A cache with a
+ * MAXENTRIES of 0 is disabled.
+ */
+struct bw2_chainCache {
+    struct bw2_mutex lock;
+    struct bw2_allocator* allocator;
+    size_t maxEntries;
+    uint64_t maxAge;
+
+    struct bw2_chainCacheEntry** buckets;
+    size_t numbuckets;
+    struct bw2_chainCacheEntry* lruhead; // Most recently used
+    struct bw2_chainCacheEntry* lrutail;
+
+    /* Incremented whenever entries are invalidated. */
+    uint64_t generation;
+    struct bw2_chainCacheStats stats;
+};
+
+/* ALLOCATOR may be NULL, to use malloc and free. */
+int bw2_chainCacheInit(struct bw2_chainCache* cache, struct bw2_allocator* allocator);
+
+/* Empties the cache, and enables it with PARAMS, or disables it if PARAMS is
+ * NULL.
+ */
+int bw2_chainCacheConfigure(struct bw2_chainCache* cache, struct bw2_chainCacheParams* params);
+
+/* Returns the unexpired entry for KEY, or NULL if there is none. The entry
+ * must be released with bw2_chainCacheRelease.
+ */
+struct bw2_chainCacheEntry* bw2_chainCacheLookup(struct bw2_chainCache* cache, struct bw2_chainCacheKey* key);
+void bw2_chainCacheGetChain(struct bw2_chainCacheEntry* entry, size_t index, struct bw2_simpleChain* sc);
+void bw2_chainCacheRelease(struct bw2_chainCache* cache, struct bw2_chainCacheEntry* entry);
+
+/* Returns NULL if the cache is disabled or the builder could not be
+ * allocated.
+ */
+struct bw2_chainCacheBuilder* bw2_chainCacheBuilderNew(struct bw2_chainCache* cache, struct bw2_chainCacheKey* key);
+void bw2_chainCacheBuilderAdd(struct bw2_chainCacheBuilder* builder, struct bw2_simpleChain* sc);
+
+/* Makes bw2_chainCacheBuilderFinish cache nothing, because some of the chains
+ * could not be collected in full.
+ */
+void bw2_chainCacheBuilderFail(struct bw2_chainCacheBuilder* builder);
+
+/* Both of these free BUILDER. */
+void bw2_chainCacheBuilderFinish(struct bw2_chainCache* cache, struct bw2_chainCacheBuilder* builder);
+void bw2_chainCacheBuilderDiscard(struct bw2_chainCacheBuilder* builder);
+
+/* Removes the entry for KEY, or every entry if KEY is NULL, and returns how
+ * many were removed.
+ */
+size_t bw2_chainCacheInvalidate(struct bw2_chainCache* cache, struct bw2_chainCacheKey* key);
+
+/* Removes every entry with a chain whose hash is CHAINHASH. */
+size_t bw2_chainCacheInvalidateChain(struct bw2_chainCache* cache, const struct bw2_hash* chainhash);
+void bw2_chainCacheGetStats(struct bw2_chainCache* cache, struct bw2_chainCacheStats* stats);
+
+#endif
@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A C++20 coroutine layer over the API in api.h. It is header-only, and does
+ * not change how the C library is built.
+ *
+ * Requests made through bw2::Client are sent without blocking the calling
+ * thread; the coroutine that awaits one is suspended until the response
+ * arrives, and is then handed to a bw2::Executor to be resumed. Subscriptions,
+ * queries and lists are exposed as bw2::Stream objects, whose results are
+ * awaited one at a time with next().
+ */
+
+#ifndef BW2_CORO_HPP
+#define BW2_CORO_HPP
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+extern "C" {
+#include "api.h"
+#include "errors.h"
+}
+
+namespace bw2 {
+
+/* Decides where suspended coroutines are resumed. POST may be called on the
+ * BOSSWAVE thread, so it must return quickly, and must not resume the
+ * coroutine itself.
+ */
+class Executor {
+public:
+    virtual ~Executor() = default;
+    virtual void post(std::coroutine_handle<> handle) = 0;
+};
+
+/* An executor that queues coroutines, and resumes them on whichever threads
+ * call run() or poll(). A few threads calling run() can serve any number of
+ * concurrent requests.
+ */
+class QueueExecutor : public Executor {
+public:
+    void post(std::coroutine_handle<> handle) override {
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->ready.push_back(handle);
+        }
+        this->nonempty.notify_one();
+    }
+
+    /* Resumes coroutines as they become ready, until stop() is called. */
+    void run() {
+        while (true) {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->nonempty.wait(guard, [this] { return this->stopped || !this->ready.empty(); });
+            if (this->stopped) {
+                return;
+            }
+            std::coroutine_handle<> handle = this->ready.front();
+            this->ready.pop_front();
+            guard.unlock();
+            handle.resume();
+        }
+    }
+
+    /* Resumes the coroutines that are ready, without waiting for more, and
+     * returns how many were resumed.
+     */
+    std::size_t poll() {
+        std::size_t resumed = 0;
+        while (true) {
+            std::unique_lock<std::mutex> guard(this->lock);
+            if (this->ready.empty()) {
+                return resumed;
+            }
+            std::coroutine_handle<> handle = this->ready.front();
+            this->ready.pop_front();
+            guard.unlock();
+            handle.resume();
+            resumed++;
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->stopped = true;
+        }
+        this->nonempty.notify_all();
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable nonempty;
+    std::deque<std::coroutine_handle<>> ready;
+    bool stopped = false;
+};
+
+/* A coroutine that starts running as soon as it is called, and frees itself
+ * when it returns. An exception escaping it terminates the program.
+ */
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/* Awaits a request made with one of the *Async functions in api.h, which
+ * START makes given the completion. The result of co_await is the request's
+ * result, as returned by the blocking function.
+ */
+template <typename Start>
+class CompletionAwaiter {
+public:
+    CompletionAwaiter(Executor& executor, Start start) : executor(executor), start(std::move(start)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        this->handle = handle;
+        this->completion.on_complete = &CompletionAwaiter::complete;
+        this->completion.ctx.ptr = this;
+
+        /* If the request cannot be sent, the completion finishes (and the
+         * coroutine is posted) before START returns, so nothing may be done
+         * here afterwards.
+         */
+        this->start(&this->completion);
+    }
+
+    int await_resume() { return bw2_wait(&this->completion); }
+
+private:
+    static void complete(struct bw2_completion* completion, union bw2_userctx ctx) {
+        (void) completion;
+        CompletionAwaiter* self = static_cast<CompletionAwaiter*>(ctx.ptr);
+        self->executor.post(self->handle);
+    }
+
+    Executor& executor;
+    Start start;
+    std::coroutine_handle<> handle;
+    struct bw2_completion completion;
+};
+
+struct MessageDeleter {
+    void operator()(struct bw2_simpleMessage* sm) const { bw2_simpleMessageFree(sm); }
+};
+
+/* A message received from a subscription or query, retained with
+ * bw2_simpleMessageRetain so that it outlives the BOSSWAVE thread's callback.
+ */
+using Message = std::unique_ptr<struct bw2_simpleMessage, MessageDeleter>;
+
+/* The state shared by a Stream and the C library's callbacks. It keeps itself
+ * alive (through SELF) until the library stops calling them.
+ */
+template <typename T>
+struct StreamState {
+    std::mutex lock;
+    std::deque<T> items;
+    bool ended = false;
+    bool stopped = false;
+    int error = 0;
+    std::coroutine_handle<> waiter;
+    Executor* executor = nullptr;
+    std::shared_ptr<StreamState> self;
+
+    struct bw2_simplemsg_ctx smctx;
+    struct bw2_chararr_ctx lctx;
+    struct bw2_subscriptionHandle handle;
+    struct bw2_completion completion;
+
+    /* Called on the BOSSWAVE thread for each result. Returns whether the C
+     * library should stop listening.
+     */
+    bool deliver(std::optional<T> item, bool end, int err) {
+        std::shared_ptr<StreamState> keep;
+        std::coroutine_handle<> resume;
+        bool stop;
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (item.has_value()) {
+                this->items.push_back(std::move(*item));
+            }
+            if (end) {
+                this->ended = true;
+                this->error = err;
+            }
+            stop = this->stopped;
+            if (end || stop) {
+                keep = std::move(this->self);
+            }
+            if (item.has_value() || end) {
+                resume = std::exchange(this->waiter, nullptr);
+            }
+        }
+        if (resume) {
+            this->executor->post(resume);
+        }
+        /* This object may be destroyed as KEEP goes out of scope. */
+        return stop;
+    }
+};
+
+/* The functions the C library calls with the results of a stream. */
+inline bool onStreamMessage(struct bw2_simpleMessage* sm, bool final, int error, union bw2_userctx ctx) {
+    StreamState<Message>* state = static_cast<StreamState<Message>*>(ctx.ptr);
+    if (sm == nullptr) {
+        /* The library stops listening after this, whatever is returned. */
+        state->deliver(std::nullopt, true, error);
+        return true;
+    }
+    Message copy(bw2_simpleMessageRetain(sm));
+    if (!copy) {
+        state->deliver(std::nullopt, true, BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE);
+        return true;
+    }
+    return state->deliver(std::move(copy), final, 0);
+}
+
+inline bool onStreamChild(char* arr, std::size_t arrlen, bool final, int error, union bw2_userctx ctx) {
+    StreamState<std::string>* state = static_cast<StreamState<std::string>*>(ctx.ptr);
+    if (arr == nullptr) {
+        bool stop = state->deliver(std::nullopt, final, error);
+        return stop || final;
+    }
+    return state->deliver(std::string(arr, arrlen), final, 0);
+}
+
+/* The results of a subscription, query or list. Results arriving before
+ * next() is awaited are buffered. Destroying a Stream makes the library stop
+ * listening for more results; to cancel a subscription at the agent, use
+ * Client::unsubscribe first.
+ */
+template <typename T>
+class Stream {
+public:
+    class NextAwaiter {
+    public:
+        explicit NextAwaiter(StreamState<T>* state) : state(state) {}
+
+        bool await_ready() {
+            std::lock_guard<std::mutex> guard(this->state->lock);
+            return !this->state->items.empty() || this->state->ended;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            std::lock_guard<std::mutex> guard(this->state->lock);
+            if (!this->state->items.empty() || this->state->ended) {
+                return false;
+            }
+            this->state->waiter = handle;
+            return true;
+        }
+
+        std::optional<T> await_resume() {
+            std::lock_guard<std::mutex> guard(this->state->lock);
+            if (this->state->items.empty()) {
+                return std::nullopt;
+            }
+            T item = std::move(this->state->items.front());
+            this->state->items.pop_front();
+            return item;
+        }
+
+    private:
+        StreamState<T>* state;
+    };
+
+    Stream() = default;
+    explicit Stream(std::shared_ptr<StreamState<T>> state) : state(std::move(state)) {}
+    Stream(Stream&&) = default;
+    Stream& operator=(Stream&& other) {
+        this->release();
+        this->state = std::move(other.state);
+        return *this;
+    }
+    ~Stream() { this->release(); }
+
+    /* Awaits the next result. The result of co_await is empty once the
+     * stream has ended and every result has been taken; error() then tells
+     * why it ended. Only one call to next() may be awaited at a time.
+     */
+    NextAwaiter next() { return NextAwaiter(this->state.get()); }
+
+    /* Returns 0 if the stream ended normally, or the error that ended it
+     * (including the error from starting it).
+     */
+    int error() {
+        std::lock_guard<std::mutex> guard(this->state->lock);
+        return this->state->error;
+    }
+
+    struct bw2_subscriptionHandle* handle() { return &this->state->handle; }
+
+private:
+    void release() {
+        if (this->state) {
+            std::lock_guard<std::mutex> guard(this->state->lock);
+            this->state->stopped = true;
+        }
+        this->state.reset();
+    }
+
+    std::shared_ptr<StreamState<T>> state;
+};
+
+/* Awaits the agent's response to the request that starts a stream, which
+ * START makes given the stream's state. The result of co_await is the stream;
+ * if the request failed, the stream has already ended with the error.
+ */
+template <typename T, typename Start>
+class StreamAwaiter {
+public:
+    StreamAwaiter(Executor& executor, Start start) : state(std::make_shared<StreamState<T>>()), start(std::move(start)) {
+        this->state->executor = &executor;
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        StreamState<T>* s = this->state.get();
+        this->handle = handle;
+        s->self = this->state;
+        s->completion.on_complete = &StreamAwaiter::complete;
+        s->completion.ctx.ptr = this;
+        this->start(s);
+    }
+
+    Stream<T> await_resume() {
+        int rv = bw2_wait(&this->state->completion);
+        if (rv != 0) {
+            /* The library will not call the stream's callbacks. */
+            std::lock_guard<std::mutex> guard(this->state->lock);
+            this->state->ended = true;
+            this->state->error = rv;
+            this->state->self.reset();
+        }
+        return Stream<T>(std::move(this->state));
+    }
+
+private:
+    static void complete(struct bw2_completion* completion, union bw2_userctx ctx) {
+        (void) completion;
+        StreamAwaiter* self = static_cast<StreamAwaiter*>(ctx.ptr);
+        self->state->executor->post(self->handle);
+    }
+
+    std::shared_ptr<StreamState<T>> state;
+    Start start;
+    std::coroutine_handle<> handle;
+};
+
+template <typename T, typename Start>
+StreamAwaiter<T, Start> startStream(Executor& executor, Start start) {
+    return StreamAwaiter<T, Start>(executor, std::move(start));
+}
+
+/* Wraps a connected client. Every function returns an object to co_await;
+ * the parameter structs, and the data they point to, must remain valid until
+ * the co_await expression completes. Output parameters are filled in before
+ * the awaiting coroutine is resumed.
+ */
+class Client {
+public:
+    Client(struct bw2_client* client, Executor& executor) : client(client), executor(executor) {}
+
+    struct bw2_client* get() { return this->client; }
+
+    auto setEntity(char* entity, std::size_t entitylen, struct bw2_vkHash* vkhash = nullptr) {
+        struct bw2_client* c = this->client;
+        return CompletionAwaiter(this->executor, [=](struct bw2_completion* completion) {
+            return bw2_setEntityAsync(c, entity, entitylen, vkhash, completion);
+        });
+    }
+
+    auto publish(struct bw2_publishParams* p) {
+        struct bw2_client* c = this->client;
+        return CompletionAwaiter(this->executor, [=](struct bw2_completion* completion) {
+            return bw2_publishAsync(c, p, completion);
+        });
+    }
+
+    auto createDOT(struct bw2_createDOTParams* p, struct bw2_dotHash* dothash, struct bw2_dot* dot = nullptr) {
+        struct bw2_client* c = this->client;
+        return CompletionAwaiter(this->executor, [=](struct bw2_completion* completion) {
+            return bw2_createDOTAsync(c, p, dothash, dot, completion);
+        });
+    }
+
+    auto createEntity(struct bw2_createEntityParams* p, struct bw2_vkHash* vkhash, struct bw2_vk* vk = nullptr) {
+        struct bw2_client* c = this->client;
+        return CompletionAwaiter(this->executor, [=](struct bw2_completion* completion) {
+            return bw2_createEntityAsync(c, p, vkhash, vk, completion);
+        });
+    }
+
+    auto createDOTChain(struct bw2_createDOTChainParams* p, struct bw2_dotChainHash* dotchainhash) {
+        struct bw2_client* c = this->client;
+        return CompletionAwaiter(this->executor, [=](struct bw2_completion* completion) {
+            return bw2_createDOTChainAsync(c, p, dotchainhash, completion);
+        });
+    }
+
+    auto subscribe(struct bw2_subscribeParams* p) {
+        struct bw2_client* c = this->client;
+        return startStream<Message>(this->executor, [=](StreamState<Message>* s) {
+            s->smctx.on_message = onStreamMessage;
+            s->smctx.ctx.ptr = s;
+            return bw2_subscribeAsync(c, p, &s->smctx, &s->handle, &s->completion);
+        });
+    }
+
+    auto query(struct bw2_queryParams* p) {
+        struct bw2_client* c = this->client;
+        return startStream<Message>(this->executor, [=](StreamState<Message>* s) {
+            s->smctx.on_message = onStreamMessage;
+            s->smctx.ctx.ptr = s;
+            return bw2_queryAsync(c, p, &s->smctx, &s->completion);
+        });
+    }
+
+    auto list(struct bw2_listParams* p) {
+        struct bw2_client* c = this->client;
+        return startStream<std::string>(this->executor, [=](StreamState<std::string>* s) {
+            s->lctx.on_message = onStreamChild;
+            s->lctx.ctx.ptr = s;
+            return bw2_listAsync(c, p, &s->lctx, &s->completion);
+        });
+    }
+
+    /* Cancels a subscription. The stream ends once the agent confirms it. */
+    auto unsubscribe(Stream<Message>& stream) {
+        struct bw2_client* c = this->client;
+        struct bw2_subscriptionHandle* handle = stream.handle();
+        return CompletionAwaiter(this->executor, [=](struct bw2_completion* completion) {
+            return bw2_unsubscribeAsync(c, handle, completion);
+        });
+    }
+
+private:
+    struct bw2_client* client;
+    Executor& executor;
+};
+
+}
+
+#endif
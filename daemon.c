@@ -31,82 +31,423 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if (BW2_OS == LINUX)
+#include <poll.h>
+#include <sys/timerfd.h>
+#endif
+
 #include "api.h"
 #include "daemon.h"
 #include "errors.h"
 #include "frame.h"
+#include "internal.h"
 #include "osutil.h"
+#include "utils.h"
+
+uint64_t _bw2_nowMillis(void) {
+    return bw2_getTimeMicros() / 1000;
+}
+
+/* Whether RCTX's frames are read with a budget or policy of their own. */
+bool _bw2_reqctxFiltered(struct bw2_reqctx* rctx) {
+    return rctx->budget != NULL || rctx->policy != NULL;
+}
+
+/* Adds RCTX to the client's list of outstanding requests. Must be called with
+ * client->reqslock held.
+ */
+void _bw2_reqsInsert(struct bw2_client* client, struct bw2_reqctx* rctx) {
+    if (_bw2_reqctxFiltered(rctx)) {
+        __atomic_fetch_add(&client->reqsfiltered, 1, __ATOMIC_RELAXED);
+    }
+    rctx->next = client->reqs;
+    if (rctx->next != NULL) {
+        rctx->next->pprev = &rctx->next;
+    }
+    rctx->pprev = &client->reqs;
+    client->reqs = rctx;
+}
+
+/* Removes RCTX from the client's list of outstanding requests, if it is there.
+ * Must be called with client->reqslock held.
+ */
+void _bw2_reqsRemove(struct bw2_reqctx* rctx) {
+    if (rctx->pprev != NULL) {
+        if (_bw2_reqctxFiltered(rctx)) {
+            __atomic_fetch_sub(&rctx->client->reqsfiltered, 1, __ATOMIC_RELAXED);
+        }
+        *rctx->pprev = rctx->next;
+        if (rctx->next != NULL) {
+            rctx->next->pprev = rctx->pprev;
+        }
+        rctx->next = NULL;
+        rctx->pprev = NULL;
+    }
+}
+
+/* Stops the deadline and cancellation token from applying to RCTX. Must be
+ * called with client->reqslock held.
+ */
+void _bw2_reqctxDisarm(struct bw2_reqctx* rctx) {
+    bw2_timerCancel(&rctx->timer);
+    if (rctx->cancel != NULL) {
+        rctx->cancel->reqctx = NULL;
+        rctx->cancel = NULL;
+    }
+}
+
+/* Ends an outstanding request early, because its deadline has passed or it was
+ * cancelled. Must be called with client->reqslock held.
+ */
+void _bw2_expireRequest(struct bw2_reqctx* rctx, int error) {
+    _bw2_reqsRemove(rctx);
+    _bw2_reqctxDisarm(rctx);
+    rctx->rv = error;
+    rctx->onframe(NULL, true, rctx, rctx->ctx);
+}
+
+void _bw2_reqctx_timeout(struct bw2_timer* timer, void* ctx) {
+    (void) timer;
+    _bw2_expireRequest(ctx, BW2_ERROR_TIMEOUT);
+}
+
+/* Expires every request whose deadline has passed. Must be called with
+ * client->reqslock held.
+ */
+void _bw2_serviceTimers(struct bw2_client* client) {
+    bw2_timerWheelAdvance(&client->timers, _bw2_nowMillis());
+}
+
+/* Makes the BOSSWAVE thread wake up by DEADLINE, in milliseconds, to expire
+ * requests. Must be called with client->reqslock held.
+ */
+void _bw2_daemonWakeBy(struct bw2_client* client, uint64_t deadline) {
+#if (BW2_OS == LINUX)
+    if (client->timerfd == -1 || (client->timerfdExpiry != 0 && client->timerfdExpiry <= deadline)) {
+        return;
+    }
+
+    struct itimerspec its;
+    memset(&its, 0x00, sizeof(its));
+    its.it_value.tv_sec = (time_t) (deadline / 1000);
+    its.it_value.tv_nsec = (long) ((deadline % 1000) * 1000000);
+    if (timerfd_settime(client->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+        client->timerfdExpiry = deadline;
+    }
+#else
+    (void) client;
+    (void) deadline;
+#endif
+}
+
+/* Delivers batched messages before the BOSSWAVE thread waits for the next
+ * frame. Batches are only held back while more frames are ready to be read, or
+ * always delivered if that cannot be checked.
+ */
+void _bw2_daemonFlushBatches(struct bw2_client* client) {
+    bw2_mutexLock(&client->reqslock);
+    if (client->batches != NULL) {
+#if (BW2_OS == LINUX)
+        struct pollfd fd;
+        fd.fd = client->connfd;
+        fd.events = POLLIN;
+        _bw2_flushBatches(client, poll(&fd, 1, 0) != 1);
+#else
+        _bw2_flushBatches(client, true);
+#endif
+    }
+    bw2_mutexUnlock(&client->reqslock);
+}
+
+/* Waits until the agent's next frame starts to arrive, expiring requests as
+ * their deadlines pass in the meantime. Without a timer to wait on, this
+ * returns immediately, and the frame is waited for while reading it.
+ */
+void _bw2_daemonAwaitFrame(struct bw2_client* client) {
+    _bw2_daemonFlushBatches(client);
+
+#if (BW2_OS == LINUX)
+    while (client->timerfd != -1) {
+        struct pollfd fds[2];
+        fds[0].fd = client->connfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = client->timerfd;
+        fds[1].events = POLLIN;
+
+        int rv = poll(fds, 2, -1);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv == -1 || fds[0].revents != 0) {
+            return;
+        }
+
+        if ((fds[1].revents & POLLIN) != 0) {
+            uint64_t expirations;
+            if (read(client->timerfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+                return;
+            }
+
+            uint64_t next;
+            bw2_mutexLock(&client->reqslock);
+            _bw2_serviceTimers(client);
+            client->timerfdExpiry = 0;
+            if (bw2_timerWheelNext(&client->timers, &next)) {
+                _bw2_daemonWakeBy(client, next);
+            }
+            bw2_mutexUnlock(&client->reqslock);
+        }
+    }
+#else
+    (void) client;
+#endif
+}
+
+/* Fails every outstanding request once the connection to the agent is gone.
+ * If KEEPREPLAYABLE is true, subscriptions that will be replayed when the
+ * client reconnects are left in place. Must be called with client->reqslock
+ * held.
+ */
+void _bw2_failAllRequests(struct bw2_client* client, bool keepReplayable) {
+    /* Mark the client as disconnected so that future requests can just
+     * fail immediately.
+     */
+    bw2_mutexLock(&client->outlock);
+    if (client->connected) {
+        close(client->connfd);
+        client->connected = false;
+    }
+    bw2_mutexUnlock(&client->outlock);
+
+    /* Release all resources and close the socket. */
+    struct bw2_reqctx* curr = client->reqs;
+    while (curr != NULL) {
+        /* At this point, curr may no longer be a valid pointer after the
+         * callback returns.
+         */
+        struct bw2_reqctx* next = curr->next;
+        if (keepReplayable && curr->replay != NULL) {
+            curr = next;
+            continue;
+        }
+
+        struct bw2_replaySub* replay = curr->replay;
+        _bw2_reqsRemove(curr);
+        _bw2_reqctxDisarm(curr);
+        curr->rv = BW2_ERROR_CONNECTION_LOST;
+        curr->onframe(NULL, true, curr, curr->ctx);
+        if (replay != NULL) {
+            _bw2_forgetReplay(client, replay);
+        }
+        curr = next;
+    }
+}
+
+/* Hands FRAME to the outstanding request with the same sequence number.
+ * Must be called with client->reqslock held.
+ */
+void _bw2_dispatchFrame(struct bw2_client* client, struct bw2_frame* frame) {
+    struct bw2_reqctx* curr = client->reqs;
+
+    while (curr != NULL && curr->seqno != frame->seqno) {
+        curr = curr->next;
+    }
+    if (curr == NULL) {
+        return;
+    }
+
+    struct bw2_header* finishhdr = bw2_getFirstHeader(frame, "finished");
+    struct bw2_replaySub* replay = curr->replay;
+    bool final = (finishhdr != NULL && strncmp(finishhdr->value, "true", finishhdr->len) == 0);
+
+    /* Take the request out of the list while its function runs, since it may
+     * no longer be valid once the function stops listening. It is put back
+     * only if the function wants more frames.
+     */
+    _bw2_reqsRemove(curr);
+    curr->rv = 0; // Normal frame
+    curr->dropped += frame->dropped;
+    bool stoplistening = curr->onframe(frame, final, curr, curr->ctx);
+
+    if (final || stoplistening) {
+        /* At this point, curr may no longer be a valid pointer. */
+        if (replay != NULL) {
+            _bw2_forgetReplay(client, replay);
+        }
+    } else {
+        _bw2_reqsInsert(client, curr);
+    }
+}
 
 void bw2_daemon(struct bw2_client* client, char* frameheap, size_t heapsize) {
     struct bw2_frame frame;
     int rv;
+
+#if (BW2_OS == LINUX)
+    bw2_mutexLock(&client->reqslock);
+    client->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    client->timerfdExpiry = 0;
+    bw2_mutexUnlock(&client->reqslock);
+#endif
+
     while (true) {
-        rv = bw2_readFrame(&frame, frameheap, heapsize, client->connfd);
+        _bw2_daemonAwaitFrame(client);
+        struct bw2_frameAlloc alloc;
+        _bw2_clientFrameAlloc(client, &alloc, frameheap, heapsize);
+        rv = bw2_readFrameAlloc(&frame, &alloc, client->connfd);
 
         bw2_mutexLock(&client->reqslock);
 
-        struct bw2_reqctx** currptr = &client->reqs;
-        struct bw2_reqctx* curr = *currptr;
-
         if (rv != 0 || !client->connected) {
-            /* Mark the client as disconnected so that future requests can just
-             * fail immediately.
-             */
-            bw2_mutexLock(&client->outlock);
-            if (client->connected) {
-                close(client->connfd);
-                client->connected = false;
-            }
-            bw2_mutexUnlock(&client->outlock);
+            bool reconnect = _bw2_shouldReconnect(client);
+            _bw2_failAllRequests(client, reconnect);
+            bw2_mutexUnlock(&client->reqslock);
 
-            /* Release all resources and close the socket. */
-            while (curr != NULL) {
-                curr->rv = BW2_ERROR_CONNECTION_LOST;
-                curr->onframe(NULL, true, curr, curr->ctx);
+            if (reconnect && _bw2_reconnect(client, frameheap, heapsize) == 0) {
+                continue;
             }
-            client->reqs = NULL;
+            if (reconnect) {
+                /* Give up on the subscriptions that were kept for replay. */
+                bw2_mutexLock(&client->reqslock);
+                _bw2_failAllRequests(client, false);
+                bw2_mutexUnlock(&client->reqslock);
+            }
+            break;
+        }
 
-            bw2_mutexUnlock(&client->reqslock);
+        _bw2_dispatchFrame(client, &frame);
 
-            return;
+        bw2_mutexUnlock(&client->reqslock);
+
+        /* If frameheap == NULL, the frame headers/POs/ROs were taken from
+         * the client's frame pool, so we need to give them back.
+         */
+        if (frameheap == NULL) {
+            bw2_frameFreeToPool(&frame, &client->framepool);
         }
+    }
+
+    bw2_framePoolRelease(&client->framepool);
 
-        while (curr != NULL) {
-            if (curr->seqno == frame.seqno) {
-                struct bw2_header* finishhdr = bw2_getFirstHeader(&frame, "finished");
+#if (BW2_OS == LINUX)
+    bw2_mutexLock(&client->reqslock);
+    if (client->timerfd != -1) {
+        close(client->timerfd);
+        client->timerfd = -1;
+    }
+    bw2_mutexUnlock(&client->reqslock);
+#endif
+}
 
-                struct bw2_reqctx* next = curr->next;
+int bw2_processIncoming(struct bw2_client* client, size_t budget, size_t* processed) {
+    struct bw2_frame frame;
+    size_t handled = 0;
+    int rv = 0;
 
-                bool final = (finishhdr != NULL && strncmp(finishhdr->value, "true", finishhdr->len) == 0);
-                curr->rv = 0; // Normal frame
-                bool stoplistening = curr->onframe(&frame, final, curr, curr->ctx);
+    if (!client->connected) {
+        rv = BW2_ERROR_CONNECTION_LOST;
+        goto lost;
+    }
 
-                if (final || stoplistening) {
-                    /* At this point, curr may no longer be a valid pointer. */
-                    *currptr = next;
-                } else {
-                    currptr = &curr->next;
-                }
+    while (handled < budget) {
+        /* First, hand off a frame if one has been fully buffered. */
+        char* start = &client->rxbuf[client->rxstart];
+        size_t buffered = client->rxlen - client->rxstart;
+        size_t framelen;
+        rv = bw2_scanFrame(start, buffered, &client->rxscan, &framelen);
+        if (rv != 0) {
+            goto lost;
+        }
 
-            } else {
-                currptr = &curr->next;
+        if (framelen != 0) {
+            struct bw2_frameAlloc alloc;
+            _bw2_clientFrameAlloc(client, &alloc, client->frameheap, client->heapsize);
+            rv = bw2_parseFrameAlloc(&frame, &alloc, start, framelen);
+            if (rv != 0) {
+                goto lost;
             }
 
-            curr = *currptr;
+            bw2_mutexLock(&client->reqslock);
+            _bw2_dispatchFrame(client, &frame);
+            _bw2_serviceTimers(client);
+            _bw2_flushBatches(client, false);
+            bw2_mutexUnlock(&client->reqslock);
+
+            if (client->frameheap == NULL) {
+                bw2_frameFreeToPool(&frame, &client->framepool);
+            }
+
+            client->rxstart += framelen;
+            memset(&client->rxscan, 0x00, sizeof(client->rxscan));
+            handled++;
+            continue;
         }
 
-        bw2_mutexUnlock(&client->reqslock);
+        /* Otherwise, read more bytes from the socket, without blocking. */
+        if (client->rxstart != 0) {
+            memmove(client->rxbuf, start, buffered);
+            client->rxlen = buffered;
+            client->rxstart = 0;
+        }
+        if (client->rxlen == client->rxbufsize) {
+            if (!client->rxbufmalloced) {
+                rv = BW2_ERROR_FRAME_HEAP_FULL;
+                goto lost;
+            }
+            char* larger = bw2_allocatorAlloc(&client->allocator, BW2_ALLOC_RXBUF, client->rxbufsize << 1);
+            if (larger == NULL) {
+                rv = BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+                goto lost;
+            }
+            memcpy(larger, client->rxbuf, client->rxlen);
+            bw2_allocatorFree(&client->allocator, BW2_ALLOC_RXBUF, client->rxbuf);
+            client->rxbuf = larger;
+            client->rxbufsize <<= 1;
+        }
 
-        /* If frameheap == NULL, the frame headers/POs/ROs were allocated
-         * with malloc, so we need to free all of the allocated resources.
-         */
-        if (frameheap == NULL) {
-            bw2_frameFreeResources(&frame);
+        ssize_t got = recv(client->connfd, &client->rxbuf[client->rxlen], client->rxbufsize - client->rxlen, MSG_DONTWAIT);
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        } else if (got <= 0) {
+            rv = BW2_ERROR_CONNECTION_LOST;
+            goto lost;
         }
+        client->rxlen += (size_t) got;
     }
+
+    bw2_mutexLock(&client->reqslock);
+    _bw2_serviceTimers(client);
+    _bw2_flushBatches(client, true);
+    bw2_mutexUnlock(&client->reqslock);
+
+    if (processed != NULL) {
+        *processed = handled;
+    }
+    return 0;
+
+lost:
+    bw2_mutexLock(&client->reqslock);
+    _bw2_failAllRequests(client, false);
+    bw2_mutexUnlock(&client->reqslock);
+
+    if (client->rxbufmalloced) {
+        bw2_allocatorFree(&client->allocator, BW2_ALLOC_RXBUF, client->rxbuf);
+        client->rxbufmalloced = false;
+    }
+    client->rxbuf = NULL;
+    client->rxbufsize = 0;
+    client->rxstart = 0;
+    client->rxlen = 0;
+    bw2_framePoolRelease(&client->framepool);
+
+    if (processed != NULL) {
+        *processed = handled;
+    }
+    return rv;
 }
 
 int bw2_transact(struct bw2_client* client, struct bw2_frame* frame, struct bw2_reqctx* reqctx) {
@@ -115,15 +456,34 @@ int bw2_transact(struct bw2_client* client, struct bw2_frame* frame, struct bw2_
     if (reqctx != NULL) {
         reqctx->seqno = frame->seqno;
 
+        reqctx->client = client;
+        reqctx->next = NULL;
+        reqctx->pprev = NULL;
+        reqctx->deadline = 0;
+        bw2_timerInit(&reqctx->timer, _bw2_reqctx_timeout, reqctx);
+
         bw2_mutexLock(&client->reqslock);
 
         if (!client->connected) {
             bw2_mutexUnlock(&client->reqslock);
+            reqctx->rv = BW2_ERROR_CONNECTION_LOST;
             return BW2_ERROR_CONNECTION_LOST;
         }
 
-        reqctx->next = client->reqs;
-        client->reqs = reqctx;
+        if (reqctx->cancel != NULL && !_bw2_cancelTokenBind(reqctx->cancel, client, reqctx)) {
+            reqctx->cancel = NULL;
+            bw2_mutexUnlock(&client->reqslock);
+            reqctx->rv = BW2_ERROR_CANCELLED;
+            return BW2_ERROR_CANCELLED;
+        }
+
+        if (reqctx->timeout != 0) {
+            reqctx->deadline = _bw2_nowMillis() + reqctx->timeout;
+            bw2_timerAdd(&client->timers, &reqctx->timer, reqctx->deadline);
+            _bw2_daemonWakeBy(client, reqctx->deadline);
+        }
+
+        _bw2_reqsInsert(client, reqctx);
         bw2_mutexUnlock(&client->reqslock);
     }
 
@@ -135,6 +495,14 @@ int bw2_transact(struct bw2_client* client, struct bw2_frame* frame, struct bw2_
         close(client->connfd);
         client->connected = false;
         bw2_mutexUnlock(&client->outlock);
+
+        if (reqctx != NULL) {
+            bw2_mutexLock(&client->reqslock);
+            _bw2_reqsRemove(reqctx);
+            _bw2_reqctxDisarm(reqctx);
+            bw2_mutexUnlock(&client->reqslock);
+            reqctx->rv = BW2_ERROR_CONNECTION_LOST;
+        }
         return BW2_ERROR_CONNECTION_LOST;
     }
 
@@ -150,17 +518,111 @@ int bw2_reqctxInit(struct bw2_reqctx* rctx, bool (*onframe)(struct bw2_frame*, b
     bw2_mutexInit(&rctx->lock);
     bw2_condInit(&rctx->condvar);
     rctx->ready = false;
+    rctx->waiter = NULL;
+    rctx->onsignal = NULL;
+    rctx->onsignalctx = NULL;
+    rctx->replay = NULL;
+    rctx->dropped = 0;
+    rctx->budget = NULL;
+    rctx->policy = NULL;
+    rctx->timeout = 0;
+    rctx->cancel = NULL;
+    rctx->next = NULL;
+    rctx->pprev = NULL;
+    rctx->client = NULL;
+    rctx->deadline = 0;
+    bw2_timerInit(&rctx->timer, _bw2_reqctx_timeout, rctx);
 
     return 0;
 }
 
+/* Checks whether RCTX has been signalled without blocking, for as long as
+ * POLICY allows, from START onwards. Returns true if it has been signalled.
+ */
+bool _bw2_reqctxPoll(struct bw2_reqctx* rctx, struct bw2_waitPolicy* policy, uint64_t start) {
+    uint64_t spin = policy->spinMicros;
+    uint64_t yield = policy->yieldMicros;
+    uint64_t elapsed = 0;
+    unsigned int spins = 0;
+
+    if (policy->adaptive) {
+        /* Poll for about twice as long as responses usually take, and not at
+         * all if they usually take longer than polling could last.
+         */
+        uint64_t average = __atomic_load_n(&rctx->client->waitlatency, __ATOMIC_RELAXED);
+        if (average != 0) {
+            if (average > spin + yield) {
+                return false;
+            }
+            spin = BW2_MIN(spin, 2 * average);
+            yield = BW2_MIN(yield, 2 * average - spin);
+        }
+    }
+
+    while (!__atomic_load_n(&rctx->ready, __ATOMIC_ACQUIRE)) {
+        if (elapsed < spin) {
+            bw2_cpuRelax();
+            if (++spins % BW2_WAIT_SPIN_CHECK_INTERVAL != 0) {
+                continue;
+            }
+        } else if (elapsed < spin + yield) {
+            bw2_threadYield();
+        } else {
+            return false;
+        }
+        elapsed = bw2_getTimeMicros() - start;
+    }
+    return true;
+}
+
+/* Adds a response time of WAITED microseconds to CLIENT's moving average.
+ * Concurrent updates may be lost, which only makes the average less precise.
+ */
+void _bw2_recordWait(struct bw2_client* client, uint64_t waited) {
+    uint64_t average = __atomic_load_n(&client->waitlatency, __ATOMIC_RELAXED);
+    if (average == 0) {
+        average = waited;
+    } else {
+        average = average - (average >> BW2_WAIT_LATENCY_SHIFT) + (waited >> BW2_WAIT_LATENCY_SHIFT);
+    }
+    __atomic_store_n(&client->waitlatency, BW2_MAX(average, 1), __ATOMIC_RELAXED);
+}
+
 int bw2_reqctxWait(struct bw2_reqctx* rctx) {
+    struct bw2_client* client = rctx->client;
+    uint64_t start = 0;
+
+    /* Going to sleep and being woken up can take longer than a fast response,
+     * so poll for the response first, if the client's wait policy says to.
+     * The lock is still taken below, so that the signalling thread is done
+     * with RCTX before this function returns.
+     */
+    if (client != NULL && (client->waitpolicy.spinMicros != 0 || client->waitpolicy.yieldMicros != 0)) {
+        start = bw2_getTimeMicros();
+        _bw2_reqctxPoll(rctx, &client->waitpolicy, start);
+    }
+
     bw2_mutexLock(&rctx->lock);
     while (!rctx->ready) {
-        bw2_condWait(&rctx->condvar, &rctx->lock);
+        if (rctx->deadline == 0) {
+            bw2_condWait(&rctx->condvar, &rctx->lock);
+        } else if (bw2_condTimedWait(&rctx->condvar, &rctx->lock, rctx->deadline * 1000) == ETIMEDOUT) {
+            /* Nothing else may be servicing the client's timers, so expire
+             * this request (and any others that are due) from here.
+             */
+            bw2_mutexUnlock(&rctx->lock);
+            bw2_mutexLock(&rctx->client->reqslock);
+            _bw2_serviceTimers(rctx->client);
+            bw2_mutexUnlock(&rctx->client->reqslock);
+            bw2_mutexLock(&rctx->lock);
+        }
     }
     bw2_mutexUnlock(&rctx->lock);
 
+    if (start != 0) {
+        _bw2_recordWait(client, bw2_getTimeMicros() - start);
+    }
+
     return 0;
 }
 
@@ -172,21 +634,57 @@ int bw2_reqctxSignalled(struct bw2_reqctx* rctx, bool* signalled) {
     return 0;
 }
 
+/* Wakes the thread in bw2_waitAny, if any. Must be called with rctx->lock
+ * held.
+ */
+void _bw2_reqctxNotifyWaiter(struct bw2_reqctx* rctx) {
+    struct bw2_reqctxWaiter* waiter = rctx->waiter;
+    if (waiter != NULL) {
+        bw2_mutexLock(&waiter->lock);
+        waiter->fired = true;
+        bw2_condSignal(&waiter->condvar);
+        bw2_mutexUnlock(&waiter->lock);
+    }
+}
+
 int bw2_reqctxSignal(struct bw2_reqctx* rctx) {
+    /* The caller is done waiting, so the deadline no longer applies. */
+    _bw2_reqctxDisarm(rctx);
+
     bw2_mutexLock(&rctx->lock);
-    rctx->ready = true;
+    __atomic_store_n(&rctx->ready, true, __ATOMIC_RELEASE);
     bw2_condSignal(&rctx->condvar);
+    _bw2_reqctxNotifyWaiter(rctx);
+    void (*onsignal)(void*) = rctx->onsignal;
+    void* onsignalctx = rctx->onsignalctx;
+    rctx->onsignal = NULL;
     bw2_mutexUnlock(&rctx->lock);
 
+    /* RCTX may no longer be valid once the lock is released. */
+    if (onsignal != NULL) {
+        onsignal(onsignalctx);
+    }
+
     return 0;
 }
 
 int bw2_reqctxBroadcast(struct bw2_reqctx* rctx) {
+    _bw2_reqctxDisarm(rctx);
+
     bw2_mutexLock(&rctx->lock);
-    rctx->ready = true;
+    __atomic_store_n(&rctx->ready, true, __ATOMIC_RELEASE);
     bw2_condBroadcast(&rctx->condvar);
+    _bw2_reqctxNotifyWaiter(rctx);
+    void (*onsignal)(void*) = rctx->onsignal;
+    void* onsignalctx = rctx->onsignalctx;
+    rctx->onsignal = NULL;
     bw2_mutexUnlock(&rctx->lock);
 
+    /* RCTX may no longer be valid once the lock is released. */
+    if (onsignal != NULL) {
+        onsignal(onsignalctx);
+    }
+
     return 0;
 }
 
@@ -35,29 +35,99 @@
 
 #include "frame.h"
 #include "osutil.h"
+#include "timer.h"
+
+/* While spinning, a waiting thread checks the clock once every this many
+ * checks for the response.
+ */
+#define BW2_WAIT_SPIN_CHECK_INTERVAL 64
+
+/* Each response time contributes 1/2^BW2_WAIT_LATENCY_SHIFT of the moving
+ * average used by adaptive wait policies.
+ */
+#define BW2_WAIT_LATENCY_SHIFT 3
 
 struct bw2_client;
 struct bw2_frame;
+struct bw2_replaySub;
+struct bw2_cancelToken;
+struct bw2_waitPolicy;
+
+/* Lets one thread wait for any of several requests to be signalled (see
+ * bw2_waitAny).
+ */
+struct bw2_reqctxWaiter {
+    struct bw2_mutex lock;
+    struct bw2_cond condvar;
+    bool fired;
+};
 
 struct bw2_reqctx {
     bool (*onframe)(struct bw2_frame*, bool final, struct bw2_reqctx* rctx, void* ctx);
     void* ctx;
 
-    /* Used for blocking semantics of the API. */
+    /* Used for blocking semantics of the API. READY is written with LOCK
+     * held, but may also be read atomically without it.
+     */
     struct bw2_mutex lock;
     struct bw2_cond condvar;
     bool ready;
     int rv;
 
+    /* Also woken when the request is signalled, if not NULL. Protected by
+     * LOCK, which must be acquired before the waiter's lock.
+     */
+    struct bw2_reqctxWaiter* waiter;
+
+    /* Called with ONSIGNALCTX once the request is signalled, if not NULL. */
+    void (*onsignal)(void* ctx);
+    void* onsignalctx;
+
+    /* Set before calling bw2_transact to give the request a deadline
+     * (TIMEOUT milliseconds from now, if nonzero) or a cancellation token.
+     * Both apply until the request is signalled.
+     */
+    uint64_t timeout;
+    struct bw2_cancelToken* cancel;
+
     /* Set internally by the daemon. */
     struct bw2_reqctx* next;
+    struct bw2_reqctx** pprev;
     int32_t seqno;
+    struct bw2_client* client;
+    struct bw2_timer timer;
+    uint64_t deadline;
+
+    /* Set for subscriptions that are replayed when the client reconnects. */
+    struct bw2_replaySub* replay;
+
+    /* The number of headers, POs, and ROs left out of this request's frames
+     * because they did not fit in the frame heap. Updated by the daemon.
+     */
+    uint64_t dropped;
+
+    /* What this request's frames are charged to when they are read without a
+     * frame heap, if not NULL.
+     */
+    struct bw2_memBudget* budget;
+
+    /* Which objects of this request's results are kept, if not NULL. */
+    struct bw2_retainPolicy* policy;
 };
 
 /* This function runs on a separate BOSSWAVE thread. It repeatedly reads frames
  * from the agent and handles them.
  */
 void bw2_daemon(struct bw2_client* client, char* frameheap, size_t heapsize);
+
+/* This function is the non-blocking counterpart of bw2_daemon, for clients
+ * that do not have their own BOSSWAVE thread. It reads whatever bytes are
+ * available on the client's socket without blocking, and handles up to BUDGET
+ * complete frames on the calling thread. The number of frames handled is stored
+ * in PROCESSED, if it is not NULL. Partially received frames are buffered in
+ * the client until the rest of the frame arrives.
+ */
+int bw2_processIncoming(struct bw2_client* client, size_t budget, size_t* processed);
 int bw2_transact(struct bw2_client* client, struct bw2_frame* frame, struct bw2_reqctx* reqctx);
 
 int bw2_reqctxInit(struct bw2_reqctx* rctx, bool (*onframe)(struct bw2_frame*, bool, struct bw2_reqctx*, void*), void* ctx);
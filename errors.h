@@ -41,5 +41,8 @@
 #define BW2_ERROR_OPERATION_NOT_SUPPORTED (9)
 #define BW2_ERROR_CONNECTION_LOST (10)
 #define BW2_ERROR_SYNCHRONIZATION (11)
+#define BW2_ERROR_TIMEOUT (12)
+#define BW2_ERROR_SUBSCRIPTION_ENDED (13)
+#define BW2_ERROR_CANCELLED (14)
 
 #endif
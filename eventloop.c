@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "osutil.h"
+
+#if (BW2_OS == LINUX)
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "daemon.h"
+#include "errors.h"
+#include "eventloop.h"
+
+#define BW2_EVENTLOOP_INITIAL_SLOTS 16
+#define BW2_EVENTLOOP_WAKE_DATA UINT64_MAX
+
+int bw2_eventLoopInit(struct bw2_eventLoop* loop) {
+    memset(loop, 0x00, sizeof(struct bw2_eventLoop));
+
+    loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollfd == -1) {
+        goto error1;
+    }
+
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakefd == -1) {
+        goto error2;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = BW2_EVENTLOOP_WAKE_DATA;
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->wakefd, &ev) != 0) {
+        goto error3;
+    }
+
+    if (bw2_mutexInit(&loop->lock) != 0) {
+        goto error3;
+    }
+
+    return 0;
+
+error3:
+    close(loop->wakefd);
+error2:
+    close(loop->epollfd);
+error1:
+    return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+}
+
+/* Must be called with loop->lock held. */
+void _bw2_eventLoopReleaseSlot(struct bw2_eventLoop* loop, uint32_t index) {
+    struct bw2_eventLoopSlot* slot = &loop->slots[index];
+    slot->client->loop = NULL;
+    slot->client = NULL;
+    slot->generation++;
+    slot->more = false;
+}
+
+int bw2_eventLoopAdd(struct bw2_eventLoop* loop, struct bw2_client* client) {
+    int rv = 0;
+    uint32_t index;
+
+    bw2_mutexLock(&loop->lock);
+
+    for (index = 0; index != loop->numslots; index++) {
+        if (loop->slots[index].client == NULL) {
+            break;
+        }
+    }
+
+    if (index == loop->numslots) {
+        uint32_t numslots = (loop->numslots == 0) ? BW2_EVENTLOOP_INITIAL_SLOTS : (loop->numslots << 1);
+        struct bw2_eventLoopSlot* slots = realloc(loop->slots, numslots * sizeof(struct bw2_eventLoopSlot));
+        if (slots == NULL) {
+            rv = BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+            goto done;
+        }
+        memset(&slots[loop->numslots], 0x00, (numslots - loop->numslots) * sizeof(struct bw2_eventLoopSlot));
+        loop->slots = slots;
+        loop->numslots = numslots;
+    }
+
+    struct bw2_eventLoopSlot* slot = &loop->slots[index];
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (((uint64_t) slot->generation) << 32) | (uint64_t) index;
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, client->connfd, &ev) != 0) {
+        rv = BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        goto done;
+    }
+
+    slot->client = client;
+    slot->more = false;
+    client->loop = loop;
+    client->loopslot = index;
+
+done:
+    bw2_mutexUnlock(&loop->lock);
+    return rv;
+}
+
+int bw2_eventLoopRemove(struct bw2_eventLoop* loop, struct bw2_client* client) {
+    int rv = 0;
+
+    bw2_mutexLock(&loop->lock);
+    if (client->loop != loop) {
+        rv = BW2_ERROR_BAD_ARG;
+    } else {
+        epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, client->connfd, NULL);
+        _bw2_eventLoopReleaseSlot(loop, client->loopslot);
+    }
+    bw2_mutexUnlock(&loop->lock);
+
+    return rv;
+}
+
+/* Handles frames for the client in the given slot. Returns true if the client
+ * may have more buffered frames, that were not handled due to the budget.
+ * Must be called with loop->lock held.
+ */
+bool _bw2_eventLoopService(struct bw2_eventLoop* loop, uint32_t index) {
+    struct bw2_eventLoopSlot* slot = &loop->slots[index];
+    size_t processed;
+
+    int rv = bw2_processIncoming(slot->client, BW2_EVENTLOOP_FRAME_BUDGET, &processed);
+    if (rv != 0) {
+        /* The socket was already closed, which removes it from the epoll set. */
+        _bw2_eventLoopReleaseSlot(loop, index);
+        return false;
+    }
+
+    slot->more = (processed == BW2_EVENTLOOP_FRAME_BUDGET);
+    return slot->more;
+}
+
+int bw2_eventLoopRun(struct bw2_eventLoop* loop) {
+    struct epoll_event events[BW2_EVENTLOOP_MAX_EVENTS];
+    bool more = false;
+
+    while (true) {
+        /* If some client still has buffered frames, we must not block. */
+        int numevents = epoll_wait(loop->epollfd, events, BW2_EVENTLOOP_MAX_EVENTS, more ? 0 : -1);
+        if (numevents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        }
+
+        bw2_mutexLock(&loop->lock);
+
+        if (loop->stopping) {
+            bw2_mutexUnlock(&loop->lock);
+            return 0;
+        }
+
+        bool stillmore = false;
+
+        int i;
+        for (i = 0; i != numevents; i++) {
+            uint64_t data = events[i].data.u64;
+            if (data == BW2_EVENTLOOP_WAKE_DATA) {
+                uint64_t count;
+                while (read(loop->wakefd, &count, sizeof(count)) > 0) {
+                }
+                continue;
+            }
+
+            uint32_t index = (uint32_t) data;
+            uint32_t generation = (uint32_t) (data >> 32);
+            if (index >= loop->numslots || loop->slots[index].client == NULL
+                    || loop->slots[index].generation != generation) {
+                /* The client was removed after this event was reported. */
+                continue;
+            }
+
+            stillmore = _bw2_eventLoopService(loop, index) || stillmore;
+        }
+
+        if (more) {
+            /* Revisit clients that ran out of budget last time around. */
+            uint32_t index;
+            for (index = 0; index != loop->numslots; index++) {
+                if (loop->slots[index].client != NULL && loop->slots[index].more) {
+                    stillmore = _bw2_eventLoopService(loop, index) || stillmore;
+                }
+            }
+        }
+
+        more = stillmore;
+
+        bw2_mutexUnlock(&loop->lock);
+    }
+}
+
+void* _bw2_eventLoop_trampoline(void* arg) {
+    bw2_eventLoopRun(arg);
+    return NULL;
+}
+
+int bw2_eventLoopStart(struct bw2_eventLoop* loop, char* threadstack, size_t stacksize) {
+    struct bw2_threadAttrs attrs;
+    memset(&attrs, 0x00, sizeof(attrs));
+    attrs.stack = threadstack;
+    attrs.stacksize = stacksize;
+    return bw2_eventLoopStartWithAttrs(loop, &attrs);
+}
+
+int bw2_eventLoopStartWithAttrs(struct bw2_eventLoop* loop, struct bw2_threadAttrs* attrs) {
+    return bw2_threadCreateWithAttrs(attrs, _bw2_eventLoop_trampoline, loop, NULL);
+}
+
+int bw2_eventLoopStop(struct bw2_eventLoop* loop) {
+    uint64_t one = 1;
+
+    bw2_mutexLock(&loop->lock);
+    loop->stopping = true;
+    bw2_mutexUnlock(&loop->lock);
+
+    if (write(loop->wakefd, &one, sizeof(one)) != sizeof(one)) {
+        return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+    }
+    return 0;
+}
+
+int bw2_eventLoopDestroy(struct bw2_eventLoop* loop) {
+    close(loop->wakefd);
+    close(loop->epollfd);
+    free(loop->slots);
+    bw2_mutexDestroy(&loop->lock);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BW2_EVENTLOOP_H
+#define BW2_EVENTLOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "osutil.h"
+
+#if (BW2_OS == LINUX)
+
+/* Maximum number of frames handled for one client before moving on to the
+ * next one, so that a single busy client cannot starve the others.
+ */
+#define BW2_EVENTLOOP_FRAME_BUDGET 64
+#define BW2_EVENTLOOP_MAX_EVENTS 64
+
+struct bw2_client;
+
+struct bw2_eventLoopSlot {
+    struct bw2_client* client;
+    uint32_t generation;
+    bool more;
+};
+
+/* An event loop multiplexes many clients onto a single thread with epoll,
+ * instead of each client having its own BOSSWAVE thread. To spread clients
+ * over a small, fixed set of threads, create one event loop per thread.
+ */
+struct bw2_eventLoop {
+    int epollfd;
+    int wakefd;
+
+    /* Held while frames are being handled, so that clients are not removed
+     * from underneath the event loop.
+     */
+    struct bw2_mutex lock;
+    struct bw2_eventLoopSlot* slots;
+    uint32_t numslots;
+    bool stopping;
+};
+
+int bw2_eventLoopInit(struct bw2_eventLoop* loop);
+int bw2_eventLoopAdd(struct bw2_eventLoop* loop, struct bw2_client* client);
+int bw2_eventLoopRemove(struct bw2_eventLoop* loop, struct bw2_client* client);
+
+/* Handles frames for all clients in the event loop on the calling thread,
+ * until bw2_eventLoopStop is called.
+ */
+int bw2_eventLoopRun(struct bw2_eventLoop* loop);
+
+/* Same as bw2_eventLoopRun, but on a new thread. */
+int bw2_eventLoopStart(struct bw2_eventLoop* loop, char* threadstack, size_t stacksize);
+int bw2_eventLoopStartWithAttrs(struct bw2_eventLoop* loop, struct bw2_threadAttrs* attrs);
+int bw2_eventLoopStop(struct bw2_eventLoop* loop);
+int bw2_eventLoopDestroy(struct bw2_eventLoop* loop);
+
+#endif
+
+#endif
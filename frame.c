@@ -56,22 +56,174 @@ void bw2_frameInit(struct bw2_frame* frame, const char* cmd, int32_t seqno) {
     frame->lastpo = NULL;
     frame->ros = NULL;
     frame->lastro = NULL;
+    frame->onheap = false;
+    frame->pool = NULL;
+    frame->ref = NULL;
 }
 
-int _bw2_frame_read_KV(struct bw2_header** header, char* frameheap, size_t heapsize, size_t* heapused, int fd);
-int _bw2_frame_read_PO(struct bw2_payloadobj** pobj, char* frameheap, size_t heapsize, size_t* heapused, int fd);
-int _bw2_frame_read_RO(struct bw2_routingobj** robj, char* frameheap, size_t heapsize, size_t* heapused, int fd);
-int _bw2_frame_consume_newline(int fd);
+/* How much of each arena the frame being read has used so far. */
+struct bw2_frameUsage {
+    size_t heapused;
+    size_t spillused;
+    size_t needed;
+    uint32_t spilled;
+    uint32_t skipped;
+    struct bw2_memBudget* budget;
+    size_t charged;
+};
+
+int _bw2_frame_read_KV(struct bw2_header** header, struct bw2_frameAlloc* alloc, struct bw2_frameUsage* usage, struct bw2_instream* in);
+int _bw2_frame_read_PO(struct bw2_payloadobj** pobj, struct bw2_frameAlloc* alloc, struct bw2_frameUsage* usage, struct bw2_instream* in);
+int _bw2_frame_read_RO(struct bw2_routingobj** robj, struct bw2_frameAlloc* alloc, struct bw2_frameUsage* usage, struct bw2_instream* in);
+int _bw2_frame_consume_newline(struct bw2_instream* in);
+int _bw2_readFrameFromStream(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, struct bw2_instream* in);
+void _bw2_frameFreeObjects(struct bw2_frame* frame, struct bw2_framePool* pool, bool remote);
+
+void _bw2_frameAllocInit(struct bw2_frameAlloc* alloc, char* frameheap, size_t heapsize) {
+    memset(alloc, 0x00, sizeof(struct bw2_frameAlloc));
+    alloc->frameheap = frameheap;
+    alloc->heapsize = heapsize;
+}
 
 int bw2_readFrame(struct bw2_frame* frame, char* frameheap, size_t heapsize, int fd) {
+    struct bw2_frameAlloc alloc;
+    _bw2_frameAllocInit(&alloc, frameheap, heapsize);
+    return bw2_readFrameAlloc(frame, &alloc, fd);
+}
+
+int bw2_parseFrame(struct bw2_frame* frame, char* frameheap, size_t heapsize, char* buf, size_t buflen) {
+    struct bw2_frameAlloc alloc;
+    _bw2_frameAllocInit(&alloc, frameheap, heapsize);
+    return bw2_parseFrameAlloc(frame, &alloc, buf, buflen);
+}
+
+int bw2_readFrameFromStream(struct bw2_frame* frame, char* frameheap, size_t heapsize, struct bw2_instream* in) {
+    struct bw2_frameAlloc alloc;
+    _bw2_frameAllocInit(&alloc, frameheap, heapsize);
+    return _bw2_readFrameFromStream(frame, &alloc, in);
+}
+
+int bw2_readFrameAlloc(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, int fd) {
+    struct bw2_instream in;
+    bw2_instreamInitFd(&in, fd);
+    return _bw2_readFrameFromStream(frame, alloc, &in);
+}
+
+int bw2_parseFrameAlloc(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, char* buf, size_t buflen) {
+    struct bw2_instream in;
+    bw2_instreamInitBuf(&in, buf, buflen);
+    return _bw2_readFrameFromStream(frame, alloc, &in);
+}
+
+void _bw2_frameStatsCount(uint64_t* stat, uint64_t delta) {
+    __atomic_store_n(stat, *stat + delta, __ATOMIC_RELAXED);
+}
+
+void _bw2_frameStatsMax(uint64_t* stat, uint64_t value) {
+    if (value > *stat) {
+        __atomic_store_n(stat, value, __ATOMIC_RELAXED);
+    }
+}
+
+size_t _bw2_frameStatsBucket(size_t size) {
+    size_t bucket;
+    size_t bucketsize = BW2_FRAMESTATS_MIN_BUCKET_SIZE;
+    for (bucket = 0; bucket != BW2_FRAMESTATS_NUM_BUCKETS - 1; bucket++) {
+        if (size <= bucketsize) {
+            break;
+        }
+        bucketsize <<= 1;
+    }
+    return bucket;
+}
+
+/* Records a frame that has been read in STATS. */
+void _bw2_frameStatsRecord(struct bw2_frameStats* stats, struct bw2_frame* frame, struct bw2_frameUsage* usage) {
+    _bw2_frameStatsCount(&stats->frames, 1);
+    if (frame->dropped != 0) {
+        _bw2_frameStatsCount(&stats->truncatedFrames, 1);
+        _bw2_frameStatsCount(&stats->droppedObjects, frame->dropped);
+    }
+    _bw2_frameStatsCount(&stats->spilledObjects, usage->spilled);
+    _bw2_frameStatsCount(&stats->skippedObjects, usage->skipped);
+    _bw2_frameStatsMax(&stats->heapHighWater, usage->heapused);
+    _bw2_frameStatsMax(&stats->spillHighWater, usage->spillused);
+    _bw2_frameStatsMax(&stats->frameHighWater, usage->needed);
+    _bw2_frameStatsCount(&stats->frameSizes[_bw2_frameStatsBucket(usage->needed)], 1);
+}
+
+void bw2_frameStatsGet(struct bw2_frameStats* from, struct bw2_frameStats* to) {
+    size_t i;
+    to->frames = __atomic_load_n(&from->frames, __ATOMIC_RELAXED);
+    to->truncatedFrames = __atomic_load_n(&from->truncatedFrames, __ATOMIC_RELAXED);
+    to->droppedObjects = __atomic_load_n(&from->droppedObjects, __ATOMIC_RELAXED);
+    to->spilledObjects = __atomic_load_n(&from->spilledObjects, __ATOMIC_RELAXED);
+    to->skippedObjects = __atomic_load_n(&from->skippedObjects, __ATOMIC_RELAXED);
+    to->heapHighWater = __atomic_load_n(&from->heapHighWater, __ATOMIC_RELAXED);
+    to->spillHighWater = __atomic_load_n(&from->spillHighWater, __ATOMIC_RELAXED);
+    to->frameHighWater = __atomic_load_n(&from->frameHighWater, __ATOMIC_RELAXED);
+    for (i = 0; i != BW2_FRAMESTATS_NUM_BUCKETS; i++) {
+        to->frameSizes[i] = __atomic_load_n(&from->frameSizes[i], __ATOMIC_RELAXED);
+        to->objectSizes[i] = __atomic_load_n(&from->objectSizes[i], __ATOMIC_RELAXED);
+    }
+}
+
+void bw2_memBudgetInit(struct bw2_memBudget* budget, size_t limit, struct bw2_memBudget* parent) {
+    memset(budget, 0x00, sizeof(struct bw2_memBudget));
+    budget->limit = limit;
+    budget->parent = parent;
+}
+
+bool bw2_memBudgetCharge(struct bw2_memBudget* budget, size_t size) {
+    struct bw2_memBudget* curr;
+    struct bw2_memBudget* undo;
+
+    for (curr = budget; curr != NULL; curr = curr->parent) {
+        size_t used = __atomic_add_fetch(&curr->used, size, __ATOMIC_RELAXED);
+        if (used < size || (curr->limit != 0 && used > curr->limit)) {
+            /* Take the charge back from this budget and the ones before it. */
+            for (undo = budget; undo != curr->parent; undo = undo->parent) {
+                __atomic_sub_fetch(&undo->used, size, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch(&curr->rejectedObjects, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&curr->rejectedBytes, size, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        size_t highwater = __atomic_load_n(&curr->highWater, __ATOMIC_RELAXED);
+        while (used > highwater && !__atomic_compare_exchange_n(&curr->highWater, &highwater, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+    return true;
+}
+
+void bw2_memBudgetCredit(struct bw2_memBudget* budget, size_t size) {
+    struct bw2_memBudget* curr;
+    for (curr = budget; curr != NULL; curr = curr->parent) {
+        __atomic_sub_fetch(&curr->used, size, __ATOMIC_RELAXED);
+    }
+}
+
+void bw2_memBudgetGetStats(struct bw2_memBudget* budget, struct bw2_memBudgetStats* stats) {
+    stats->limit = budget->limit;
+    stats->used = __atomic_load_n(&budget->used, __ATOMIC_RELAXED);
+    stats->highWater = __atomic_load_n(&budget->highWater, __ATOMIC_RELAXED);
+    stats->rejectedObjects = __atomic_load_n(&budget->rejectedObjects, __ATOMIC_RELAXED);
+    stats->rejectedBytes = __atomic_load_n(&budget->rejectedBytes, __ATOMIC_RELAXED);
+}
+
+int _bw2_readFrameFromStream(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, struct bw2_instream* in) {
     char header[BW2_FRAME_HEADER_LENGTH];
-    int consumed = 0;
 
-    size_t heapused = 0;
+    struct bw2_frameUsage usage;
+    memset(&usage, 0x00, sizeof(usage));
 
     memset(frame, 0x00, sizeof(struct bw2_frame));
+    frame->onheap = (alloc->frameheap != NULL);
+    frame->pool = alloc->pool;
+    frame->poalign = BW2_MAX(alloc->poalign, BW2_FRAME_OBJECT_ALIGNMENT);
 
-    int rv = bw2_read_until_full(header, BW2_FRAME_HEADER_LENGTH, fd, NULL);
+    int rv = bw2_read_until_full(header, BW2_FRAME_HEADER_LENGTH, in, NULL);
     if (rv == BW2_UNTIL_EOF_REACHED) {
         return BW2_ERROR_MALFORMED_FRAME;
     } else if (rv == BW2_UNTIL_ERROR) {
@@ -95,73 +247,180 @@ int bw2_readFrame(struct bw2_frame* frame, char* frameheap, size_t heapsize, int
      */
     frame->seqno = (int32_t) strtoull(&header[16], NULL, 10);
 
+    /* Which objects are kept, and without a frame heap, what they are
+     * charged to, may depend on the request the frame is for.
+     */
+    if (alloc->onheader != NULL) {
+        alloc->onheader(frame, alloc, alloc->onheaderctx);
+    }
+    if (alloc->frameheap == NULL) {
+        usage.budget = alloc->budget;
+        frame->budget = usage.budget;
+    }
+
     /* Now, we nead to read each header, PO, and RO. */
     char objtype[4];
+    int res;
     while (true) {
-        int res = bw2_read_until_full(objtype, 3, fd, NULL);
+        res = bw2_read_until_full(objtype, 3, in, NULL);
         if (res != BW2_UNTIL_ARRAY_FULL) {
-            return BW2_ERROR_MALFORMED_FRAME;
+            res = BW2_ERROR_MALFORMED_FRAME;
+            goto fail;
         }
 
         objtype[3] = '\0';
 
         if (strcmp(objtype, "kv ") == 0) {
             struct bw2_header* hdr = NULL;
-            res = _bw2_frame_read_KV(&hdr, frameheap, heapsize, &heapused, fd);
+            res = _bw2_frame_read_KV(&hdr, alloc, &usage, in);
+            if (hdr != NULL) {
+                hdr->next = NULL;
+                if (frame->lasthdr == NULL) {
+                    frame->hdrs = hdr;
+                } else {
+                    frame->lasthdr->next = hdr;
+                }
+                frame->lasthdr = hdr;
+            }
             if (res == BW2_ERROR_FRAME_HEAP_FULL) {
-                continue;
+                frame->dropped++;
             } else if (res != 0) {
-                return res;
+                goto fail;
             }
-            hdr->next = NULL;
-            if (frame->lasthdr == NULL) {
-                frame->hdrs = hdr;
-            } else {
-                frame->lasthdr->next = hdr;
-            }
-            frame->lasthdr = hdr;
         } else if (strcmp(objtype, "ro ") == 0) {
             struct bw2_routingobj* ro = NULL;
-            res = _bw2_frame_read_RO(&ro, frameheap, heapsize, &heapused, fd);
+            res = _bw2_frame_read_RO(&ro, alloc, &usage, in);
+            if (ro != NULL) {
+                ro->next = NULL;
+                if (frame->lastro == NULL) {
+                    frame->ros = ro;
+                } else {
+                    frame->lastro->next = ro;
+                }
+                frame->lastro = ro;
+            }
             if (res == BW2_ERROR_FRAME_HEAP_FULL) {
-                continue;
+                frame->dropped++;
             } else if (res != 0) {
-                return res;
+                goto fail;
             }
-            ro->next = NULL;
-            if (frame->lastro == NULL) {
-                frame->ros = ro;
-            } else {
-                frame->lastro->next = ro;
-            }
-            frame->lastro = ro;
         } else if (strcmp(objtype, "po ") == 0) {
             struct bw2_payloadobj* po = NULL;
-            res = _bw2_frame_read_PO(&po, frameheap, heapsize, &heapused, fd);
+            res = _bw2_frame_read_PO(&po, alloc, &usage, in);
+            if (po != NULL) {
+                po->next = NULL;
+                if (frame->lastpo == NULL) {
+                    frame->pos = po;
+                } else {
+                    frame->lastpo->next = po;
+                }
+                frame->lastpo = po;
+            }
             if (res == BW2_ERROR_FRAME_HEAP_FULL) {
-                continue;
+                frame->dropped++;
             } else if (res != 0) {
-                return res;
+                goto fail;
             }
-            po->next = NULL;
-            if (frame->lastpo == NULL) {
-                frame->pos = po;
-            } else {
-                frame->lastpo->next = po;
-            }
-            frame->lastpo = po;
         } else if (strcmp(objtype, "end") == 0) {
-            res = _bw2_frame_consume_newline(fd);
+            res = _bw2_frame_consume_newline(in);
             if (res != 0) {
-                return BW2_ERROR_MALFORMED_FRAME;
+                res = BW2_ERROR_MALFORMED_FRAME;
+                goto fail;
             }
-            break;
+            frame->charged = usage.charged;
+            frame->skipped = usage.skipped;
+            if (alloc->stats != NULL) {
+                _bw2_frameStatsRecord(alloc->stats, frame, &usage);
+            }
+            return 0;
         } else {
+            res = BW2_ERROR_MALFORMED_FRAME;
+            goto fail;
+        }
+    }
+
+fail:
+    /* A frame that could not be read is not freed by the caller, so the
+     * objects read so far go back to the pool here, and the budget gets back
+     * what they were charged.
+     */
+    if (!frame->onheap) {
+        frame->charged = usage.charged;
+        _bw2_frameFreeObjects(frame, frame->pool, false);
+    }
+    return res;
+}
+
+int bw2_scanFrame(const char* buf, size_t buflen, struct bw2_framescan* scan, size_t* framelen) {
+    *framelen = 0;
+
+    if (scan->scanned == 0) {
+        if (buflen < BW2_FRAME_HEADER_LENGTH) {
+            return 0;
+        }
+        if (buf[4] != ' ' || buf[15] != ' ' || buf[26] != '\n') {
             return BW2_ERROR_MALFORMED_FRAME;
         }
+        scan->scanned = BW2_FRAME_HEADER_LENGTH;
     }
 
-    return 0;
+    /* Each iteration skips over one header, PO, or RO. */
+    while (true) {
+        size_t pos = scan->scanned;
+        if (buflen - pos < 3) {
+            return 0;
+        }
+
+        if (memcmp(&buf[pos], "end", 3) == 0) {
+            if (buflen - pos < 4) {
+                return 0;
+            }
+            if (buf[pos + 3] != '\n') {
+                return BW2_ERROR_MALFORMED_FRAME;
+            }
+            *framelen = pos + 4;
+            return 0;
+        } else if (memcmp(&buf[pos], "kv ", 3) != 0
+                    && memcmp(&buf[pos], "po ", 3) != 0
+                    && memcmp(&buf[pos], "ro ", 3) != 0) {
+            return BW2_ERROR_MALFORMED_FRAME;
+        }
+
+        /* The object header ends with the length of the object's body. */
+        const char* line = &buf[pos + 3];
+        const char* newline = memchr(line, '\n', buflen - pos - 3);
+        if (newline == NULL) {
+            return 0;
+        }
+        const char* lenstart = newline;
+        while (lenstart != line && lenstart[-1] != ' ') {
+            lenstart--;
+        }
+        if (lenstart == line || lenstart == newline || newline - lenstart > BW2_FRAME_MAX_LENGTH_DIGITS) {
+            return BW2_ERROR_MALFORMED_FRAME;
+        }
+        size_t bodylen = 0;
+        const char* digit;
+        for (digit = lenstart; digit != newline; digit++) {
+            if (*digit < '0' || *digit > '9' || bodylen > (SIZE_MAX - 9) / 10) {
+                return BW2_ERROR_MALFORMED_FRAME;
+            }
+            bodylen = (bodylen * 10) + (size_t) (*digit - '0');
+        }
+
+        /* Skip the body and the newline after it. */
+        size_t bodystart = (size_t) (newline - buf) + 1;
+        if (bodylen > SIZE_MAX - bodystart - 1) {
+            return BW2_ERROR_MALFORMED_FRAME;
+        }
+        if (buflen - bodystart < bodylen + 1) {
+            return 0;
+        }
+        if (buf[bodystart + bodylen] != '\n') {
+            return BW2_ERROR_MALFORMED_FRAME;
+        }
+        scan->scanned = bodystart + bodylen + 1;
+    }
 }
 
 struct bw2_header* bw2_getFirstHeader(struct bw2_frame* frame, const char* key) {
@@ -190,24 +449,260 @@ int bw2_frameMustResponse(struct bw2_frame* frame) {
 }
 
 void bw2_frameFreeResources(struct bw2_frame* frame) {
+    bw2_frameFreeToPool(frame, NULL);
+}
+
+void _bw2_framePoolCount(uint64_t* stat, int64_t delta) {
+    __atomic_fetch_add(stat, (uint64_t) delta, __ATOMIC_RELAXED);
+}
+
+/* Returns the size class of a block of SIZE bytes, or
+ * BW2_FRAMEPOOL_NUM_CLASSES if it is too large for any class.
+ */
+size_t _bw2_framePoolClass(size_t size) {
+    size_t class;
+    size_t classsize = BW2_FRAMEPOOL_MIN_CLASS_SIZE;
+    for (class = 0; class != BW2_FRAMEPOOL_NUM_CLASSES; class++) {
+        if (size <= classsize) {
+            break;
+        }
+        classsize <<= 2;
+    }
+    return class;
+}
+
+size_t _bw2_framePoolMaxCached(struct bw2_framePool* pool) {
+    return pool->maxCached == 0 ? BW2_FRAMEPOOL_DEFAULT_MAX_CACHED : pool->maxCached;
+}
+
+void _bw2_framePoolFree(struct bw2_framePool* pool, void* block, size_t size);
+
+/* Puts the blocks freed by other threads back on POOL's free lists, and lets
+ * other threads return blocks to a released pool again.
+ */
+void _bw2_framePoolDrainRemote(struct bw2_framePool* pool) {
+    void* block = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+    if (block == BW2_FRAMEPOOL_RELEASED) {
+        return;
+    }
+    while (block != NULL) {
+        void* next = ((void**) block)[0];
+        size_t class = ((size_t*) block)[1];
+        _bw2_framePoolFree(pool, block, BW2_FRAMEPOOL_MIN_CLASS_SIZE << (class << 1));
+        block = next;
+    }
+}
+
+/* Returns the allocator used for POOL's blocks. */
+struct bw2_allocator* _bw2_framePoolAllocator(struct bw2_framePool* pool) {
+    return (pool == NULL) ? NULL : pool->allocator;
+}
+
+void* _bw2_framePoolAlloc(struct bw2_framePool* pool, size_t size) {
+    if (pool == NULL) {
+        return malloc(size);
+    }
+
+    _bw2_framePoolCount(&pool->stats.allocs, 1);
+
+    size_t class = _bw2_framePoolClass(size);
+    if (class == BW2_FRAMEPOOL_NUM_CLASSES) {
+        _bw2_framePoolCount(&pool->stats.mallocs, 1);
+        return bw2_allocatorAlloc(pool->allocator, BW2_ALLOC_FRAME_OBJECT, size);
+    }
+
+    if (pool->freelist[class] == NULL && __atomic_load_n(&pool->remote, __ATOMIC_RELAXED) != NULL) {
+        _bw2_framePoolDrainRemote(pool);
+    }
+
+    void* block = pool->freelist[class];
+    if (block != NULL) {
+        pool->freelist[class] = *((void**) block);
+        pool->count[class]--;
+        _bw2_framePoolCount(&pool->stats.hits, 1);
+        _bw2_framePoolCount(&pool->stats.cached, -1);
+        return block;
+    }
+
+    _bw2_framePoolCount(&pool->stats.mallocs, 1);
+    return bw2_allocatorAlloc(pool->allocator, BW2_ALLOC_FRAME_OBJECT, BW2_FRAMEPOOL_MIN_CLASS_SIZE << (class << 1));
+}
+
+/* Returns a block of SIZE bytes, taken from POOL, to the pool. */
+void _bw2_framePoolFree(struct bw2_framePool* pool, void* block, size_t size) {
+    if (pool == NULL) {
+        free(block);
+        return;
+    }
+
+    size_t class = _bw2_framePoolClass(size);
+    if (class == BW2_FRAMEPOOL_NUM_CLASSES || pool->count[class] >= _bw2_framePoolMaxCached(pool)) {
+        _bw2_framePoolCount(&pool->stats.releases, 1);
+        bw2_allocatorFree(pool->allocator, BW2_ALLOC_FRAME_OBJECT, block);
+        return;
+    }
+
+    *((void**) block) = pool->freelist[class];
+    pool->freelist[class] = block;
+    pool->count[class]++;
+    _bw2_framePoolCount(&pool->stats.cached, 1);
+}
+
+/* Returns a block of SIZE bytes, taken from POOL, to the pool from a thread
+ * that may not be the one using it.
+ */
+void _bw2_framePoolFreeRemote(struct bw2_framePool* pool, void* block, size_t size) {
+    size_t class = _bw2_framePoolClass(size);
+    if (pool == NULL || class == BW2_FRAMEPOOL_NUM_CLASSES) {
+        bw2_allocatorFree(_bw2_framePoolAllocator(pool), BW2_ALLOC_FRAME_OBJECT, block);
+        return;
+    }
+
+    /* Once the pool has been released, nothing will drain the list. */
+    ((size_t*) block)[1] = class;
+    void* head = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+    do {
+        if (head == BW2_FRAMEPOOL_RELEASED) {
+            _bw2_framePoolCount(&pool->stats.releases, 1);
+            bw2_allocatorFree(pool->allocator, BW2_ALLOC_FRAME_OBJECT, block);
+            return;
+        }
+        ((void**) block)[0] = head;
+    } while (!__atomic_compare_exchange_n(&pool->remote, &head, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+size_t _bw2_frame_PO_blocksize(size_t vallen, size_t poalign);
+
+void _bw2_frameFreeObjects(struct bw2_frame* frame, struct bw2_framePool* pool, bool remote) {
     struct bw2_header* hcurr, * hnext;
     struct bw2_payloadobj* pcurr, * pnext;
     struct bw2_routingobj* rcurr, * rnext;
+    void (*freeblock)(struct bw2_framePool*, void*, size_t) = remote ? _bw2_framePoolFreeRemote : _bw2_framePoolFree;
 
+    /* Each object was allocated together with its key and value, so its
+     * size class can be worked out from them.
+     */
     for (hcurr = frame->hdrs; hcurr != NULL; hcurr = hnext) {
         hnext = hcurr->next;
-        free(hcurr);
+        freeblock(pool, hcurr, sizeof(struct bw2_header) + strlen(hcurr->key) + 1 + hcurr->len);
     }
 
     for (pcurr = frame->pos; pcurr != NULL; pcurr = pnext) {
         pnext = pcurr->next;
-        free(pcurr);
+        freeblock(pool, pcurr, _bw2_frame_PO_blocksize(pcurr->polen, frame->poalign));
     }
 
     for (rcurr = frame->ros; rcurr != NULL; rcurr = rnext) {
         rnext = rcurr->next;
-        free(rcurr);
+        freeblock(pool, rcurr, sizeof(struct bw2_routingobj) + rcurr->rolen);
     }
+
+    if (frame->budget != NULL) {
+        bw2_memBudgetCredit(frame->budget, frame->charged);
+    }
+}
+
+void bw2_frameFreeToPool(struct bw2_frame* frame, struct bw2_framePool* pool) {
+    /* If the frame's resources have been retained, the last reference to
+     * them frees them instead.
+     */
+    if (frame->ref != NULL) {
+        bw2_frameRefRelease(frame->ref);
+        frame->ref = NULL;
+        return;
+    }
+    _bw2_frameFreeObjects(frame, pool, false);
+}
+
+struct bw2_frameRef* bw2_frameRetain(struct bw2_frame* frame) {
+    if (frame->onheap) {
+        return NULL;
+    }
+
+    if (frame->ref == NULL) {
+        struct bw2_frameRef* ref = bw2_allocatorAlloc(_bw2_framePoolAllocator(frame->pool), BW2_ALLOC_FRAME_REF, sizeof(struct bw2_frameRef));
+        if (ref == NULL) {
+            return NULL;
+        }
+
+        /* The frame itself holds the first reference. */
+        memcpy(&ref->frame, frame, sizeof(struct bw2_frame));
+        ref->refs = 1;
+        frame->ref = ref;
+    }
+
+    bw2_frameRefRetain(frame->ref);
+    return frame->ref;
+}
+
+void bw2_frameRefRetain(struct bw2_frameRef* ref) {
+    __atomic_fetch_add(&ref->refs, 1, __ATOMIC_RELAXED);
+}
+
+void bw2_frameRefRelease(struct bw2_frameRef* ref) {
+    if (__atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct bw2_allocator* allocator = _bw2_framePoolAllocator(ref->frame.pool);
+        _bw2_frameFreeObjects(&ref->frame, ref->frame.pool, true);
+        bw2_allocatorFree(allocator, BW2_ALLOC_FRAME_REF, ref);
+    }
+}
+
+/* Frees the blocks of size class CLASS that POOL keeps beyond KEEP. */
+void _bw2_framePoolTrim(struct bw2_framePool* pool, size_t class, size_t keep) {
+    while (pool->count[class] > keep) {
+        void* block = pool->freelist[class];
+        pool->freelist[class] = *((void**) block);
+        pool->count[class]--;
+        _bw2_framePoolCount(&pool->stats.releases, 1);
+        _bw2_framePoolCount(&pool->stats.cached, -1);
+        bw2_allocatorFree(pool->allocator, BW2_ALLOC_FRAME_OBJECT, block);
+    }
+}
+
+int bw2_framePoolConfigure(struct bw2_framePool* pool, struct bw2_framePoolParams* params) {
+    size_t class;
+
+    pool->maxCached = params->maxCached;
+    size_t maxcached = _bw2_framePoolMaxCached(pool);
+    size_t prefill = BW2_MIN(params->prefill, maxcached);
+
+    for (class = 0; class != BW2_FRAMEPOOL_NUM_CLASSES; class++) {
+        _bw2_framePoolTrim(pool, class, maxcached);
+        while (pool->count[class] < prefill) {
+            void* block = bw2_allocatorAlloc(pool->allocator, BW2_ALLOC_FRAME_OBJECT, BW2_FRAMEPOOL_MIN_CLASS_SIZE << (class << 1));
+            if (block == NULL) {
+                return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+            }
+            _bw2_framePoolCount(&pool->stats.mallocs, 1);
+            _bw2_framePoolFree(pool, block, BW2_FRAMEPOOL_MIN_CLASS_SIZE << (class << 1));
+        }
+    }
+
+    return 0;
+}
+
+void bw2_framePoolRelease(struct bw2_framePool* pool) {
+    size_t class;
+
+    /* Blocks freed by other threads from now on are not kept. */
+    void* block = __atomic_exchange_n(&pool->remote, BW2_FRAMEPOOL_RELEASED, __ATOMIC_ACQ_REL);
+    while (block != NULL && block != BW2_FRAMEPOOL_RELEASED) {
+        void* next = ((void**) block)[0];
+        _bw2_framePoolCount(&pool->stats.releases, 1);
+        bw2_allocatorFree(pool->allocator, BW2_ALLOC_FRAME_OBJECT, block);
+        block = next;
+    }
+    for (class = 0; class != BW2_FRAMEPOOL_NUM_CLASSES; class++) {
+        _bw2_framePoolTrim(pool, class, 0);
+    }
+}
+
+void bw2_framePoolGetStats(struct bw2_framePool* pool, struct bw2_framePoolStats* stats) {
+    stats->allocs = __atomic_load_n(&pool->stats.allocs, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&pool->stats.hits, __ATOMIC_RELAXED);
+    stats->mallocs = __atomic_load_n(&pool->stats.mallocs, __ATOMIC_RELAXED);
+    stats->releases = __atomic_load_n(&pool->stats.releases, __ATOMIC_RELAXED);
+    stats->cached = __atomic_load_n(&pool->stats.cached, __ATOMIC_RELAXED);
 }
 
 void bw2_appendKV(struct bw2_frame* frame, struct bw2_header* kv) {
@@ -383,13 +878,13 @@ int bw2_writeFrame(struct bw2_frame* frame, int fd) {
 
 /* Helper functions for parsing a frame from the wire OOB format. */
 
-int _bw2_frame_read_token(char* buf, size_t buflen, char delimiter, int fd) {
+int _bw2_frame_read_token(char* buf, size_t buflen, char delimiter, struct bw2_instream* in) {
     size_t bytesread;
 
     if (buflen == 0) {
         return BW2_ERROR_BAD_ARG;
     }
-    int rv = bw2_read_until_char(buf, buflen - 1, delimiter, fd, &bytesread);
+    int rv = bw2_read_until_char(buf, buflen - 1, delimiter, in, &bytesread);
     buf[bytesread] = '\0';
 
     if (rv == BW2_UNTIL_ERROR) {
@@ -397,7 +892,7 @@ int _bw2_frame_read_token(char* buf, size_t buflen, char delimiter, int fd) {
     } else if (rv == BW2_UNTIL_EOF_REACHED) {
         return BW2_ERROR_MALFORMED_FRAME;
     } else if (rv == BW2_UNTIL_ARRAY_FULL) {
-        rv = bw2_drop_until_char(delimiter, fd, NULL);
+        rv = bw2_drop_until_char(delimiter, in, NULL);
         if (rv == BW2_UNTIL_EOF_REACHED) {
             return BW2_ERROR_MALFORMED_FRAME;
         } else if (rv == BW2_UNTIL_ERROR) {
@@ -408,24 +903,82 @@ int _bw2_frame_read_token(char* buf, size_t buflen, char delimiter, int fd) {
     return 0;
 }
 
-void* _bw2_frame_heap_alloc(char* frameheap, size_t heapsize, size_t* heapused, size_t size) {
-    if (frameheap == NULL) {
-        return malloc(size);
+/* Returns the number of bytes to skip from ADDR to reach a multiple of ALIGN,
+ * which must be a power of two.
+ */
+size_t _bw2_frame_align_pad(uintptr_t addr, size_t align) {
+    return (size_t) -addr & (align - 1);
+}
+
+/* Returns the size of a block holding a PO with a body of VALLEN bytes,
+ * outside of a frame heap. Blocks from malloc are only aligned for the struct,
+ * so room is left to align the body by hand.
+ */
+size_t _bw2_frame_PO_blocksize(size_t vallen, size_t poalign) {
+    size_t size = sizeof(struct bw2_payloadobj) + vallen;
+    if (poalign > BW2_FRAME_OBJECT_ALIGNMENT) {
+        size += poalign - 1;
     }
+    return size;
+}
 
-    size_t heapleft = heapsize - *heapused;
-    if (heapleft < size) {
+/* Allocates SIZE bytes in ARENA, of which USED bytes are taken, such that the
+ * byte at OFFSET into the block is aligned to ALIGN. Returns NULL if there is
+ * no room.
+ */
+void* _bw2_frame_arena_alloc(char* arena, size_t arenasize, size_t* used, size_t size, size_t align, size_t offset) {
+    size_t pad = _bw2_frame_align_pad((uintptr_t) &arena[*used + offset], align);
+    if (arenasize - *used < pad || arenasize - *used - pad < size) {
         return NULL;
-    } else {
-        void* block = &frameheap[*heapused];
-        (*heapused) += size;
+    }
+    void* block = &arena[*used + pad];
+    *used += pad + size;
+    return block;
+}
+
+/* Allocates SIZE bytes from the frame heap, or, if it is full, from the spill
+ * arena, such that the byte at OFFSET into the block is aligned to ALIGN.
+ * Returns NULL if neither has room. Without a frame heap, the block is only
+ * aligned for the struct at its start.
+ */
+void* _bw2_frame_heap_alloc(struct bw2_frameAlloc* alloc, struct bw2_frameUsage* usage, size_t size, size_t align, size_t offset) {
+    /* Count the bytes the frame would take up if it all fit in the heap. */
+    usage->needed += _bw2_frame_align_pad((uintptr_t) alloc->frameheap + usage->needed + offset, align) + size;
+    if (alloc->stats != NULL) {
+        _bw2_frameStatsCount(&alloc->stats->objectSizes[_bw2_frameStatsBucket(size)], 1);
+    }
+
+    if (alloc->frameheap == NULL) {
+        /* Check the budget before allocating anything, so that an object
+         * claiming to be huge is dropped rather than allocated.
+         */
+        if (usage->budget != NULL && !bw2_memBudgetCharge(usage->budget, size)) {
+            return NULL;
+        }
+        void* block = _bw2_framePoolAlloc(alloc->pool, size);
+        if (block == NULL) {
+            if (usage->budget != NULL) {
+                bw2_memBudgetCredit(usage->budget, size);
+            }
+        } else {
+            usage->charged += size;
+        }
         return block;
     }
+
+    void* block = _bw2_frame_arena_alloc(alloc->frameheap, alloc->heapsize, &usage->heapused, size, align, offset);
+    if (block == NULL && alloc->spill != NULL) {
+        block = _bw2_frame_arena_alloc(alloc->spill, alloc->spillsize, &usage->spillused, size, align, offset);
+        if (block != NULL) {
+            usage->spilled++;
+        }
+    }
+    return block;
 }
 
-int _bw2_frame_consume_newline(int fd) {
+int _bw2_frame_consume_newline(struct bw2_instream* in) {
     char c;
-    int rv = recv(fd, &c, 1, 0);
+    int rv = bw2_instreamRecv(in, &c, 1);
     if (rv == 0 || rv == -1 || c != '\n') {
         return 1;
     } else {
@@ -433,16 +986,69 @@ int _bw2_frame_consume_newline(int fd) {
     }
 }
 
-int _bw2_frame_read_KV(struct bw2_header** header, char* frameheap, size_t heapsize, size_t* heapused, int fd) {
+bool _bw2_retainKey(struct bw2_retainPolicy* policy, const char* key) {
+    size_t i;
+    if (policy == NULL || policy->keys == NULL || strcmp(key, "finished") == 0) {
+        return true;
+    }
+    for (i = 0; i != policy->numKeys; i++) {
+        if (strcmp(key, policy->keys[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool _bw2_retainPO(struct bw2_retainPolicy* policy, uint32_t ponum) {
+    size_t i;
+    if (policy == NULL || policy->pos == NULL) {
+        return true;
+    }
+    for (i = 0; i != policy->numPOs; i++) {
+        uint8_t maskbits = BW2_MIN(policy->pos[i].maskbits, 32);
+        uint32_t mask = (maskbits == 0) ? 0 : (UINT32_MAX << (32 - maskbits));
+        if (((ponum ^ policy->pos[i].ponum) & mask) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool _bw2_retainRO(struct bw2_retainPolicy* policy, uint8_t ronum) {
+    size_t i;
+    if (policy == NULL || policy->ros == NULL) {
+        return true;
+    }
+    for (i = 0; i != policy->numROs; i++) {
+        if (ronum == policy->ros[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Skips over the VALLEN-byte body of an object that is not kept. */
+int _bw2_frame_skip_object(size_t vallen, struct bw2_frameUsage* usage, struct bw2_instream* in) {
+    if (bw2_drop_full_array(vallen, in, NULL) != BW2_UNTIL_ARRAY_FULL) {
+        return BW2_ERROR_MALFORMED_FRAME;
+    }
+    if (_bw2_frame_consume_newline(in) != 0) {
+        return BW2_ERROR_MALFORMED_FRAME;
+    }
+    usage->skipped++;
+    return 0;
+}
+
+int _bw2_frame_read_KV(struct bw2_header** header, struct bw2_frameAlloc* alloc, struct bw2_frameUsage* usage, struct bw2_instream* in) {
     char key[BW2_FRAME_MAX_KEY_LENGTH + 1];
     char length[BW2_FRAME_MAX_LENGTH_DIGITS + 1];
     int rv;
 
-    rv = _bw2_frame_read_token(key, BW2_FRAME_MAX_KEY_LENGTH + 1, ' ', fd);
+    rv = _bw2_frame_read_token(key, BW2_FRAME_MAX_KEY_LENGTH + 1, ' ', in);
     if (rv != 0) {
         return rv;
     }
-    rv = _bw2_frame_read_token(length, BW2_FRAME_MAX_LENGTH_DIGITS + 1, '\n', fd);
+    rv = _bw2_frame_read_token(length, BW2_FRAME_MAX_LENGTH_DIGITS + 1, '\n', in);
     if (rv != 0) {
         return rv;
     }
@@ -450,48 +1056,55 @@ int _bw2_frame_read_KV(struct bw2_header** header, char* frameheap, size_t heaps
     size_t keylenwithnull = strlen(key) + 1;
 
     size_t vallen = (size_t) strtoull(length, NULL, 10);
+    if (!_bw2_retainKey(alloc->policy, key)) {
+        return _bw2_frame_skip_object(vallen, usage, in);
+    }
     size_t hdrlen = sizeof(struct bw2_header) + keylenwithnull + vallen;
 
     /* Try to allocate space in the frame's heap, if there was no overflow. */
     struct bw2_header* hdr = NULL;
     if (hdrlen >= vallen) {
-        hdr = _bw2_frame_heap_alloc(frameheap, heapsize, heapused, hdrlen);
+        hdr = _bw2_frame_heap_alloc(alloc, usage, hdrlen, BW2_FRAME_OBJECT_ALIGNMENT, 0);
     }
 
     if (hdr == NULL) {
         /* No space... :( */
-        rv = bw2_drop_full_array(vallen, fd, NULL);
+        rv = bw2_drop_full_array(vallen, in, NULL);
     } else {
         hdr->key = (char*) (hdr + 1);
         strncpy(hdr->key, key, keylenwithnull);
         hdr->len = vallen;
         hdr->value = hdr->key + keylenwithnull;
-        rv = bw2_read_until_full(hdr->value, vallen, fd, NULL);
+        *header = hdr;
+        rv = bw2_read_until_full(hdr->value, vallen, in, NULL);
     }
 
     if (rv != BW2_UNTIL_ARRAY_FULL) {
         return BW2_ERROR_MALFORMED_FRAME;
     }
 
-    rv = _bw2_frame_consume_newline(fd);
+    rv = _bw2_frame_consume_newline(in);
     if (rv != 0) {
         return BW2_ERROR_MALFORMED_FRAME;
     }
 
-    *header = hdr;
+    if (hdr == NULL) {
+        return BW2_ERROR_FRAME_HEAP_FULL;
+    }
+
     return 0;
 }
 
-int _bw2_frame_read_PO(struct bw2_payloadobj** pobj, char* frameheap, size_t heapsize, size_t* heapused, int fd) {
+int _bw2_frame_read_PO(struct bw2_payloadobj** pobj, struct bw2_frameAlloc* alloc, struct bw2_frameUsage* usage, struct bw2_instream* in) {
     char ponumstr[BW2_FRAME_MAX_PONUM_LENGTH + 1];
     char length[BW2_FRAME_MAX_LENGTH_DIGITS + 1];
     int rv;
 
-    rv = _bw2_frame_read_token(ponumstr, BW2_FRAME_MAX_PONUM_LENGTH + 1, ' ', fd);
+    rv = _bw2_frame_read_token(ponumstr, BW2_FRAME_MAX_PONUM_LENGTH + 1, ' ', in);
     if (rv != 0) {
         return rv;
     }
-    rv = _bw2_frame_read_token(length, BW2_FRAME_MAX_LENGTH_DIGITS + 1, '\n', fd);
+    rv = _bw2_frame_read_token(length, BW2_FRAME_MAX_LENGTH_DIGITS + 1, '\n', in);
     if (rv != 0) {
         return rv;
     }
@@ -513,81 +1126,104 @@ int _bw2_frame_read_PO(struct bw2_payloadobj** pobj, char* frameheap, size_t hea
     }
 
     size_t vallen = (size_t) strtoull(length, NULL, 10);
+    if (!_bw2_retainPO(alloc->policy, ponum)) {
+        return _bw2_frame_skip_object(vallen, usage, in);
+    }
+
+    size_t poalign = BW2_MAX(alloc->poalign, BW2_FRAME_OBJECT_ALIGNMENT);
     size_t polen = vallen + sizeof(struct bw2_payloadobj);
+    if (alloc->frameheap == NULL) {
+        polen = _bw2_frame_PO_blocksize(vallen, poalign);
+    }
 
-    /* Try to allocate space in the frame's heap, if there was no overflow. */
+    /* Try to allocate space in the frame's heap, if there was no overflow. The
+     * body of the PO comes right after the struct, at an aligned address.
+     */
     struct bw2_payloadobj* po = NULL;
     if (polen >= vallen) {
-        po = _bw2_frame_heap_alloc(frameheap, heapsize, heapused, polen);
+        po = _bw2_frame_heap_alloc(alloc, usage, polen, poalign, sizeof(struct bw2_payloadobj));
     }
 
     if (po == NULL) {
         /* No space... :( */
-        rv = bw2_drop_full_array(vallen, fd, NULL);
+        rv = bw2_drop_full_array(vallen, in, NULL);
     } else {
         po->ponum = ponum;
         po->polen = vallen;
         po->po = (char*) (po + 1);
-        rv = bw2_read_until_full(po->po, vallen, fd, NULL);
+        po->po += _bw2_frame_align_pad((uintptr_t) po->po, poalign);
+        *pobj = po;
+        rv = bw2_read_until_full(po->po, vallen, in, NULL);
     }
 
     if (rv != BW2_UNTIL_ARRAY_FULL) {
         return BW2_ERROR_MALFORMED_FRAME;
     }
 
-    rv = _bw2_frame_consume_newline(fd);
+    rv = _bw2_frame_consume_newline(in);
     if (rv != 0) {
         return BW2_ERROR_MALFORMED_FRAME;
     }
 
-    *pobj = po;
+    if (po == NULL) {
+        return BW2_ERROR_FRAME_HEAP_FULL;
+    }
+
     return 0;
 }
 
-int _bw2_frame_read_RO(struct bw2_routingobj** robj, char* frameheap, size_t heapsize, size_t* heapused, int fd) {
+int _bw2_frame_read_RO(struct bw2_routingobj** robj, struct bw2_frameAlloc* alloc, struct bw2_frameUsage* usage, struct bw2_instream* in) {
     char ronumstr[BW2_FRAME_MAX_RONUM_LENGTH + 1];
     char length[BW2_FRAME_MAX_LENGTH_DIGITS + 1];
     int rv;
 
-    rv = _bw2_frame_read_token(ronumstr, BW2_FRAME_MAX_RONUM_LENGTH + 1, ' ', fd);
+    rv = _bw2_frame_read_token(ronumstr, BW2_FRAME_MAX_RONUM_LENGTH + 1, ' ', in);
     if (rv != 0) {
         return rv;
     }
-    rv = _bw2_frame_read_token(length, BW2_FRAME_MAX_LENGTH_DIGITS + 1, '\n', fd);
+    rv = _bw2_frame_read_token(length, BW2_FRAME_MAX_LENGTH_DIGITS + 1, '\n', in);
     if (rv != 0) {
         return rv;
     }
 
     uint8_t ronum = (uint8_t) strtoull(ronumstr, NULL, 10);
     size_t vallen = (size_t) strtoull(length, NULL, 10);
+    if (!_bw2_retainRO(alloc->policy, ronum)) {
+        return _bw2_frame_skip_object(vallen, usage, in);
+    }
+
     size_t rolen = vallen + sizeof(struct bw2_routingobj);
 
     /* Try to allocate space in the frame's heap, if there was no overflow. */
     struct bw2_routingobj* ro = NULL;
     if (rolen >= vallen) {
-        ro = _bw2_frame_heap_alloc(frameheap, heapsize, heapused, rolen);
+        ro = _bw2_frame_heap_alloc(alloc, usage, rolen, BW2_FRAME_OBJECT_ALIGNMENT, 0);
     }
 
     if (ro == NULL) {
         /* No space... :( */
-        rv = bw2_drop_full_array(vallen, fd, NULL);
+        rv = bw2_drop_full_array(vallen, in, NULL);
     } else {
         ro->ronum = ronum;
         ro->rolen = vallen;
         ro->ro = (char*) (ro + 1);
-        rv = bw2_read_until_full(ro->ro, vallen, fd, NULL);
+        *robj = ro;
+        rv = bw2_read_until_full(ro->ro, vallen, in, NULL);
     }
 
     if (rv != BW2_UNTIL_ARRAY_FULL) {
         return BW2_ERROR_MALFORMED_FRAME;
     }
 
-    rv = _bw2_frame_consume_newline(fd);
+    rv = _bw2_frame_consume_newline(in);
     if (rv != 0) {
         return BW2_ERROR_MALFORMED_FRAME;
     }
 
-    *robj = ro;
+    if (ro == NULL) {
+        return BW2_ERROR_FRAME_HEAP_FULL;
+    }
+
     return 0;
 }
 
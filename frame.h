@@ -30,6 +30,7 @@
 #ifndef BW2_FRAME_H
 #define BW2_FRAME_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -86,6 +87,11 @@
 #define BW2_FRAME_CMD_RESPONSE "resp"
 #define BW2_FRAME_CMD_RESULT "rslt"
 
+struct bw2_allocator;
+struct bw2_framePool;
+struct bw2_frameRef;
+struct bw2_memBudget;
+
 struct bw2_frame {
     char cmd[4];
     int32_t seqno;
@@ -99,6 +105,23 @@ struct bw2_frame {
 
     struct bw2_routingobj* ros;
     struct bw2_routingobj* lastro;
+
+    /* For a frame that was read, where its resources were allocated, and,
+     * once any of them have been retained (see bw2_frameRetain), the count of
+     * references to them. DROPPED is the number of headers, POs, and ROs that
+     * were left out of the frame because they did not fit, SKIPPED is the
+     * number left out by a retention policy, and POALIGN is the boundary to
+     * which the bodies of its POs were aligned. CHARGED bytes are charged to
+     * BUDGET until the frame's resources are freed.
+     */
+    uint32_t dropped;
+    uint32_t skipped;
+    size_t poalign;
+    bool onheap;
+    struct bw2_framePool* pool;
+    struct bw2_frameRef* ref;
+    struct bw2_memBudget* budget;
+    size_t charged;
 };
 
 struct bw2_header {
@@ -122,9 +145,212 @@ struct bw2_payloadobj {
     char* po;
 };
 
+/* Used by bw2_scanFrame to remember how far into a partially received frame it
+ * has already looked. Zero it before scanning a new frame.
+ */
+struct bw2_framescan {
+    size_t scanned;
+};
+
+/* Without a frame heap, the headers, POs, and ROs of frames that are read
+ * can be taken from a frame pool, which keeps blocks of a few size classes
+ * for reuse once a frame is freed, rather than giving them back to the
+ * system. Class I holds objects of up to BW2_FRAMEPOOL_MIN_CLASS_SIZE << 2I
+ * bytes; larger objects are always allocated with malloc.
+ */
+#define BW2_FRAMEPOOL_NUM_CLASSES 4
+#define BW2_FRAMEPOOL_MIN_CLASS_SIZE 128
+#define BW2_FRAMEPOOL_DEFAULT_MAX_CACHED 64
+
+/* Zero this struct for the defaults. */
+struct bw2_framePoolParams {
+    /* Most blocks of each size class kept for reuse (0 for the default). */
+    size_t maxCached;
+
+    /* Blocks of each size class to allocate up front. */
+    size_t prefill;
+};
+
+struct bw2_framePoolStats {
+    uint64_t allocs;
+    uint64_t hits;
+    uint64_t mallocs;
+    uint64_t releases;
+    uint64_t cached;
+};
+
+/* The value of a pool's REMOTE list once the pool has been released. */
+#define BW2_FRAMEPOOL_RELEASED ((void*) 1)
+
+/* A frame pool is used by one thread at a time, but its statistics may be
+ * read from any thread. A zeroed pool is empty and uses the defaults.
+ */
+struct bw2_framePool {
+    void* freelist[BW2_FRAMEPOOL_NUM_CLASSES];
+    size_t count[BW2_FRAMEPOOL_NUM_CLASSES];
+    size_t maxCached;
+    struct bw2_framePoolStats stats;
+
+    /* Blocks freed by other threads, to be put back on the free lists by the
+     * thread using the pool, or BW2_FRAMEPOOL_RELEASED once the pool has been
+     * released, in which case they are freed straight away.
+     */
+    void* remote;
+
+    /* Where blocks and frame references are allocated (NULL for malloc). */
+    struct bw2_allocator* allocator;
+};
+
+/* Frame and object sizes are counted in buckets of sizes up to
+ * BW2_FRAMESTATS_MIN_BUCKET_SIZE << I bytes, and the last bucket counts the
+ * sizes larger than that.
+ */
+#define BW2_FRAMESTATS_NUM_BUCKETS 16
+#define BW2_FRAMESTATS_MIN_BUCKET_SIZE 64
+
+/* Statistics about the frames read with a struct bw2_frameAlloc. The size of a
+ * frame is the number of bytes its headers, POs, and ROs take up in a frame
+ * heap.
+ */
+struct bw2_frameStats {
+    uint64_t frames;
+    uint64_t truncatedFrames;
+    uint64_t droppedObjects;
+    uint64_t spilledObjects;
+    uint64_t skippedObjects;
+    uint64_t heapHighWater;
+    uint64_t spillHighWater;
+    uint64_t frameHighWater;
+    uint64_t frameSizes[BW2_FRAMESTATS_NUM_BUCKETS];
+    uint64_t objectSizes[BW2_FRAMESTATS_NUM_BUCKETS];
+};
+
+/* A limit on the memory allocated for frames that are read without a frame
+ * heap, from when they are read until their resources are freed (including
+ * while they are retained). Memory charged to a budget is also charged to its
+ * PARENT, if not NULL. Objects that would take a budget or any of its parents
+ * over its LIMIT are left out of the frame, and counted in REJECTEDOBJECTS and
+ * REJECTEDBYTES of the budget they would have exceeded. A budget may be
+ * charged and credited from any thread; its other members are read
+ * atomically with bw2_memBudgetGetStats.
+ */
+struct bw2_memBudget {
+    size_t limit;
+    struct bw2_memBudget* parent;
+
+    size_t used;
+    size_t highWater;
+    uint64_t rejectedObjects;
+    uint64_t rejectedBytes;
+};
+
+struct bw2_memBudgetStats {
+    size_t limit;
+    size_t used;
+    size_t highWater;
+    uint64_t rejectedObjects;
+    uint64_t rejectedBytes;
+};
+
+/* The PO numbers whose first MASKBITS bits are those of PONUM, like the
+ * BW2_PO_NUM_* and BW2_PO_MASK_* pairs in ponames.h. A MASKBITS of 32 matches
+ * PONUM alone.
+ */
+struct bw2_poRange {
+    uint32_t ponum;
+    uint8_t maskbits;
+};
+
+/* Which headers, POs, and ROs of a frame are kept when it is read. Objects
+ * that are not kept are skipped without being stored. Each list, if not NULL,
+ * holds the header keys, PO ranges, or RO numbers to keep, and if NULL, every
+ * object of that kind is kept. The "finished" header is always kept.
+ */
+struct bw2_retainPolicy {
+    const char** keys;
+    size_t numKeys;
+    struct bw2_poRange* pos;
+    size_t numPOs;
+    uint8_t* ros;
+    size_t numROs;
+};
+
+/* Headers, POs, and ROs that are read are aligned to this many bytes, so that
+ * their members can be accessed directly on any target.
+ */
+#define BW2_FRAME_OBJECT_ALIGNMENT __alignof__(struct bw2_payloadobj)
+
+/* Where the resources of frames that are read are allocated. */
+struct bw2_frameAlloc {
+    /* Where objects are allocated first, or NULL to use POOL instead. */
+    char* frameheap;
+    size_t heapsize;
+
+    /* Where objects that do not fit in FRAMEHEAP are allocated, if not NULL. */
+    char* spill;
+    size_t spillsize;
+
+    /* Used if FRAMEHEAP is NULL; if POOL is also NULL, malloc is used. */
+    struct bw2_framePool* pool;
+
+    /* The boundary, a power of two, to which the bodies of POs are aligned
+     * (0 for BW2_FRAME_OBJECT_ALIGNMENT).
+     */
+    size_t poalign;
+
+    /* Updated for each frame that is read, if not NULL. Written only by the
+     * thread reading frames, but may be read atomically by any thread.
+     */
+    struct bw2_frameStats* stats;
+
+    /* What objects allocated without a frame heap are charged to, if not
+     * NULL.
+     */
+    struct bw2_memBudget* budget;
+
+    /* Which objects are kept, or NULL to keep them all. */
+    struct bw2_retainPolicy* policy;
+
+    /* Called with ONHEADERCTX once the command and sequence number of a frame
+     * have been read, if not NULL. It may change BUDGET and POLICY for the
+     * rest of that frame.
+     */
+    void (*onheader)(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, void* ctx);
+    void* onheaderctx;
+};
+
+/* The resources of a frame that outlive it, until the last reference to them
+ * is released.
+ */
+struct bw2_frameRef {
+    uint32_t refs;
+    struct bw2_frame frame;
+};
+
+struct bw2_instream;
+
 void bw2_frameInit(struct bw2_frame* frame, const char* cmd, int32_t seqno);
 
 int bw2_readFrame(struct bw2_frame* frame, char* frameheap, size_t heapsize, int fd);
+int bw2_readFrameFromStream(struct bw2_frame* frame, char* frameheap, size_t heapsize, struct bw2_instream* in);
+
+/* Parses a frame that has been fully received into BUF. */
+int bw2_parseFrame(struct bw2_frame* frame, char* frameheap, size_t heapsize, char* buf, size_t buflen);
+
+/* Same as the above, but allocate the frame's resources as described by
+ * ALLOC. A frame whose resources were taken from a pool is freed with
+ * bw2_frameFreeToPool.
+ */
+int bw2_readFrameAlloc(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, int fd);
+int bw2_parseFrameAlloc(struct bw2_frame* frame, struct bw2_frameAlloc* alloc, char* buf, size_t buflen);
+
+/* Checks whether BUF begins with a complete frame, without parsing it or
+ * allocating anything. If it does, the frame's length (including the frame
+ * header) is stored in FRAMELEN; otherwise, FRAMELEN is set to 0. Calling this
+ * again on the same frame after more bytes arrive resumes where the previous
+ * call left off.
+ */
+int bw2_scanFrame(const char* buf, size_t buflen, struct bw2_framescan* scan, size_t* framelen);
 struct bw2_header* bw2_getFirstHeader(struct bw2_frame* frame, const char* key);
 
 int bw2_frameMustResponse(struct bw2_frame* frame);
@@ -133,6 +359,41 @@ int bw2_frameMustResponse(struct bw2_frame* frame);
  * allocated with malloc (i.e., with a NULL frame heap).
  */
 void bw2_frameFreeResources(struct bw2_frame* frame);
+void bw2_frameFreeToPool(struct bw2_frame* frame, struct bw2_framePool* pool);
+
+/* Keeps the resources of FRAME, which must have been read without a frame
+ * heap, from being freed along with the frame, and returns a new reference to
+ * them. They are freed once the frame has been freed and every reference has
+ * been released, which may happen on any thread. Must be called on the thread
+ * that read FRAME, before it is freed. Returns NULL if FRAME was read into a
+ * frame heap, or if memory could not be allocated.
+ */
+struct bw2_frameRef* bw2_frameRetain(struct bw2_frame* frame);
+void bw2_frameRefRetain(struct bw2_frameRef* ref);
+void bw2_frameRefRelease(struct bw2_frameRef* ref);
+
+/* Sets the limits of POOL, freeing any blocks it keeps beyond them, and then
+ * allocates blocks up front as requested.
+ */
+int bw2_framePoolConfigure(struct bw2_framePool* pool, struct bw2_framePoolParams* params);
+
+/* Frees every block kept by POOL. Blocks freed by other threads afterwards are
+ * freed straight away, rather than kept, until the thread using the pool
+ * allocates from it again. The pool can still be used afterwards.
+ */
+void bw2_framePoolRelease(struct bw2_framePool* pool);
+void bw2_framePoolGetStats(struct bw2_framePool* pool, struct bw2_framePoolStats* stats);
+
+/* Copies the statistics in FROM, which may be being updated by another
+ * thread, to TO.
+ */
+void bw2_frameStatsGet(struct bw2_frameStats* from, struct bw2_frameStats* to);
+
+/* LIMIT is in bytes, or 0 for no limit. */
+void bw2_memBudgetInit(struct bw2_memBudget* budget, size_t limit, struct bw2_memBudget* parent);
+bool bw2_memBudgetCharge(struct bw2_memBudget* budget, size_t size);
+void bw2_memBudgetCredit(struct bw2_memBudget* budget, size_t size);
+void bw2_memBudgetGetStats(struct bw2_memBudget* budget, struct bw2_memBudgetStats* stats);
 
 void bw2_appendKV(struct bw2_frame* frame, struct bw2_header* kv);
 void bw2_appendPO(struct bw2_frame* frame, struct bw2_payloadobj* po);
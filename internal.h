@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BW2_INTERNAL_H
+#define BW2_INTERNAL_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "chaincache.h"
+#include "daemon.h"
+#include "frame.h"
+
+/* Functions shared between the library's source files. This header is not
+ * included by api.h, and applications should not use it.
+ */
+
+/* Used internally by the bindings. These must be called with the client's
+ * reqslock held.
+ */
+void _bw2_reqsInsert(struct bw2_client* client, struct bw2_reqctx* rctx);
+bool _bw2_reqctxFiltered(struct bw2_reqctx* rctx);
+void _bw2_reqsRemove(struct bw2_reqctx* rctx);
+void _bw2_reqctxDisarm(struct bw2_reqctx* rctx);
+void _bw2_expireRequest(struct bw2_reqctx* rctx, int error);
+void _bw2_serviceTimers(struct bw2_client* client);
+
+/* Used internally by bw2_daemon to reconnect after the connection is lost. */
+bool _bw2_shouldReconnect(struct bw2_client* client);
+int _bw2_reconnect(struct bw2_client* client, char* frameheap, size_t heapsize);
+void _bw2_forgetReplay(struct bw2_client* client, struct bw2_replaySub* replay);
+
+/* Used internally to read frames for CLIENT into FRAMEHEAP. */
+void _bw2_clientFrameAlloc(struct bw2_client* client, struct bw2_frameAlloc* alloc, char* frameheap, size_t heapsize);
+
+/* Used internally by the BOSSWAVE thread to deliver batched messages. */
+void _bw2_flushBatches(struct bw2_client* client, bool all);
+
+/* Used internally by bw2_transact. */
+bool _bw2_cancelTokenBind(struct bw2_cancelToken* token, struct bw2_client* client, struct bw2_reqctx* reqctx);
+
+/* Used internally to resolve PACs for bw2_publish and bw2_subscribe. */
+void _bw2_chainCacheKeyFromParams(struct bw2_buildChainParams* p, struct bw2_chainCacheKey* key);
+int _bw2_buildChainUncached(struct bw2_client* client, struct bw2_buildChainParams* p, struct bw2_simplechain_ctx* scctx);
+
+#endif
@@ -29,6 +29,11 @@
 
 #include <string.h>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "errors.h"
 #include "objects.h"
 #include "utils.h"
 
@@ -67,3 +72,228 @@ void bw2_dotChainHash_set(struct bw2_dotChainHash* dotchainhash, char* blob, siz
     memcpy(dotchainhash->dotchainhash, blob, bloblen);
     dotchainhash->dotchainhashlen = bloblen;
 }
+
+/* Hashes are encoded as ten groups of three bytes, followed by the last two
+ * bytes as three characters and a padding character.
+ */
+#define BW2_HASH_FULL_GROUPS_LENGTH 30
+
+const char bw2_base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* Returns the value of base64 character C, or -1 if it is not one. */
+int _bw2_base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    } else if (c == '-' || c == '+') {
+        return 62;
+    } else if (c == '_' || c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+/* Decodes the NUMGROUPS groups of four characters in B64 into OUT. */
+int _bw2_base64_decode_scalar(uint8_t* out, const char* b64, size_t numgroups) {
+    size_t i;
+    for (i = 0; i != numgroups; i++) {
+        int a = _bw2_base64_value(b64[0]);
+        int b = _bw2_base64_value(b64[1]);
+        int c = _bw2_base64_value(b64[2]);
+        int d = _bw2_base64_value(b64[3]);
+        if ((a | b | c | d) < 0) {
+            return BW2_ERROR_BAD_ARG;
+        }
+        uint32_t group = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = (uint8_t) (group >> 16);
+        out[1] = (uint8_t) (group >> 8);
+        out[2] = (uint8_t) group;
+        out += 3;
+        b64 += 4;
+    }
+    return 0;
+}
+
+/* Encodes the NUMGROUPS groups of three bytes in IN into B64. */
+void _bw2_base64_encode_scalar(char* b64, const uint8_t* in, size_t numgroups) {
+    size_t i;
+    for (i = 0; i != numgroups; i++) {
+        uint32_t group = (in[0] << 16) | (in[1] << 8) | in[2];
+        b64[0] = bw2_base64_alphabet[(group >> 18) & 0x3f];
+        b64[1] = bw2_base64_alphabet[(group >> 12) & 0x3f];
+        b64[2] = bw2_base64_alphabet[(group >> 6) & 0x3f];
+        b64[3] = bw2_base64_alphabet[group & 0x3f];
+        in += 3;
+        b64 += 4;
+    }
+}
+
+#if defined(__SSSE3__)
+/* Decodes 16 characters into the first 12 bytes of the result, using the
+ * method of Mula and Lemire. Sets *VALID to false if any character is not
+ * base64.
+ */
+__m128i _bw2_base64_decode_block(__m128i chars, bool* valid) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('Z' + 1)));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+    __m128i plus = _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('-')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('+')));
+    __m128i slash = _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('_')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('/')));
+
+    /* Each character's value is the character plus an offset for its range. */
+    __m128i offset = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+    offset = _mm_or_si128(offset, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+    offset = _mm_or_si128(offset, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+    __m128i values = _mm_add_epi8(chars, offset);
+    values = _mm_or_si128(_mm_andnot_si128(_mm_or_si128(plus, slash), values), _mm_and_si128(plus, _mm_set1_epi8(62)));
+    values = _mm_or_si128(values, _mm_and_si128(slash, _mm_set1_epi8(63)));
+
+    __m128i known = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+    *valid = (_mm_movemask_epi8(known) == 0xffff);
+
+    /* Pack the four 6-bit values of each group into three bytes. */
+    __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(groups, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* Encodes the first 12 bytes of IN into 16 characters. */
+__m128i _bw2_base64_encode_block(__m128i in) {
+    /* Split each group of three bytes into four 6-bit indices. */
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t0, t1);
+
+    /* Add the offset of each index's range of the alphabet. */
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+    __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '-' - 62, '_' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+#endif
+
+int bw2_hashDecode(struct bw2_hash* hash, const char* b64, size_t b64len) {
+    struct bw2_hash decoded;
+    int rv;
+
+    if (b64len == BW2_OBJECTS_HASH_BASE64_LENGTH && b64[b64len - 1] == '=') {
+        b64len--;
+    }
+    if (b64len != BW2_OBJECTS_HASH_BASE64_LENGTH - 1) {
+        return BW2_ERROR_BAD_ARG;
+    }
+
+#if defined(__SSSE3__)
+    /* The first 32 characters are decoded 16 at a time, and the rest of the
+     * full groups are left to the scalar code.
+     */
+    bool valid1, valid2;
+    __m128i lo = _bw2_base64_decode_block(_mm_loadu_si128((const __m128i*) b64), &valid1);
+    __m128i hi = _bw2_base64_decode_block(_mm_loadu_si128((const __m128i*) &b64[16]), &valid2);
+    if (!valid1 || !valid2) {
+        return BW2_ERROR_BAD_ARG;
+    }
+    _mm_storeu_si128((__m128i*) decoded.bytes, lo);
+    _mm_storeu_si128((__m128i*) &decoded.bytes[12], hi);
+    rv = _bw2_base64_decode_scalar(&decoded.bytes[24], &b64[32], 2);
+#else
+    rv = _bw2_base64_decode_scalar(decoded.bytes, b64, BW2_HASH_FULL_GROUPS_LENGTH / 3);
+#endif
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* The last three characters hold the last two bytes. */
+    const char* last = &b64[(BW2_HASH_FULL_GROUPS_LENGTH / 3) * 4];
+    int a = _bw2_base64_value(last[0]);
+    int b = _bw2_base64_value(last[1]);
+    int c = _bw2_base64_value(last[2]);
+    if ((a | b | c) < 0) {
+        return BW2_ERROR_BAD_ARG;
+    }
+    decoded.bytes[30] = (uint8_t) ((a << 2) | (b >> 4));
+    decoded.bytes[31] = (uint8_t) ((b << 4) | (c >> 2));
+
+    memcpy(hash, &decoded, sizeof(struct bw2_hash));
+    return 0;
+}
+
+void bw2_hashEncode(const struct bw2_hash* hash, char* b64) {
+#if defined(__SSSE3__)
+    /* The first 24 bytes are encoded 12 at a time. */
+    _mm_storeu_si128((__m128i*) b64, _bw2_base64_encode_block(_mm_load_si128((const __m128i*) hash->bytes)));
+    _mm_storeu_si128((__m128i*) &b64[16], _bw2_base64_encode_block(_mm_loadu_si128((const __m128i*) &hash->bytes[12])));
+    _bw2_base64_encode_scalar(&b64[32], &hash->bytes[24], 2);
+#else
+    _bw2_base64_encode_scalar(b64, hash->bytes, BW2_HASH_FULL_GROUPS_LENGTH / 3);
+#endif
+
+    const uint8_t* last = &hash->bytes[BW2_HASH_FULL_GROUPS_LENGTH];
+    char* out = &b64[(BW2_HASH_FULL_GROUPS_LENGTH / 3) * 4];
+    out[0] = bw2_base64_alphabet[last[0] >> 2];
+    out[1] = bw2_base64_alphabet[((last[0] & 0x03) << 4) | (last[1] >> 4)];
+    out[2] = bw2_base64_alphabet[(last[1] & 0x0f) << 2];
+    out[3] = '=';
+}
+
+bool bw2_hashEqual(const struct bw2_hash* a, const struct bw2_hash* b) {
+#if defined(__SSSE3__)
+    __m128i lo = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*) a->bytes), _mm_load_si128((const __m128i*) b->bytes));
+    __m128i hi = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*) &a->bytes[16]), _mm_load_si128((const __m128i*) &b->bytes[16]));
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xffff;
+#else
+    /* Every byte is compared, rather than stopping at the first difference. */
+    uint64_t wa[BW2_OBJECTS_HASH_LENGTH / 8];
+    uint64_t wb[BW2_OBJECTS_HASH_LENGTH / 8];
+    uint64_t diff = 0;
+    size_t i;
+    memcpy(wa, a->bytes, sizeof(wa));
+    memcpy(wb, b->bytes, sizeof(wb));
+    for (i = 0; i != BW2_OBJECTS_HASH_LENGTH / 8; i++) {
+        diff |= wa[i] ^ wb[i];
+    }
+    return diff == 0;
+#endif
+}
+
+uint64_t bw2_hashValue(const struct bw2_hash* hash) {
+    /* The bytes are already a cryptographic hash, so folding them together
+     * and mixing the result is enough.
+     */
+    uint64_t words[BW2_OBJECTS_HASH_LENGTH / 8];
+    memcpy(words, hash->bytes, sizeof(words));
+    uint64_t h = words[0] ^ ((words[1] << 16) | (words[1] >> 48)) ^ ((words[2] << 32) | (words[2] >> 32)) ^ ((words[3] << 48) | (words[3] >> 16));
+    h *= UINT64_C(0x9e3779b97f4a7c15);
+    return h ^ (h >> 32);
+}
+
+int bw2_vkHash_toBinary(const struct bw2_vkHash* vkhash, struct bw2_hash* hash) {
+    return bw2_hashDecode(hash, vkhash->vkhash, vkhash->vkhashlen);
+}
+
+void bw2_vkHash_fromBinary(struct bw2_vkHash* vkhash, const struct bw2_hash* hash) {
+    bw2_hashEncode(hash, vkhash->vkhash);
+    vkhash->vkhashlen = BW2_OBJECTS_HASH_BASE64_LENGTH;
+}
+
+int bw2_dotHash_toBinary(const struct bw2_dotHash* dothash, struct bw2_hash* hash) {
+    return bw2_hashDecode(hash, dothash->dothash, dothash->dothashlen);
+}
+
+void bw2_dotHash_fromBinary(struct bw2_dotHash* dothash, const struct bw2_hash* hash) {
+    bw2_hashEncode(hash, dothash->dothash);
+    dothash->dothashlen = BW2_OBJECTS_HASH_BASE64_LENGTH;
+}
+
+int bw2_dotChainHash_toBinary(const struct bw2_dotChainHash* dotchainhash, struct bw2_hash* hash) {
+    return bw2_hashDecode(hash, dotchainhash->dotchainhash, dotchainhash->dotchainhashlen);
+}
+
+void bw2_dotChainHash_fromBinary(struct bw2_dotChainHash* dotchainhash, const struct bw2_hash* hash) {
+    bw2_hashEncode(hash, dotchainhash->dotchainhash);
+    dotchainhash->dotchainhashlen = BW2_OBJECTS_HASH_BASE64_LENGTH;
+}
@@ -30,6 +30,8 @@
 #ifndef BW2_OBJECTS_H
 #define BW2_OBJECTS_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "frame.h"
@@ -41,6 +43,12 @@
 #define BW2_OBJECTS_MAX_DOT_HASH_LENGTH 100
 #define BW2_OBJECTS_MAX_DOT_CHAIN_HASH_LENGTH 100
 
+/* VK, DOT, and DOT chain hashes are 32 bytes, sent as 44 characters of
+ * URL-safe base64 (with padding).
+ */
+#define BW2_OBJECTS_HASH_LENGTH 32
+#define BW2_OBJECTS_HASH_BASE64_LENGTH 44
+
 struct bw2_subscriptionHandle {
     char handle[BW2_OBJECTS_MAX_SUBSCRIPTION_HANDLE_LENGTH];
     size_t handlelen;
@@ -87,6 +95,13 @@ struct bw2_dotChainHash {
     size_t dotchainhashlen;
 };
 
+/* The binary form of a VK, DOT, or DOT chain hash, a third of the size of the
+ * structs above, for use as a key in caches and maps.
+ */
+struct bw2_hash {
+    uint8_t bytes[BW2_OBJECTS_HASH_LENGTH];
+} __attribute__((aligned(16)));
+
 void bw2_subscriptionHandle_set(struct bw2_subscriptionHandle* handle, char* blob, size_t bloblen);
 void bw2_vk_set(struct bw2_vk* vk, char* blob, size_t bloblen);
 void bw2_vkHash_set(struct bw2_vkHash* vkhash, char* blob, size_t bloblen);
@@ -94,4 +109,28 @@ void bw2_dot_set(struct bw2_dot* dot, char* blob, size_t bloblen);
 void bw2_dotHash_set(struct bw2_dotHash* dothash, char* blob, size_t bloblen);
 void bw2_dotChainHash_set(struct bw2_dotChainHash* dotchainhash, char* blob, size_t bloblen);
 
+/* Decodes the base64 form of a hash, with or without padding, in either the
+ * URL-safe or the standard alphabet. Returns BW2_ERROR_BAD_ARG if B64 is not
+ * the encoding of a 32-byte hash.
+ */
+int bw2_hashDecode(struct bw2_hash* hash, const char* b64, size_t b64len);
+
+/* Writes the BW2_OBJECTS_HASH_BASE64_LENGTH characters of the URL-safe base64
+ * form of HASH, with padding, to B64. They are not null-terminated.
+ */
+void bw2_hashEncode(const struct bw2_hash* hash, char* b64);
+
+/* Takes the same time whether or not the hashes are equal. */
+bool bw2_hashEqual(const struct bw2_hash* a, const struct bw2_hash* b);
+
+/* A 64-bit hash of HASH, for hash tables. */
+uint64_t bw2_hashValue(const struct bw2_hash* hash);
+
+int bw2_vkHash_toBinary(const struct bw2_vkHash* vkhash, struct bw2_hash* hash);
+void bw2_vkHash_fromBinary(struct bw2_vkHash* vkhash, const struct bw2_hash* hash);
+int bw2_dotHash_toBinary(const struct bw2_dotHash* dothash, struct bw2_hash* hash);
+void bw2_dotHash_fromBinary(struct bw2_dotHash* dothash, const struct bw2_hash* hash);
+int bw2_dotChainHash_toBinary(const struct bw2_dotChainHash* dotchainhash, struct bw2_hash* hash);
+void bw2_dotChainHash_fromBinary(struct bw2_dotChainHash* dotchainhash, const struct bw2_hash* hash);
+
 #endif
@@ -27,11 +27,28 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* Needed on Linux for the functions that set a thread's CPU affinity and
+ * name.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <string.h>
+
 #include "errors.h"
 #include "osutil.h"
 
 #if (BW2_OS == LINUX)
 
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
 int bw2_mutexInit(struct bw2_mutex* lock) {
     return pthread_mutex_init(&lock->mutex, NULL);
 }
@@ -49,13 +66,29 @@ int bw2_mutexDestroy(struct bw2_mutex* lock) {
 }
 
 int bw2_condInit(struct bw2_cond* condvar) {
-    return pthread_cond_init(&condvar->cond, NULL);
+    /* Timed waits are against the monotonic clock, as in bw2_getTimeMicros. */
+    pthread_condattr_t attr;
+    int rv = pthread_condattr_init(&attr);
+    if (rv != 0) {
+        return rv;
+    }
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    rv = pthread_cond_init(&condvar->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return rv;
 }
 
 int bw2_condWait(struct bw2_cond* condvar, struct bw2_mutex* lock) {
     return pthread_cond_wait(&condvar->cond, &lock->mutex);
 }
 
+int bw2_condTimedWait(struct bw2_cond* condvar, struct bw2_mutex* lock, uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) (deadline / 1000000);
+    ts.tv_nsec = (long) ((deadline % 1000000) * 1000);
+    return pthread_cond_timedwait(&condvar->cond, &lock->mutex, &ts);
+}
+
 int bw2_condSignal(struct bw2_cond* condvar) {
     return pthread_cond_signal(&condvar->cond);
 }
@@ -68,20 +101,186 @@ int bw2_condDestroy(struct bw2_cond* condvar) {
     return pthread_cond_destroy(&condvar->cond);
 }
 
-int bw2_threadCreate(char* thread_stack, int stack_size, void* (*function)(void*), void* arg, int* tid) {
-    (void) thread_stack;
-    (void) stack_size;
+uint64_t bw2_getTimeMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t) ts.tv_sec) * 1000000) + (((uint64_t) ts.tv_nsec) / 1000);
+}
+
+/* A nice value applies to a single thread on Linux, but can only be set by
+ * the thread itself (it needs the thread's kernel ID), so threads with one
+ * start here, and tell their creator whether it could be set.
+ */
+struct bw2_threadStart {
+    void* (*function)(void*);
+    void* arg;
+    int nice;
+
+    struct bw2_mutex lock;
+    struct bw2_cond started;
+    bool done;
+    int rv;
+};
+
+void* _bw2_threadStart_trampoline(void* arg) {
+    struct bw2_threadStart* start = arg;
+    void* (*function)(void*) = start->function;
+    void* fnarg = start->arg;
+    int rv = 0;
+
+    if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), start->nice) != 0) {
+        /* Lowering the nice value needs privileges that the process may lack. */
+        rv = (errno == EPERM || errno == EACCES) ? BW2_ERROR_OPERATION_NOT_SUPPORTED : BW2_ERROR_BAD_ARG;
+    }
+
+    /* START belongs to the creator, which may release it once told. */
+    bw2_mutexLock(&start->lock);
+    start->rv = rv;
+    start->done = true;
+    bw2_condSignal(&start->started);
+    bw2_mutexUnlock(&start->lock);
+
+    if (rv != 0) {
+        return NULL;
+    }
+    return function(fnarg);
+}
 
+int bw2_threadCreateWithAttrs(struct bw2_threadAttrs* attrs, void* (*function)(void*), void* arg, int* tid) {
+    struct bw2_threadStart startbuf;
+    struct bw2_threadStart* start = NULL;
+    pthread_attr_t pattr;
     pthread_t pthread_id;
-    int rv = pthread_create(&pthread_id, NULL, function, arg);
+    int rv;
+
+    if (pthread_attr_init(&pattr) != 0) {
+        return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+    }
+
+    if (attrs->stack != NULL) {
+        rv = pthread_attr_setstack(&pattr, attrs->stack, attrs->stacksize);
+    } else if (attrs->stacksize != 0) {
+        rv = pthread_attr_setstacksize(&pattr, attrs->stacksize);
+    } else {
+        rv = 0;
+    }
+    if (rv != 0) {
+        rv = BW2_ERROR_BAD_ARG;
+        goto destroyattr;
+    }
+
+    if (attrs->cpumask != 0) {
+        cpu_set_t cpus;
+        int cpu;
+        CPU_ZERO(&cpus);
+        for (cpu = 0; cpu != 64; cpu++) {
+            if ((attrs->cpumask & (((uint64_t) 1) << cpu)) != 0) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        if (pthread_attr_setaffinity_np(&pattr, sizeof(cpus), &cpus) != 0) {
+            rv = BW2_ERROR_BAD_ARG;
+            goto destroyattr;
+        }
+    }
+
+    if (attrs->realtime) {
+        if (attrs->priority < sched_get_priority_min(SCHED_FIFO) || attrs->priority > sched_get_priority_max(SCHED_FIFO)) {
+            rv = BW2_ERROR_BAD_ARG;
+            goto destroyattr;
+        }
+
+        struct sched_param param;
+        memset(&param, 0x00, sizeof(param));
+        param.sched_priority = attrs->priority;
+        if (pthread_attr_setinheritsched(&pattr, PTHREAD_EXPLICIT_SCHED) != 0
+            || pthread_attr_setschedpolicy(&pattr, SCHED_FIFO) != 0
+            || pthread_attr_setschedparam(&pattr, &param) != 0) {
+            rv = BW2_ERROR_BAD_ARG;
+            goto destroyattr;
+        }
+    } else if (attrs->priority != 0) {
+        if (attrs->priority < PRIO_MIN || attrs->priority >= PRIO_MAX) {
+            rv = BW2_ERROR_BAD_ARG;
+            goto destroyattr;
+        }
+
+        start = &startbuf;
+        start->function = function;
+        start->arg = arg;
+        start->nice = attrs->priority;
+        start->done = false;
+        start->rv = 0;
+        if (bw2_mutexInit(&start->lock) != 0) {
+            rv = BW2_ERROR_SYNCHRONIZATION;
+            goto destroyattr;
+        }
+        if (bw2_condInit(&start->started) != 0) {
+            bw2_mutexDestroy(&start->lock);
+            rv = BW2_ERROR_SYNCHRONIZATION;
+            goto destroyattr;
+        }
+        function = _bw2_threadStart_trampoline;
+        arg = start;
+    }
+
+    rv = pthread_create(&pthread_id, &pattr, function, arg);
+    if (rv != 0) {
+        /* Realtime scheduling needs privileges that the process may lack. */
+        rv = (rv == EPERM) ? BW2_ERROR_OPERATION_NOT_SUPPORTED : BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        goto destroystart;
+    }
+
+    if (start != NULL) {
+        bw2_mutexLock(&start->lock);
+        while (!start->done) {
+            bw2_condWait(&start->started, &start->lock);
+        }
+        bw2_mutexUnlock(&start->lock);
+
+        /* A thread whose nice value could not be set exits right away. */
+        rv = start->rv;
+        if (rv != 0) {
+            pthread_join(pthread_id, NULL);
+            goto destroystart;
+        }
+    }
+
+    /* Linux rejects names longer than 15 characters, so the name is cut
+     * short rather than left unset. A thread without a name works just as
+     * well, so an error here is not reported.
+     */
+    char name[BW2_THREAD_NAME_MAX];
+    strncpy(name, attrs->name == NULL ? "BOSSWAVE" : attrs->name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    (void) pthread_setname_np(pthread_id, name);
 
     if (tid != NULL) {
         *tid = (int) pthread_id;
     }
 
+destroystart:
+    if (start != NULL) {
+        bw2_condDestroy(&start->started);
+        bw2_mutexDestroy(&start->lock);
+    }
+destroyattr:
+    pthread_attr_destroy(&pattr);
     return rv;
 }
 
+void bw2_cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void bw2_threadYield(void) {
+    sched_yield();
+}
+
 #elif (BW2_OS == RIOT)
 
 int bw2_mutexInit(struct bw2_mutex* lock) {
@@ -113,6 +312,22 @@ int bw2_condWait(struct bw2_cond* condvar, struct bw2_mutex* lock) {
     return 0;
 }
 
+int bw2_condTimedWait(struct bw2_cond* condvar, struct bw2_mutex* lock, uint64_t deadline) {
+    (void) condvar;
+
+    /* RIOT's condition variables cannot time out, so we poll instead. This
+     * is allowed, since waiters must tolerate returning without a signal.
+     */
+    uint64_t now = bw2_getTimeMicros();
+    if (now >= deadline) {
+        return ETIMEDOUT;
+    }
+    mutex_unlock(&lock->mutex);
+    xtimer_usleep((uint32_t) BW2_RIOT_TIMEDWAIT_POLL_MICROS);
+    mutex_lock(&lock->mutex);
+    return 0;
+}
+
 int bw2_condSignal(struct bw2_cond* condvar) {
     cond_signal(&condvar->cond);
     return 0;
@@ -128,9 +343,16 @@ int bw2_condDestroy(struct bw2_cond* condvar) {
 }
 
 #include <thread.h>
+#include <xtimer.h>
 
-int bw2_threadCreate(char* thread_stack, int stack_size, void* (*function)(void*), void* arg, int* tid) {
-    kernel_pid_t thread_id = thread_create(thread_stack, stack_size, THREAD_PRIORITY_BOSSWAVE, 0, function, arg, "BOSSWAVE");
+uint64_t bw2_getTimeMicros(void) {
+    return xtimer_now_usec64();
+}
+
+int bw2_threadCreateWithAttrs(struct bw2_threadAttrs* attrs, void* (*function)(void*), void* arg, int* tid) {
+    uint8_t priority = (attrs->priority == 0) ? THREAD_PRIORITY_BOSSWAVE : (uint8_t) attrs->priority;
+    const char* name = (attrs->name == NULL) ? "BOSSWAVE" : attrs->name;
+    kernel_pid_t thread_id = thread_create(attrs->stack, (int) attrs->stacksize, priority, 0, function, arg, name);
 
     if (thread_id < 0) {
         return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
@@ -143,4 +365,21 @@ int bw2_threadCreate(char* thread_stack, int stack_size, void* (*function)(void*
     return 0;
 }
 
+void bw2_cpuRelax(void) {
+}
+
+void bw2_threadYield(void) {
+    thread_yield();
+}
+
 #endif
+
+/* Not specific to any OS. */
+
+int bw2_threadCreate(char* thread_stack, int stack_size, void* (*function)(void*), void* arg, int* tid) {
+    struct bw2_threadAttrs attrs;
+    memset(&attrs, 0x00, sizeof(attrs));
+    attrs.stack = thread_stack;
+    attrs.stacksize = (size_t) stack_size;
+    return bw2_threadCreateWithAttrs(&attrs, function, arg, tid);
+}
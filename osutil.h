@@ -30,6 +30,10 @@
 #ifndef BW2_OSUTIL_H
 #define BW2_OSUTIL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define LINUX 0
 #define RIOT 1
 
@@ -57,6 +61,9 @@ struct bw2_cond {
 
 #define THREAD_PRIORITY_BOSSWAVE (THREAD_PRIORITY_MAIN - 1)
 
+/* How often a timed wait checks whether it has been signalled. */
+#define BW2_RIOT_TIMEDWAIT_POLL_MICROS 1000
+
 struct bw2_mutex {
     mutex_t mutex;
 };
@@ -77,12 +84,65 @@ int bw2_mutexUnlock(struct bw2_mutex* lock);
 int bw2_mutexDestroy(struct bw2_mutex* lock);
 int bw2_condInit(struct bw2_cond* condvar);
 int bw2_condWait(struct bw2_cond* condvar, struct bw2_mutex* lock);
+
+/* Like bw2_condWait, but gives up at DEADLINE, which is on the same clock as
+ * bw2_getTimeMicros. Like bw2_condWait, it may return early without the
+ * condition variable having been signalled. It returns ETIMEDOUT once the
+ * deadline has passed.
+ */
+int bw2_condTimedWait(struct bw2_cond* condvar, struct bw2_mutex* lock, uint64_t deadline);
 int bw2_condSignal(struct bw2_cond* condvar);
 int bw2_condBroadcast(struct bw2_cond* condvar);
 int bw2_condDestroy(struct bw2_cond* condvar);
 
+/* Returns the time, in microseconds, on a clock that never goes backwards. */
+uint64_t bw2_getTimeMicros(void);
+
 /* Functions for threading. */
 
+/* The size of a thread's name on Linux, including the terminating null byte. */
+#define BW2_THREAD_NAME_MAX 16
+
+/* Where and how a thread created by the bindings runs. Members left zeroed get
+ * the default behavior.
+ */
+struct bw2_threadAttrs {
+    /* The memory to use as the thread's stack, which is required on RIOT, and
+     * its size. If STACK is NULL, a stack of STACKSIZE bytes is allocated, or
+     * one of the default size if STACKSIZE is 0.
+     */
+    char* stack;
+    size_t stacksize;
+
+    /* The thread's name, or NULL for "BOSSWAVE". On Linux, only the first 15
+     * characters are kept.
+     */
+    const char* name;
+
+    /* On Linux, the CPUs that the thread may run on, as a bit mask of the
+     * first 64 CPUs, or 0 for any CPU.
+     */
+    uint64_t cpumask;
+
+    /* On Linux, if REALTIME is set, the thread is scheduled with SCHED_FIFO
+     * at priority PRIORITY; otherwise PRIORITY is its nice value. Either
+     * must be in its valid range (sched_get_priority_min/max, or -20 to
+     * 19). On RIOT, PRIORITY is the thread's priority, or
+     * THREAD_PRIORITY_BOSSWAVE if 0.
+     */
+    bool realtime;
+    int priority;
+};
+
 int bw2_threadCreate(char* thread_stack, int stack_size, void* (*function) (void*), void* arg, int* tid);
+int bw2_threadCreateWithAttrs(struct bw2_threadAttrs* attrs, void* (*function) (void*), void* arg, int* tid);
+
+/* Functions for waiting without blocking. */
+
+/* Hints to the CPU that the calling thread is busy-waiting. */
+void bw2_cpuRelax(void);
+
+/* Lets other threads run on the calling thread's CPU. */
+void bw2_threadYield(void);
 
 #endif
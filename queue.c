@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "api.h"
+#include "errors.h"
+#include "osutil.h"
+#include "queue.h"
+#include "utils.h"
+
+#define BW2_MSGQUEUE_PUSHED 0
+#define BW2_MSGQUEUE_FULL 1
+#define BW2_MSGQUEUE_BUSY 2
+
+/* Stored in a slot while the producer compares the message in it with another
+ * one, so that the consumer does not take and free the message meanwhile.
+ */
+#define BW2_MSGQUEUE_CLAIMED ((struct bw2_simpleMessage*) 1)
+
+int bw2_msgqueueInit(struct bw2_msgqueue* q, struct bw2_msgqueueSlot* slots, size_t capacity, int policy) {
+    /* Indices wrap around, so the capacity must divide SIZE_MAX + 1. */
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return BW2_ERROR_BAD_ARG;
+    }
+
+    memset(q, 0x00, sizeof(struct bw2_msgqueue));
+    memset(slots, 0x00, capacity * sizeof(struct bw2_msgqueueSlot));
+    q->slots = slots;
+    q->capacity = capacity;
+    q->policy = policy;
+
+    if (bw2_mutexInit(&q->lock) != 0) {
+        goto error1;
+    }
+    if (bw2_condInit(&q->nonempty) != 0) {
+        goto error2;
+    }
+    if (bw2_condInit(&q->nonfull) != 0) {
+        goto error3;
+    }
+
+    return 0;
+
+error3:
+    bw2_condDestroy(&q->nonempty);
+error2:
+    bw2_mutexDestroy(&q->lock);
+error1:
+    return BW2_ERROR_SYNCHRONIZATION;
+}
+
+void _bw2_msgqueueWake(struct bw2_msgqueue* q, bool* waiting, struct bw2_cond* condvar) {
+    /* Pairs with the fence in _bw2_msgqueuePark, so that either the waiter
+     * sees the change to the queue, or we see that it is waiting.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        bw2_mutexLock(&q->lock);
+        bw2_condSignal(condvar);
+        bw2_mutexUnlock(&q->lock);
+    }
+}
+
+bool _bw2_msgqueueIsFull(struct bw2_msgqueue* q) {
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    return (tail - head) >= q->capacity
+        || __atomic_load_n(&q->slots[tail & (q->capacity - 1)].msg, __ATOMIC_ACQUIRE) != NULL;
+}
+
+bool _bw2_msgqueueIsEmpty(struct bw2_msgqueue* q) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    return head == tail;
+}
+
+/* Sleeps until woken, or until DEADLINE if it is not 0. The caller must
+ * recheck whether the queue changed afterwards.
+ */
+void _bw2_msgqueuePark(struct bw2_msgqueue* q, bool* waiting, struct bw2_cond* condvar, bool (*done)(struct bw2_msgqueue*), uint64_t deadline) {
+    bw2_mutexLock(&q->lock);
+    __atomic_store_n(waiting, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!done(q) && !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+        if (deadline == 0) {
+            bw2_condWait(condvar, &q->lock);
+        } else {
+            bw2_condTimedWait(condvar, &q->lock, deadline);
+        }
+    }
+    __atomic_store_n(waiting, false, __ATOMIC_RELAXED);
+    bw2_mutexUnlock(&q->lock);
+}
+
+bool _bw2_msgqueueHasRoom(struct bw2_msgqueue* q) {
+    return !_bw2_msgqueueIsFull(q);
+}
+
+bool _bw2_msgqueueHasMessage(struct bw2_msgqueue* q) {
+    return !_bw2_msgqueueIsEmpty(q);
+}
+
+/* Takes the oldest message in the queue, or returns NULL if it is empty. This
+ * is used by the consumer, and by the producer to drop the oldest message.
+ */
+struct bw2_simpleMessage* _bw2_msgqueueTake(struct bw2_msgqueue* q) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    while (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        if (__atomic_compare_exchange_n(&q->head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            /* Advancing HEAD made the message in this slot ours, once the
+             * producer is done looking at it.
+             */
+            struct bw2_msgqueueSlot* slot = &q->slots[head & (q->capacity - 1)];
+            struct bw2_simpleMessage* msg = __atomic_load_n(&slot->msg, __ATOMIC_ACQUIRE);
+            do {
+                while (msg == BW2_MSGQUEUE_CLAIMED) {
+                    bw2_cpuRelax();
+                    msg = __atomic_load_n(&slot->msg, __ATOMIC_ACQUIRE);
+                }
+            } while (!__atomic_compare_exchange_n(&slot->msg, &msg, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+int _bw2_msgqueueTryPush(struct bw2_msgqueue* q, struct bw2_simpleMessage* msg, uint64_t urihash) {
+    size_t tail = q->tail;
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if ((tail - head) >= q->capacity) {
+        return BW2_MSGQUEUE_FULL;
+    }
+
+    struct bw2_msgqueueSlot* slot = &q->slots[tail & (q->capacity - 1)];
+    if (__atomic_load_n(&slot->msg, __ATOMIC_ACQUIRE) != NULL) {
+        /* Whoever advanced HEAD past this slot has not taken the message yet. */
+        return BW2_MSGQUEUE_BUSY;
+    }
+
+    slot->urihash = urihash;
+    __atomic_store_n(&slot->msg, msg, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return BW2_MSGQUEUE_PUSHED;
+}
+
+/* Swaps MSG in for the newest queued message with the same URI, so that
+ * messages for any one URI stay in order. URIHASH only rules slots out; the
+ * URI of a message whose hash matches is compared before it is replaced.
+ */
+bool _bw2_msgqueueReplace(struct bw2_msgqueue* q, struct bw2_simpleMessage* msg, uint64_t urihash) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    size_t i;
+    for (i = q->tail; i != head; i--) {
+        struct bw2_msgqueueSlot* slot = &q->slots[(i - 1) & (q->capacity - 1)];
+        if (slot->urihash != urihash) {
+            continue;
+        }
+
+        /* Keep the consumer from taking the old message while it is read. */
+        struct bw2_simpleMessage* old = __atomic_load_n(&slot->msg, __ATOMIC_ACQUIRE);
+        if (old == NULL || !__atomic_compare_exchange_n(&slot->msg, &old, BW2_MSGQUEUE_CLAIMED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            /* The consumer already took the old message. */
+            continue;
+        }
+
+        if (old->uri_len == msg->uri_len && memcmp(old->uri, msg->uri, msg->uri_len) == 0) {
+            __atomic_store_n(&slot->msg, msg, __ATOMIC_RELEASE);
+            bw2_simpleMessageFree(old);
+            return true;
+        }
+        __atomic_store_n(&slot->msg, old, __ATOMIC_RELEASE);
+    }
+    return false;
+}
+
+void bw2_msgqueuePush(struct bw2_msgqueue* q, struct bw2_simpleMessage* msg) {
+    uint64_t urihash = bw2_hash_bytes(msg->uri, msg->uri_len);
+
+    while (true) {
+        int rv = _bw2_msgqueueTryPush(q, msg, urihash);
+        if (rv == BW2_MSGQUEUE_PUSHED) {
+            __atomic_fetch_add(&q->enqueued, 1, __ATOMIC_RELAXED);
+            _bw2_msgqueueWake(q, &q->consumerWaiting, &q->nonempty);
+            return;
+        } else if (rv == BW2_MSGQUEUE_BUSY) {
+            /* The consumer is about to free up a slot. */
+            bw2_cpuRelax();
+            continue;
+        }
+
+        struct bw2_simpleMessage* oldest;
+        switch (q->policy) {
+        case BW2_OVERFLOW_DROP_NEWEST:
+            bw2_simpleMessageFree(msg);
+            __atomic_fetch_add(&q->droppedNewest, 1, __ATOMIC_RELAXED);
+            return;
+        case BW2_OVERFLOW_KEEP_LATEST_PER_URI:
+            if (_bw2_msgqueueReplace(q, msg, urihash)) {
+                __atomic_fetch_add(&q->replaced, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            /* No older message for this URI is queued, so make room by
+             * dropping the oldest one.
+             */
+            /* Fall through */
+        case BW2_OVERFLOW_DROP_OLDEST:
+            oldest = _bw2_msgqueueTake(q);
+            if (oldest != NULL) {
+                bw2_simpleMessageFree(oldest);
+                __atomic_fetch_add(&q->droppedOldest, 1, __ATOMIC_RELAXED);
+            }
+            break;
+        default:
+            _bw2_msgqueuePark(q, &q->producerWaiting, &q->nonfull, _bw2_msgqueueHasRoom, 0);
+            break;
+        }
+    }
+}
+
+void bw2_msgqueueClose(struct bw2_msgqueue* q, int error) {
+    q->error = error;
+    __atomic_store_n(&q->closed, true, __ATOMIC_RELEASE);
+
+    bw2_mutexLock(&q->lock);
+    bw2_condSignal(&q->nonempty);
+    bw2_mutexUnlock(&q->lock);
+}
+
+int bw2_msgqueuePop(struct bw2_msgqueue* q, int64_t timeout, struct bw2_simpleMessage** msg) {
+    uint64_t deadline = 0;
+    if (timeout > 0) {
+        deadline = bw2_getTimeMicros() + (((uint64_t) timeout) * 1000);
+    }
+
+    while (true) {
+        /* Check CLOSED first, so that a message pushed just before the queue
+         * was closed is not missed.
+         */
+        bool closed = __atomic_load_n(&q->closed, __ATOMIC_ACQUIRE);
+
+        struct bw2_simpleMessage* m = _bw2_msgqueueTake(q);
+        if (m != NULL) {
+            __atomic_fetch_add(&q->delivered, 1, __ATOMIC_RELAXED);
+            _bw2_msgqueueWake(q, &q->producerWaiting, &q->nonfull);
+            *msg = m;
+            return 0;
+        }
+
+        if (closed) {
+            return (q->error != 0) ? q->error : BW2_ERROR_SUBSCRIPTION_ENDED;
+        } else if (timeout == 0 || (timeout > 0 && bw2_getTimeMicros() >= deadline)) {
+            return BW2_ERROR_TIMEOUT;
+        }
+
+        _bw2_msgqueuePark(q, &q->consumerWaiting, &q->nonempty, _bw2_msgqueueHasMessage, deadline);
+    }
+}
+
+size_t bw2_msgqueueDrain(struct bw2_msgqueue* q, struct bw2_simpleMessage** msgs, size_t max) {
+    size_t count;
+    for (count = 0; count != max; count++) {
+        msgs[count] = _bw2_msgqueueTake(q);
+        if (msgs[count] == NULL) {
+            break;
+        }
+    }
+
+    if (count != 0) {
+        __atomic_fetch_add(&q->delivered, count, __ATOMIC_RELAXED);
+        _bw2_msgqueueWake(q, &q->producerWaiting, &q->nonfull);
+    }
+    return count;
+}
+
+void bw2_msgqueueStats(struct bw2_msgqueue* q, struct bw2_msgqueueStats* stats) {
+    stats->enqueued = __atomic_load_n(&q->enqueued, __ATOMIC_RELAXED);
+    stats->delivered = __atomic_load_n(&q->delivered, __ATOMIC_RELAXED);
+    stats->droppedOldest = __atomic_load_n(&q->droppedOldest, __ATOMIC_RELAXED);
+    stats->droppedNewest = __atomic_load_n(&q->droppedNewest, __ATOMIC_RELAXED);
+    stats->replaced = __atomic_load_n(&q->replaced, __ATOMIC_RELAXED);
+    stats->copyFailed = __atomic_load_n(&q->copyFailed, __ATOMIC_RELAXED);
+
+    /* HEAD is read first, since TAIL is never behind it. Either may still have
+     * moved on meanwhile, so the depth is clamped to what the queue can hold.
+     */
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    size_t depth = tail - head;
+    stats->depth = (depth > q->capacity) ? q->capacity : depth;
+}
+
+void bw2_msgqueueDestroy(struct bw2_msgqueue* q) {
+    struct bw2_simpleMessage* m;
+    while ((m = _bw2_msgqueueTake(q)) != NULL) {
+        bw2_simpleMessageFree(m);
+    }
+
+    bw2_condDestroy(&q->nonfull);
+    bw2_condDestroy(&q->nonempty);
+    bw2_mutexDestroy(&q->lock);
+}
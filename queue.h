@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BW2_QUEUE_H
+#define BW2_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "osutil.h"
+
+/* What to do when a message arrives and the queue is full. */
+#define BW2_OVERFLOW_BLOCK 0
+#define BW2_OVERFLOW_DROP_OLDEST 1
+#define BW2_OVERFLOW_DROP_NEWEST 2
+#define BW2_OVERFLOW_KEEP_LATEST_PER_URI 3
+
+struct bw2_simpleMessage;
+
+struct bw2_msgqueueSlot {
+    struct bw2_simpleMessage* msg;
+
+    /* Written only by the producer, so it can be read without racing with the
+     * consumer freeing MSG.
+     */
+    uint64_t urihash;
+};
+
+struct bw2_msgqueueStats {
+    size_t enqueued;
+    size_t delivered;
+    size_t droppedOldest;
+    size_t droppedNewest;
+    size_t replaced;
+    size_t copyFailed;
+    size_t depth;
+};
+
+/* A bounded, lock-free queue of messages with one producer (the BOSSWAVE
+ * thread) and one consumer. Indices only ever increase; whoever advances HEAD
+ * past a slot owns the message in it. The lock and condition variables are
+ * used only to put the producer or consumer to sleep.
+ */
+struct bw2_msgqueue {
+    struct bw2_msgqueueSlot* slots;
+    size_t capacity;
+    int policy;
+
+    size_t head;
+    size_t tail;
+
+    bool closed;
+    int error;
+
+    bool consumerWaiting;
+    bool producerWaiting;
+    struct bw2_mutex lock;
+    struct bw2_cond nonempty;
+    struct bw2_cond nonfull;
+
+    size_t enqueued;
+    size_t delivered;
+    size_t droppedOldest;
+    size_t droppedNewest;
+    size_t replaced;
+
+    /* Messages that never reached the queue, because they could not be
+     * copied. Kept apart from the overflow counters, since the queue was not
+     * necessarily full.
+     */
+    size_t copyFailed;
+};
+
+int bw2_msgqueueInit(struct bw2_msgqueue* q, struct bw2_msgqueueSlot* slots, size_t capacity, int policy);
+
+/* Called by the producer. The queue takes ownership of MSG, which must have
+ * been created with bw2_simpleMessageCopy.
+ */
+void bw2_msgqueuePush(struct bw2_msgqueue* q, struct bw2_simpleMessage* msg);
+
+/* Called by the producer once no more messages will be pushed. */
+void bw2_msgqueueClose(struct bw2_msgqueue* q, int error);
+
+/* Called by the consumer. TIMEOUT is in milliseconds; if it is negative, this
+ * waits for as long as it takes. Returns 0 and stores a message that the caller
+ * now owns into MSG, or returns BW2_ERROR_TIMEOUT, or, once the queue is closed
+ * and empty, returns the error it was closed with or
+ * BW2_ERROR_SUBSCRIPTION_ENDED.
+ */
+int bw2_msgqueuePop(struct bw2_msgqueue* q, int64_t timeout, struct bw2_simpleMessage** msg);
+
+/* Called by the consumer. Takes up to MAX messages without waiting, and
+ * returns how many were stored into MSGS.
+ */
+size_t bw2_msgqueueDrain(struct bw2_msgqueue* q, struct bw2_simpleMessage** msgs, size_t max);
+
+void bw2_msgqueueStats(struct bw2_msgqueue* q, struct bw2_msgqueueStats* stats);
+
+/* Frees any messages still in the queue. */
+void bw2_msgqueueDestroy(struct bw2_msgqueue* q);
+
+#endif
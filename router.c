@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "api.h"
+#include "errors.h"
+#include "osutil.h"
+#include "router.h"
+#include "utils.h"
+
+/* Finds the end of the segment starting at START. A URI of LEN bytes has its
+ * segments separated by '/'; position LEN + 1 means that there are no more
+ * segments.
+ */
+size_t _bw2_router_segment_end(const char* uri, size_t len, size_t start) {
+    size_t end = start;
+    while (end < len && uri[end] != '/') {
+        end++;
+    }
+    return end;
+}
+
+bool _bw2_router_is_wildcard(const char* segment, size_t len, char wildcard) {
+    return len == 1 && segment[0] == wildcard;
+}
+
+struct bw2_routeNode* _bw2_router_child(struct bw2_routeNode* node, const char* segment, size_t len, uint64_t hash) {
+    struct bw2_routeNode* child;
+    if (node->numbuckets == 0) {
+        return NULL;
+    }
+    for (child = node->buckets[hash & (node->numbuckets - 1)]; child != NULL; child = child->sibling) {
+        if (child->hash == hash && child->segmentlen == len && memcmp(child->segment, segment, len) == 0) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+int _bw2_router_insert_child(struct bw2_routeNode* node, struct bw2_routeNode* child) {
+    size_t i;
+    if (node->numchildren >= node->numbuckets) {
+        size_t newnumbuckets = (node->numbuckets == 0) ? BW2_ROUTER_INITIAL_BUCKETS : (node->numbuckets << 1);
+        struct bw2_routeNode** newbuckets = calloc(newnumbuckets, sizeof(struct bw2_routeNode*));
+        if (newbuckets == NULL) {
+            return BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+        }
+        for (i = 0; i < node->numbuckets; i++) {
+            struct bw2_routeNode* curr = node->buckets[i];
+            while (curr != NULL) {
+                struct bw2_routeNode* next = curr->sibling;
+                curr->sibling = newbuckets[curr->hash & (newnumbuckets - 1)];
+                newbuckets[curr->hash & (newnumbuckets - 1)] = curr;
+                curr = next;
+            }
+        }
+        free(node->buckets);
+        node->buckets = newbuckets;
+        node->numbuckets = newnumbuckets;
+    }
+
+    i = child->hash & (node->numbuckets - 1);
+    child->sibling = node->buckets[i];
+    node->buckets[i] = child;
+    node->numchildren++;
+    return 0;
+}
+
+void _bw2_router_unlink_child(struct bw2_routeNode* node, struct bw2_routeNode* child) {
+    struct bw2_routeNode** currptr;
+    if (node->plus == child) {
+        node->plus = NULL;
+        return;
+    }
+    if (node->star == child) {
+        node->star = NULL;
+        return;
+    }
+    for (currptr = &node->buckets[child->hash & (node->numbuckets - 1)]; *currptr != NULL; currptr = &(*currptr)->sibling) {
+        if (*currptr == child) {
+            *currptr = child->sibling;
+            node->numchildren--;
+            return;
+        }
+    }
+}
+
+struct bw2_routeNode* _bw2_router_new_node(struct bw2_routeNode* parent, const char* segment, size_t len, uint64_t hash) {
+    struct bw2_routeNode* node = malloc(sizeof(struct bw2_routeNode) + len);
+    if (node == NULL) {
+        return NULL;
+    }
+    memset(node, 0x00, sizeof(struct bw2_routeNode));
+    node->parent = parent;
+    node->segment = (char*) (node + 1);
+    node->segmentlen = len;
+    node->hash = hash;
+    memcpy(node->segment, segment, len);
+    return node;
+}
+
+void _bw2_router_free_node(struct bw2_routeNode* node) {
+    free(node->buckets);
+    free(node);
+}
+
+/* Frees NODE and its ancestors, as long as nothing is registered under them. */
+void _bw2_router_prune(struct bw2_router* router, struct bw2_routeNode* node) {
+    while (node != &router->root && node->handlers == NULL && node->numchildren == 0 && node->plus == NULL && node->star == NULL) {
+        struct bw2_routeNode* parent = node->parent;
+        _bw2_router_unlink_child(parent, node);
+        _bw2_router_free_node(node);
+        node = parent;
+    }
+}
+
+/* Frees every node below NODE, without freeing NODE itself. */
+void _bw2_router_free_subtree(struct bw2_routeNode* node) {
+    size_t i;
+    for (i = 0; i < node->numbuckets; i++) {
+        struct bw2_routeNode* curr = node->buckets[i];
+        while (curr != NULL) {
+            struct bw2_routeNode* next = curr->sibling;
+            _bw2_router_free_subtree(curr);
+            _bw2_router_free_node(curr);
+            curr = next;
+        }
+    }
+    if (node->plus != NULL) {
+        _bw2_router_free_subtree(node->plus);
+        _bw2_router_free_node(node->plus);
+    }
+    if (node->star != NULL) {
+        _bw2_router_free_subtree(node->star);
+        _bw2_router_free_node(node->star);
+    }
+}
+
+int bw2_routerInit(struct bw2_router* router) {
+    memset(&router->root, 0x00, sizeof(struct bw2_routeNode));
+    router->generation = 0;
+    if (bw2_mutexInit(&router->lock) != 0) {
+        return BW2_ERROR_SYNCHRONIZATION;
+    }
+    return 0;
+}
+
+int bw2_routerAdd(struct bw2_router* router, const char* pattern, struct bw2_routeHandler* handler) {
+    size_t len = strlen(pattern);
+    size_t start = (len == 0) ? 1 : 0;
+    struct bw2_routeNode* node = &router->root;
+    int rv = 0;
+
+    bw2_mutexLock(&router->lock);
+
+    while (start <= len) {
+        size_t end = _bw2_router_segment_end(pattern, len, start);
+        const char* segment = &pattern[start];
+        size_t segmentlen = end - start;
+        struct bw2_routeNode** wildcard = NULL;
+        struct bw2_routeNode* child;
+        uint64_t hash = 0;
+
+        if (_bw2_router_is_wildcard(segment, segmentlen, '+')) {
+            wildcard = &node->plus;
+            child = node->plus;
+        } else if (_bw2_router_is_wildcard(segment, segmentlen, '*')) {
+            wildcard = &node->star;
+            child = node->star;
+        } else {
+            hash = bw2_hash_bytes(segment, segmentlen);
+            child = _bw2_router_child(node, segment, segmentlen, hash);
+        }
+
+        if (child == NULL) {
+            child = _bw2_router_new_node(node, segment, segmentlen, hash);
+            if (child == NULL) {
+                rv = BW2_ERROR_SYSTEM_RESOURCE_UNAVAILABLE;
+                goto error;
+            }
+            if (wildcard != NULL) {
+                *wildcard = child;
+            } else if ((rv = _bw2_router_insert_child(node, child)) != 0) {
+                _bw2_router_free_node(child);
+                goto error;
+            }
+        }
+
+        node = child;
+        start = end + 1;
+    }
+
+    handler->node = node;
+    handler->next = node->handlers;
+    node->handlers = handler;
+
+    bw2_mutexUnlock(&router->lock);
+    return 0;
+
+error:
+    /* Don't leave behind nodes created for this pattern. */
+    _bw2_router_prune(router, node);
+    bw2_mutexUnlock(&router->lock);
+    return rv;
+}
+
+int bw2_routerRemove(struct bw2_router* router, struct bw2_routeHandler* handler) {
+    struct bw2_routeHandler** currptr;
+
+    bw2_mutexLock(&router->lock);
+
+    /* A removed handler's node may already have been pruned, so it is
+     * forgotten on removal rather than walked again.
+     */
+    struct bw2_routeNode* node = handler->node;
+    if (node == NULL) {
+        bw2_mutexUnlock(&router->lock);
+        return BW2_ERROR_BAD_ARG;
+    }
+
+    for (currptr = &node->handlers; *currptr != NULL; currptr = &(*currptr)->next) {
+        if (*currptr == handler) {
+            *currptr = handler->next;
+            break;
+        }
+    }
+    handler->node = NULL;
+    handler->next = NULL;
+    _bw2_router_prune(router, node);
+
+    bw2_mutexUnlock(&router->lock);
+    return 0;
+}
+
+/* Delivers SM to the handlers of every pattern under NODE that matches the
+ * segments of the URI from position START onward. A pattern with several "*"
+ * segments may match the same URI in more than one way, so each node records
+ * the generation of the last message it was given.
+ */
+size_t _bw2_router_match(struct bw2_router* router, struct bw2_routeNode* node, struct bw2_simpleMessage* sm, size_t start) {
+    const char* uri = sm->uri;
+    size_t len = sm->uri_len;
+    size_t delivered = 0;
+    struct bw2_routeNode* child;
+    size_t pos;
+
+    if (start > len) {
+        if (node->delivered != router->generation) {
+            struct bw2_routeHandler* handler;
+            node->delivered = router->generation;
+            for (handler = node->handlers; handler != NULL; handler = handler->next) {
+                handler->on_message(sm, handler->ctx);
+                delivered++;
+            }
+        }
+    } else {
+        size_t end = _bw2_router_segment_end(uri, len, start);
+        child = _bw2_router_child(node, &uri[start], end - start, bw2_hash_bytes(&uri[start], end - start));
+        if (child != NULL) {
+            delivered += _bw2_router_match(router, child, sm, end + 1);
+        }
+        if (node->plus != NULL) {
+            delivered += _bw2_router_match(router, node->plus, sm, end + 1);
+        }
+    }
+
+    /* "*" matches zero or more segments. */
+    if (node->star != NULL) {
+        pos = start;
+        while (true) {
+            delivered += _bw2_router_match(router, node->star, sm, pos);
+            if (pos > len) {
+                break;
+            }
+            pos = _bw2_router_segment_end(uri, len, pos) + 1;
+        }
+    }
+
+    return delivered;
+}
+
+size_t bw2_routerDispatch(struct bw2_router* router, struct bw2_simpleMessage* sm) {
+    size_t delivered = 0;
+    if (sm->uri == NULL) {
+        return 0;
+    }
+
+    bw2_mutexLock(&router->lock);
+    router->generation++;
+    delivered = _bw2_router_match(router, &router->root, sm, (sm->uri_len == 0) ? 1 : 0);
+    if (delivered == 0 && router->on_unmatched != NULL) {
+        router->on_unmatched(sm, router->ctx);
+    }
+    bw2_mutexUnlock(&router->lock);
+
+    return delivered;
+}
+
+bool _bw2_router_on_message(struct bw2_simpleMessage* sm, bool final, int error, union bw2_userctx ctx) {
+    struct bw2_router* router = ctx.ptr;
+    if (sm != NULL) {
+        bw2_routerDispatch(router, sm);
+    }
+    if (final && router->on_end != NULL) {
+        router->on_end(error, router->ctx);
+    }
+    return false;
+}
+
+int bw2_routerSubscribe(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_router* router, struct bw2_subscriptionHandle* handle) {
+    router->smctx.on_message = _bw2_router_on_message;
+    router->smctx.ctx.ptr = router;
+    return bw2_subscribe(client, p, &router->smctx, handle);
+}
+
+void bw2_routerDestroy(struct bw2_router* router) {
+    _bw2_router_free_subtree(&router->root);
+    free(router->root.buckets);
+    memset(&router->root, 0x00, sizeof(struct bw2_routeNode));
+    bw2_mutexDestroy(&router->lock);
+}
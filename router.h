@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BW2_ROUTER_H
+#define BW2_ROUTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "objects.h"
+#include "osutil.h"
+
+/* Number of hash buckets a node's literal children start with. */
+#define BW2_ROUTER_INITIAL_BUCKETS 4
+
+struct bw2_routeNode;
+
+struct bw2_routeHandler {
+    /* The user sets these elements. */
+    void (*on_message)(struct bw2_simpleMessage* sm, union bw2_userctx ctx);
+    union bw2_userctx ctx;
+
+    /* The remaining elements are used internally by the router. */
+    struct bw2_routeNode* node;
+    struct bw2_routeHandler* next;
+};
+
+/* One segment of a pattern. Literal children are kept in a chained hash table
+ * keyed by segment, so that looking up the next segment of a URI does not
+ * depend on how many patterns branch off at this point; the "+" and "*"
+ * children are kept separately.
+ */
+struct bw2_routeNode {
+    struct bw2_routeNode* parent;
+    struct bw2_routeNode* sibling;
+    char* segment;
+    size_t segmentlen;
+    uint64_t hash;
+
+    struct bw2_routeNode** buckets;
+    size_t numbuckets;
+    size_t numchildren;
+    struct bw2_routeNode* plus;
+    struct bw2_routeNode* star;
+
+    struct bw2_routeHandler* handlers;
+    uint64_t delivered; // Generation of the last message delivered to HANDLERS
+};
+
+struct bw2_router {
+    /* The user sets these elements. Both functions are optional. */
+    void (*on_unmatched)(struct bw2_simpleMessage* sm, union bw2_userctx ctx);
+    void (*on_end)(int error, union bw2_userctx ctx);
+    union bw2_userctx ctx;
+
+    /* The remaining elements are used internally by the router. */
+    struct bw2_mutex lock;
+    struct bw2_routeNode root;
+    uint64_t generation;
+    struct bw2_simplemsg_ctx smctx;
+};
+
+int bw2_routerInit(struct bw2_router* router);
+int bw2_routerAdd(struct bw2_router* router, const char* pattern, struct bw2_routeHandler* handler);
+int bw2_routerRemove(struct bw2_router* router, struct bw2_routeHandler* handler);
+size_t bw2_routerDispatch(struct bw2_router* router, struct bw2_simpleMessage* sm);
+int bw2_routerSubscribe(struct bw2_client* client, struct bw2_subscribeParams* p, struct bw2_router* router, struct bw2_subscriptionHandle* handle);
+void bw2_routerDestroy(struct bw2_router* router);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define BW2_TIMERWHEEL_MASK (BW2_TIMERWHEEL_SLOTS - 1)
+
+/* The latest expiry time the wheel can hold, relative to its current time. */
+#define BW2_TIMERWHEEL_SPAN ((((uint64_t) 1) << (BW2_TIMERWHEEL_BITS * BW2_TIMERWHEEL_LEVELS)) - 1)
+
+void bw2_timerWheelInit(struct bw2_timerWheel* wheel, uint64_t now) {
+    memset(wheel, 0x00, sizeof(struct bw2_timerWheel));
+    wheel->now = now;
+}
+
+void bw2_timerInit(struct bw2_timer* timer, void (*on_expire)(struct bw2_timer*, void*), void* ctx) {
+    memset(timer, 0x00, sizeof(struct bw2_timer));
+    timer->on_expire = on_expire;
+    timer->ctx = ctx;
+}
+
+bool bw2_timerArmed(struct bw2_timer* timer) {
+    return timer->pprev != NULL;
+}
+
+void _bw2_timer_link(struct bw2_timer** head, struct bw2_timer* timer) {
+    timer->next = *head;
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+}
+
+void _bw2_timer_unlink(struct bw2_timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Puts TIMER into the slot for its expiry time. Timers that are already due
+ * go into the slot for the next tick.
+ */
+void _bw2_timer_place(struct bw2_timerWheel* wheel, struct bw2_timer* timer) {
+    uint64_t when = timer->expires;
+    uint64_t delta;
+    int level;
+
+    if (when <= wheel->now) {
+        when = wheel->now + 1;
+    }
+    delta = when - wheel->now;
+    if (delta > BW2_TIMERWHEEL_SPAN) {
+        /* Too far out; it will be placed again when it gets closer. */
+        when = wheel->now + BW2_TIMERWHEEL_SPAN;
+        delta = BW2_TIMERWHEEL_SPAN;
+    }
+
+    for (level = 0; level < BW2_TIMERWHEEL_LEVELS - 1; level++) {
+        if (delta < (((uint64_t) 1) << (BW2_TIMERWHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    timer->level = level;
+    wheel->count[level]++;
+    _bw2_timer_link(&wheel->slots[level][(when >> (BW2_TIMERWHEEL_BITS * level)) & BW2_TIMERWHEEL_MASK], timer);
+}
+
+void bw2_timerAdd(struct bw2_timerWheel* wheel, struct bw2_timer* timer, uint64_t expires) {
+    if (bw2_timerArmed(timer)) {
+        bw2_timerCancel(timer);
+    }
+    timer->wheel = wheel;
+    timer->expires = expires;
+    _bw2_timer_place(wheel, timer);
+}
+
+void bw2_timerCancel(struct bw2_timer* timer) {
+    if (bw2_timerArmed(timer)) {
+        timer->wheel->count[timer->level]--;
+        _bw2_timer_unlink(timer);
+    }
+}
+
+/* Takes every timer out of a slot, and either expires it or places it again
+ * (on a lower level, once the wheel has advanced far enough). The slot is first
+ * moved into a local list, so that the functions called for expired timers can
+ * cancel any of the others.
+ */
+void _bw2_timer_run_slot(struct bw2_timerWheel* wheel, int level, size_t index) {
+    struct bw2_timer* pending = NULL;
+    struct bw2_timer* timer;
+
+    pending = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    if (pending != NULL) {
+        pending->pprev = &pending;
+    }
+
+    while ((timer = pending) != NULL) {
+        _bw2_timer_unlink(timer);
+        wheel->count[level]--;
+        if (timer->expires <= wheel->now) {
+            timer->on_expire(timer, timer->ctx);
+        } else {
+            _bw2_timer_place(wheel, timer);
+        }
+    }
+}
+
+bool _bw2_timer_empty(struct bw2_timerWheel* wheel) {
+    int level;
+    for (level = 0; level < BW2_TIMERWHEEL_LEVELS; level++) {
+        if (wheel->count[level] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bw2_timerWheelAdvance(struct bw2_timerWheel* wheel, uint64_t now) {
+    while (wheel->now < now) {
+        int level;
+
+        if (_bw2_timer_empty(wheel)) {
+            wheel->now = now;
+            return;
+        }
+
+        /* If the lowest levels are empty, nothing happens until the first
+         * nonempty level moves on to its next slot, so skip ahead to it.
+         */
+        for (level = 0; wheel->count[level] == 0; level++);
+        if (level != 0) {
+            uint64_t turn = (wheel->now | ((((uint64_t) 1) << (BW2_TIMERWHEEL_BITS * level)) - 1)) + 1;
+            if (turn > now) {
+                wheel->now = now;
+                return;
+            }
+            wheel->now = turn;
+        } else {
+            wheel->now++;
+        }
+
+        /* When a level completes a turn, move the timers in the next slot of
+         * the level above it down.
+         */
+        for (level = 1; level < BW2_TIMERWHEEL_LEVELS; level++) {
+            if (((wheel->now >> (BW2_TIMERWHEEL_BITS * (level - 1))) & BW2_TIMERWHEEL_MASK) != 0) {
+                break;
+            }
+        }
+        while (--level > 0) {
+            _bw2_timer_run_slot(wheel, level, (wheel->now >> (BW2_TIMERWHEEL_BITS * level)) & BW2_TIMERWHEEL_MASK);
+        }
+
+        _bw2_timer_run_slot(wheel, 0, wheel->now & BW2_TIMERWHEEL_MASK);
+    }
+}
+
+bool bw2_timerWheelNext(struct bw2_timerWheel* wheel, uint64_t* when) {
+    uint64_t next = 0;
+    bool found = false;
+    int level;
+
+    /* Timers on level 0 are in the slot for their exact expiry time. */
+    if (wheel->count[0] != 0) {
+        uint64_t tick;
+        for (tick = wheel->now + 1; tick <= wheel->now + BW2_TIMERWHEEL_SLOTS; tick++) {
+            if (wheel->slots[0][tick & BW2_TIMERWHEEL_MASK] != NULL) {
+                next = tick;
+                found = true;
+                break;
+            }
+        }
+    }
+
+    /* Timers on higher levels cannot expire before they move down, when the
+     * level below completes its turn.
+     */
+    for (level = 1; level < BW2_TIMERWHEEL_LEVELS; level++) {
+        if (wheel->count[level] != 0) {
+            uint64_t turn = (wheel->now | ((((uint64_t) 1) << (BW2_TIMERWHEEL_BITS * level)) - 1)) + 1;
+            if (!found || turn < next) {
+                next = turn;
+                found = true;
+            }
+            break;
+        }
+    }
+
+    if (found) {
+        *when = next;
+    }
+    return found;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2017 Sam Kumar <samkumar@berkeley.edu>
+ * Copyright (c) 2017 Michael P Andersen <m.andersen@cs.berkeley.edu>
+ * Copyright (c) 2017 University of California, Berkeley
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the University of California, Berkeley nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BW2_TIMER_H
+#define BW2_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The wheel has BW2_TIMERWHEEL_LEVELS levels of BW2_TIMERWHEEL_SLOTS slots.
+ * Each slot on level 0 spans one tick (one millisecond, as used by the
+ * client), and each slot on a higher level spans a whole turn of the level
+ * below it. A timer goes on the lowest level that can hold its expiry time,
+ * and moves down a level each time the wheel below it completes a turn.
+ */
+#define BW2_TIMERWHEEL_BITS 6
+#define BW2_TIMERWHEEL_SLOTS (1 << BW2_TIMERWHEEL_BITS)
+#define BW2_TIMERWHEEL_LEVELS 4
+
+struct bw2_timerWheel;
+
+struct bw2_timer {
+    void (*on_expire)(struct bw2_timer* timer, void* ctx);
+    void* ctx;
+
+    /* Used internally by the timer wheel. PPREV is NULL unless the timer is
+     * armed.
+     */
+    struct bw2_timer* next;
+    struct bw2_timer** pprev;
+    struct bw2_timerWheel* wheel;
+    uint64_t expires;
+    int level;
+};
+
+struct bw2_timerWheel {
+    uint64_t now;
+    size_t count[BW2_TIMERWHEEL_LEVELS];
+    struct bw2_timer* slots[BW2_TIMERWHEEL_LEVELS][BW2_TIMERWHEEL_SLOTS];
+};
+
+void bw2_timerWheelInit(struct bw2_timerWheel* wheel, uint64_t now);
+
+/* Expires every timer whose expiry time is at or before NOW, calling its
+ * function. The functions may add and cancel timers.
+ */
+void bw2_timerWheelAdvance(struct bw2_timerWheel* wheel, uint64_t now);
+
+/* Stores into WHEN a time, no later than the earliest expiry time of any
+ * timer, at which bw2_timerWheelAdvance should next be called. Returns false,
+ * without storing anything, if no timer is armed.
+ */
+bool bw2_timerWheelNext(struct bw2_timerWheel* wheel, uint64_t* when);
+
+void bw2_timerInit(struct bw2_timer* timer, void (*on_expire)(struct bw2_timer*, void*), void* ctx);
+void bw2_timerAdd(struct bw2_timerWheel* wheel, struct bw2_timer* timer, uint64_t expires);
+void bw2_timerCancel(struct bw2_timer* timer);
+bool bw2_timerArmed(struct bw2_timer* timer);
+
+#endif
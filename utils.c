@@ -54,14 +54,39 @@ int bw2_logf(char* format, ...) {
     }
 }
 
-int bw2_read_until_char(char* arr, size_t maxlen, char until, int fd, size_t* bytesread) {
+void bw2_instreamInitFd(struct bw2_instream* in, int fd) {
+    in->fd = fd;
+    in->buf = NULL;
+    in->buflen = 0;
+    in->bufpos = 0;
+}
+
+void bw2_instreamInitBuf(struct bw2_instream* in, char* buf, size_t buflen) {
+    in->fd = -1;
+    in->buf = buf;
+    in->buflen = buflen;
+    in->bufpos = 0;
+}
+
+ssize_t bw2_instreamRecv(struct bw2_instream* in, char* arr, size_t len) {
+    if (in->buf == NULL) {
+        return recv(in->fd, arr, len, 0);
+    }
+
+    len = BW2_MIN(len, in->buflen - in->bufpos);
+    memcpy(arr, &in->buf[in->bufpos], len);
+    in->bufpos += len;
+    return (ssize_t) len;
+}
+
+int bw2_read_until_char(char* arr, size_t maxlen, char until, struct bw2_instream* in, size_t* bytesread) {
     char c;
     if (bytesread != NULL) {
         *bytesread = 0;
     }
 
     while (maxlen != 0) {
-        int rv = recv(fd, &c, 1, 0);
+        int rv = bw2_instreamRecv(in, &c, 1);
         if (rv == 0) {
             return BW2_UNTIL_EOF_REACHED;
         } else if (rv == -1) {
@@ -82,32 +107,34 @@ int bw2_read_until_char(char* arr, size_t maxlen, char until, int fd, size_t* by
     return BW2_UNTIL_ARRAY_FULL;
 }
 
-int bw2_drop_until_char(char until, int fd, size_t* bytesread) {
+int bw2_drop_until_char(char until, struct bw2_instream* in, size_t* bytesread) {
     char c;
     if (bytesread != NULL) {
         *bytesread = 0;
     }
 
     do {
-        int rv = recv(fd, &c, 1, 0);
+        int rv = bw2_instreamRecv(in, &c, 1);
         if (rv == 0) {
             return BW2_UNTIL_EOF_REACHED;
         } else if (rv == -1) {
             return BW2_UNTIL_ERROR;
         }
-        (*bytesread)++;
+        if (bytesread != NULL) {
+            (*bytesread)++;
+        }
     } while (c != until);
 
     return BW2_UNTIL_CHAR_FOUND;
 }
 
-int bw2_read_until_full(char* arr, size_t len, int fd, size_t* bytesread) {
+int bw2_read_until_full(char* arr, size_t len, struct bw2_instream* in, size_t* bytesread) {
     if (bytesread != NULL) {
         *bytesread = 0;
     }
 
     while (len != 0) {
-        ssize_t rv = recv(fd, arr, len, 0);
+        ssize_t rv = bw2_instreamRecv(in, arr, len);
         if (rv == 0) {
             return BW2_UNTIL_EOF_REACHED;
         } else if (rv == -1) {
@@ -124,7 +151,7 @@ int bw2_read_until_full(char* arr, size_t len, int fd, size_t* bytesread) {
 }
 
 
-int bw2_drop_full_array(size_t len, int fd, size_t* bytesread) {
+int bw2_drop_full_array(size_t len, struct bw2_instream* in, size_t* bytesread) {
     char c;
 
     if (bytesread != NULL) {
@@ -132,7 +159,7 @@ int bw2_drop_full_array(size_t len, int fd, size_t* bytesread) {
     }
 
     while (len != 0) {
-        ssize_t rv = recv(fd, &c, 1, 0);
+        ssize_t rv = bw2_instreamRecv(in, &c, 1);
         if (rv == 0) {
             return BW2_UNTIL_EOF_REACHED;
         } else if (rv == -1) {
@@ -182,6 +209,95 @@ int bw2_ponum_from_dot_form(const char* dotform, uint32_t* ponum) {
     return 0;
 }
 
+uint64_t bw2_hash_bytes(const char* bytes, size_t len) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    size_t i;
+    for (i = 0; i != len; i++) {
+        hash ^= (uint8_t) bytes[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+void bw2_arenaInit(struct bw2_arena* arena, char* buf, size_t size) {
+    /* Start at the first aligned byte of BUF. */
+    size_t skip = (BW2_ARENA_ALIGNMENT - ((uintptr_t) buf % BW2_ARENA_ALIGNMENT)) % BW2_ARENA_ALIGNMENT;
+    skip = BW2_MIN(skip, size);
+    arena->buf = buf + skip;
+    arena->size = size - skip;
+    arena->used = 0;
+}
+
+void* bw2_arenaAlloc(struct bw2_arena* arena, size_t size) {
+    size_t start = (arena->used + BW2_ARENA_ALIGNMENT - 1) & ~((size_t) BW2_ARENA_ALIGNMENT - 1);
+    if (start > arena->size || arena->size - start < size) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return &arena->buf[start];
+}
+
+size_t bw2_arenaMark(struct bw2_arena* arena) {
+    return arena->used;
+}
+
+void bw2_arenaRewind(struct bw2_arena* arena, size_t mark) {
+    arena->used = mark;
+}
+
+void bw2_arenaReset(struct bw2_arena* arena) {
+    arena->used = 0;
+}
+
+void _bw2_allocatorCount(uint64_t* stat, uint64_t delta) {
+    __atomic_fetch_add(stat, delta, __ATOMIC_RELAXED);
+}
+
+void* bw2_allocatorAlloc(struct bw2_allocator* allocator, int site, size_t size) {
+    if (allocator == NULL) {
+        return malloc(size);
+    }
+
+    void* ptr = (allocator->alloc == NULL) ? malloc(size) : allocator->alloc(size, allocator->ctx);
+
+    struct bw2_allocSiteStats* stats = &allocator->stats.sites[site];
+    if (ptr == NULL) {
+        _bw2_allocatorCount(&stats->failures, 1);
+    } else {
+        _bw2_allocatorCount(&stats->allocs, 1);
+        _bw2_allocatorCount(&stats->bytes, size);
+    }
+    return ptr;
+}
+
+void bw2_allocatorFree(struct bw2_allocator* allocator, int site, void* ptr) {
+    if (allocator == NULL) {
+        free(ptr);
+        return;
+    }
+    if (ptr == NULL) {
+        return;
+    }
+
+    _bw2_allocatorCount(&allocator->stats.sites[site].frees, 1);
+    if (allocator->alloc == NULL) {
+        free(ptr);
+    } else {
+        allocator->free(ptr, allocator->ctx);
+    }
+}
+
+void bw2_allocatorGetStats(struct bw2_allocator* allocator, struct bw2_allocStats* stats) {
+    size_t i;
+    for (i = 0; i != BW2_ALLOC_NUM_SITES; i++) {
+        struct bw2_allocSiteStats* from = &allocator->stats.sites[i];
+        stats->sites[i].allocs = __atomic_load_n(&from->allocs, __ATOMIC_RELAXED);
+        stats->sites[i].frees = __atomic_load_n(&from->frees, __ATOMIC_RELAXED);
+        stats->sites[i].bytes = __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+        stats->sites[i].failures = __atomic_load_n(&from->failures, __ATOMIC_RELAXED);
+    }
+}
+
 int bw2_write_full_array(char* arr, size_t len, int fd) {
     size_t written = 0;
     while (written != len) {
@@ -33,6 +33,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
 #include <time.h>
 
 #define BW2_MIN(X, Y) ((X) < (Y) ? (X) : (Y))
@@ -46,26 +47,115 @@ int bw2_logf(char* format, ...);
 #define BW2_UNTIL_CHAR_FOUND 0
 #define BW2_UNTIL_ERROR -1
 
-/* Reads from FD and into ARR, an array of length MAXLEN, up to the first
+/* An input stream is where the functions below get their bytes from. It is
+ * either a socket, or a buffer holding bytes that were already received from a
+ * socket. For a buffer, reaching the end of the buffer looks like EOF.
+ */
+struct bw2_instream {
+    int fd;
+
+    /* If BUF is not NULL, bytes are read from BUF instead of from FD. */
+    char* buf;
+    size_t buflen;
+    size_t bufpos;
+};
+
+void bw2_instreamInitFd(struct bw2_instream* in, int fd);
+void bw2_instreamInitBuf(struct bw2_instream* in, char* buf, size_t buflen);
+
+/* Same semantics as recv with no flags. */
+ssize_t bw2_instreamRecv(struct bw2_instream* in, char* arr, size_t len);
+
+/* Reads from IN and into ARR, an array of length MAXLEN, up to the first
  * occurrence of UNTIL.
  * The character UNTIL is not stored into ARR.
  * The status (one of the four #define'd values above) is returned.
- * The number of bytes read from FD, excluding the "UNTIL" character, is stored
+ * The number of bytes read from IN, excluding the "UNTIL" character, is stored
  * in BYTESREAD.
  */
-int bw2_read_until_char(char* arr, size_t maxlen, char until, int fd, size_t* bytesread);
+int bw2_read_until_char(char* arr, size_t maxlen, char until, struct bw2_instream* in, size_t* bytesread);
 
 /* Same as bw2_read_until_char, but throws away data instead of storing into an
  * array.
  */
-int bw2_drop_until_char(char until, int fd, size_t* bytesread);
+int bw2_drop_until_char(char until, struct bw2_instream* in, size_t* bytesread);
 
-int bw2_read_until_full(char* arr, size_t len, int fd, size_t* bytesread);
+int bw2_read_until_full(char* arr, size_t len, struct bw2_instream* in, size_t* bytesread);
 
-int bw2_drop_full_array(size_t len, int fd, size_t* bytesread);
+int bw2_drop_full_array(size_t len, struct bw2_instream* in, size_t* bytesread);
 
 int bw2_ponum_from_dot_form(const char* dotform, uint32_t* ponum);
 
+/* 64-bit FNV-1a hash, for hash tables keyed by strings such as URIs. */
+uint64_t bw2_hash_bytes(const char* bytes, size_t len);
+
+/* Blocks allocated from an arena are aligned to this many bytes. */
+#define BW2_ARENA_ALIGNMENT 8
+
+/* A bump allocator over a buffer provided by the user. Blocks are not freed
+ * one at a time; instead, the whole arena is reset at once, or rewound to a
+ * mark taken earlier.
+ */
+struct bw2_arena {
+    char* buf;
+    size_t size;
+    size_t used;
+};
+
+void bw2_arenaInit(struct bw2_arena* arena, char* buf, size_t size);
+
+/* Returns NULL if the arena does not have SIZE bytes left. */
+void* bw2_arenaAlloc(struct bw2_arena* arena, size_t size);
+size_t bw2_arenaMark(struct bw2_arena* arena);
+void bw2_arenaRewind(struct bw2_arena* arena, size_t mark);
+void bw2_arenaReset(struct bw2_arena* arena);
+
+/* The places where a client allocates memory, for which an allocator keeps
+ * separate counts.
+ */
+#define BW2_ALLOC_FRAME_OBJECT 0   /* Headers, POs, and ROs, without a frame heap */
+#define BW2_ALLOC_FRAME_REF 1      /* Retained frames */
+#define BW2_ALLOC_MESSAGE_COPY 2   /* bw2_simpleMessageCopy */
+#define BW2_ALLOC_MESSAGE_RETAIN 3 /* bw2_simpleMessageRetain */
+#define BW2_ALLOC_RXBUF 4          /* The receive buffer of bw2_processIncoming */
+#define BW2_ALLOC_DAEMON 5         /* Arguments of the BOSSWAVE thread */
+#define BW2_ALLOC_ENTITY 6         /* Entities kept for reconnecting */
+#define BW2_ALLOC_REPLAY 7         /* Subscriptions kept for reconnecting */
+#define BW2_ALLOC_SHARED_SUB 8     /* bw2_subscribeShared */
+#define BW2_ALLOC_BATCH 9          /* bw2_subscribeBatched and bw2_queryBatched */
+#define BW2_ALLOC_MULTI 10         /* bw2_queryMulti and bw2_listMulti */
+#define BW2_ALLOC_CHAIN_CACHE 11   /* Chains kept by bw2_buildChain */
+#define BW2_ALLOC_NUM_SITES 12
+
+struct bw2_allocSiteStats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;
+    uint64_t failures;
+};
+
+struct bw2_allocStats {
+    struct bw2_allocSiteStats sites[BW2_ALLOC_NUM_SITES];
+};
+
+/* Where memory is allocated. ALLOC and FREE behave like malloc and free, and
+ * are passed CTX; if ALLOC is NULL, malloc and free are used. They may be
+ * called from any thread. STATS counts the calls made from each site, and the
+ * bytes requested; it is updated atomically, and read with
+ * bw2_allocatorGetStats.
+ */
+struct bw2_allocator {
+    void* (*alloc)(size_t size, void* ctx);
+    void (*free)(void* ptr, void* ctx);
+    void* ctx;
+    struct bw2_allocStats stats;
+};
+
+/* ALLOCATOR may be NULL, to use malloc and free without counting. */
+void* bw2_allocatorAlloc(struct bw2_allocator* allocator, int site, size_t size);
+void bw2_allocatorFree(struct bw2_allocator* allocator, int site, void* ptr);
+void bw2_allocatorGetStats(struct bw2_allocator* allocator, struct bw2_allocStats* stats);
+
 
 /* The following functions do not use the above four error codes. */
 